@@ -0,0 +1,330 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Asynchronous submission/completion interface. Operations are queued per
+ *  vchan and direction, and the one at the head of each queue is retried
+ *  with the nonblocking calls of io.c whenever the event channel of its
+ *  vchan fires. The event channel fds of all the vchans are registered on
+ *  an epoll fd, which callers can poll for completions.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "libvchan.h"
+#include "libvchan_private.h"
+
+// event channels handled per epoll_wait()
+#define EVENT_BATCH 64
+
+#define DIR_READ 0
+#define DIR_WRITE 1
+
+struct aio_op {
+   struct libvchan_sqe sqe;
+   /* bytes moved so far by a VCHAN_AIO_WRITE */
+   size_t done;
+   struct aio_op *next;
+};
+
+struct vchan_aio_chan {
+   struct libvchan_aio *aio;
+   struct libvchan *ctrl;
+   /* pending operations, oldest first, per direction */
+   struct aio_op *head[2], *tail[2];
+   struct vchan_aio_chan *prev, *next;
+};
+
+struct libvchan_aio {
+   int epoll_fd;
+   /* readable while completions are waiting to be reaped */
+   int event_fd;
+   int signalled;
+   /* operations submitted and not yet reaped, at most entries */
+   unsigned int entries, inflight;
+   struct aio_op *ops, *free_ops;
+   /* completion ring, entries long, a power of two */
+   struct libvchan_cqe *cq;
+   unsigned int cq_head, cq_tail;
+   struct vchan_aio_chan *chans;
+};
+
+struct libvchan_aio *libvchan_aio_create(unsigned int entries)
+{
+   struct libvchan_aio *aio;
+   struct epoll_event ev;
+   unsigned int i, n = 1;
+
+   if (entries == 0)
+       return NULL;
+   while (n < entries)
+       n *= 2;
+   aio = calloc(1, sizeof(*aio));
+   if (!aio)
+       return NULL;
+   aio->entries = n;
+   aio->epoll_fd = aio->event_fd = -1;
+   aio->ops = calloc(n, sizeof(*aio->ops));
+   aio->cq = calloc(n, sizeof(*aio->cq));
+   if (!aio->ops || !aio->cq)
+       goto fail;
+   for (i = 0; i < n; i++) {
+       aio->ops[i].next = aio->free_ops;
+       aio->free_ops = &aio->ops[i];
+   }
+   aio->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (aio->epoll_fd < 0)
+       goto fail;
+   aio->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (aio->event_fd < 0)
+       goto fail;
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if (epoll_ctl(aio->epoll_fd, EPOLL_CTL_ADD, aio->event_fd, &ev))
+       goto fail;
+   return aio;
+ fail:
+   libvchan_aio_destroy(aio);
+   return NULL;
+}
+
+void libvchan_aio_destroy(struct libvchan_aio *aio)
+{
+   if (!aio)
+       return;
+   while (aio->chans)
+       vchan_aio_detach(aio->chans->ctrl);
+   if (aio->event_fd != -1)
+       close(aio->event_fd);
+   if (aio->epoll_fd != -1)
+       close(aio->epoll_fd);
+   free(aio->ops);
+   free(aio->cq);
+   free(aio);
+}
+
+int libvchan_aio_fd(struct libvchan_aio *aio)
+{
+   return aio->epoll_fd;
+}
+
+static void complete(struct libvchan_aio *aio, struct aio_op *op, int res)
+{
+   struct libvchan_cqe *cqe = &aio->cq[aio->cq_tail++ & (aio->entries - 1)];
+   uint64_t one = 1;
+   cqe->user_data = op->sqe.user_data;
+   cqe->res = res;
+   op->next = aio->free_ops;
+   aio->free_ops = op;
+   // EAGAIN means the counter is already raised; on other errors the next
+   // completion tries again
+   if (!aio->signalled &&
+       (write(aio->event_fd, &one, sizeof(one)) == sizeof(one) || errno == EAGAIN))
+       aio->signalled = 1;
+}
+
+/**
+ * Try the operation once without blocking.
+ * returns 0 if it has to wait for the peer, -1 on error, or the bytes moved
+ */
+static int try_op(struct libvchan *ctrl, struct aio_op *op)
+{
+   struct libvchan_sqe *sqe = &op->sqe;
+   switch (sqe->opcode) {
+   case VCHAN_AIO_SEND:
+       return libvchan_send(ctrl, sqe->buf, sqe->len);
+   case VCHAN_AIO_RECV:
+       return libvchan_recv(ctrl, sqe->buf, sqe->len);
+   case VCHAN_AIO_WRITE:
+       return libvchan_write(ctrl, (char *)sqe->buf + op->done, sqe->len - op->done);
+   case VCHAN_AIO_READ:
+       return libvchan_read(ctrl, sqe->buf, sqe->len);
+   }
+   return -1;
+}
+
+/**
+ * Run the queue of one direction of a vchan until its head operation has
+ * to wait for the peer.
+ */
+static void progress(struct vchan_aio_chan *chan, int dir)
+{
+   struct aio_op *op;
+   int rv;
+
+   while ((op = chan->head[dir])) {
+       rv = op->sqe.len ? try_op(chan->ctrl, op) : 0;
+       if (rv == 0 && op->sqe.len)
+           return;
+       if (rv > 0) {
+           op->done += rv;
+           if (op->sqe.opcode == VCHAN_AIO_WRITE && op->done < op->sqe.len)
+               continue;
+       }
+       chan->head[dir] = op->next;
+       if (!chan->head[dir])
+           chan->tail[dir] = NULL;
+       complete(chan->aio, op, rv < 0 ? -1 : (int)op->done);
+   }
+}
+
+static struct vchan_aio_chan *aio_attach(struct libvchan_aio *aio, struct libvchan *ctrl)
+{
+   struct vchan_aio_chan *chan;
+   struct epoll_event ev;
+
+   if (ctrl->aio)
+       return ctrl->aio->aio == aio ? ctrl->aio : NULL;
+   // the event channel fd of a poller is shared with its other vchans
+   if (ctrl->poller || ctrl->event_fd < 0)
+       return NULL;
+   chan = calloc(1, sizeof(*chan));
+   if (!chan)
+       return NULL;
+   chan->aio = aio;
+   chan->ctrl = ctrl;
+   ev.events = EPOLLIN;
+   ev.data.ptr = chan;
+   if (epoll_ctl(aio->epoll_fd, EPOLL_CTL_ADD, ctrl->event_fd, &ev)) {
+       free(chan);
+       return NULL;
+   }
+   chan->next = aio->chans;
+   if (aio->chans)
+       aio->chans->prev = chan;
+   aio->chans = chan;
+   ctrl->aio = chan;
+   ctrl->blocking = 0;
+   return chan;
+}
+
+void vchan_aio_detach(struct libvchan *ctrl)
+{
+   struct vchan_aio_chan *chan = ctrl->aio;
+   struct libvchan_aio *aio = chan->aio;
+   struct aio_op *op;
+   int dir;
+
+   for (dir = 0; dir < 2; dir++) {
+       while ((op = chan->head[dir])) {
+           chan->head[dir] = op->next;
+           complete(aio, op, -1);
+       }
+   }
+   epoll_ctl(aio->epoll_fd, EPOLL_CTL_DEL, ctrl->event_fd, NULL);
+   if (chan->prev)
+       chan->prev->next = chan->next;
+   else
+       aio->chans = chan->next;
+   if (chan->next)
+       chan->next->prev = chan->prev;
+   ctrl->aio = NULL;
+   free(chan);
+}
+
+int libvchan_aio_submit(struct libvchan_aio *aio, const struct libvchan_sqe *sqes, int count)
+{
+   struct vchan_aio_chan *chan;
+   struct aio_op *op;
+   int n, dir;
+
+   // completed operations hold their slot in the completion ring until
+   // reaped, so a free operation is not enough
+   for (n = 0; n < count && aio->inflight < aio->entries; n++) {
+       if (sqes[n].opcode < VCHAN_AIO_SEND || sqes[n].opcode > VCHAN_AIO_READ)
+           break;
+       chan = aio_attach(aio, sqes[n].ctrl);
+       if (!chan)
+           break;
+       op = aio->free_ops;
+       aio->free_ops = op->next;
+       aio->inflight++;
+       op->sqe = sqes[n];
+       op->done = 0;
+       op->next = NULL;
+       dir = sqes[n].opcode == VCHAN_AIO_SEND || sqes[n].opcode == VCHAN_AIO_WRITE ?
+             DIR_WRITE : DIR_READ;
+       if (chan->tail[dir])
+           chan->tail[dir]->next = op;
+       else
+           chan->head[dir] = op;
+       chan->tail[dir] = op;
+       // start it straight away if it is first in line
+       if (chan->head[dir] == op)
+           progress(chan, dir);
+   }
+   return n == 0 && count ? -1 : n;
+}
+
+/**
+ * Handle the event channels that fired, retrying the operations of their
+ * vchans.
+ * returns -1 on error, or 0
+ */
+static int poll_events(struct libvchan_aio *aio, int timeout_ms)
+{
+   struct epoll_event evs[EVENT_BATCH];
+   struct vchan_aio_chan *chan;
+   int n, i;
+
+   n = epoll_wait(aio->epoll_fd, evs, EVENT_BATCH, timeout_ms);
+   if (n < 0)
+       return -1;
+   for (i = 0; i < n; i++) {
+       chan = evs[i].data.ptr;
+       if (!chan)
+           continue;
+       // the fd is readable, so this only consumes and unmasks the event
+       if (libvchan_wait(chan->ctrl))
+           return -1;
+       progress(chan, DIR_READ);
+       progress(chan, DIR_WRITE);
+   }
+   return 0;
+}
+
+int libvchan_aio_reap(struct libvchan_aio *aio, struct libvchan_cqe *cqes, int max, int timeout_ms)
+{
+   uint64_t count;
+   int n = 0;
+
+   if (poll_events(aio, aio->cq_head != aio->cq_tail ? 0 : timeout_ms))
+       return -1;
+   // with no timeout, keep going until something completes
+   while (timeout_ms < 0 && aio->cq_head == aio->cq_tail && aio->inflight) {
+       if (poll_events(aio, -1))
+           return -1;
+   }
+   while (n < max && aio->cq_head != aio->cq_tail) {
+       cqes[n++] = aio->cq[aio->cq_head++ & (aio->entries - 1)];
+       aio->inflight--;
+   }
+   // EAGAIN means the counter is already clear; on other errors the fd
+   // stays readable and the next reap tries again
+   if (aio->cq_head == aio->cq_tail && aio->signalled &&
+       (read(aio->event_fd, &count, sizeof(count)) == sizeof(count) || errno == EAGAIN))
+       aio->signalled = 0;
+   return n;
+}
@@ -0,0 +1,188 @@
+/**
+ * This is a program designed to test communication bandwidth between two Xen domains
+ * with operations kept outstanding through a libvchan_aio queue.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "libvchan.h"
+
+#define MAX_DEPTH   256
+
+char *buf;
+unsigned long long total_size;
+int blocksize;
+int depth;
+
+inline double BW(unsigned long long bytes, long usec) {
+    double bw;
+    // uncomment below to measure in Mbit/s
+    bw = (double) ((((double)bytes/**8*/)/(1024*1024)) / (((double)usec)/1000000.0));
+    return bw;
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client [read|write] domid nodeid blocksize transfer_size depth\n"
+               "%s server [read|write] domid nodeid blocksize transfer_size depth read_buffer_size write_buffer_size\n"
+               "depth is the number of operations in flight, a power of two up to %d\n", argv[0], argv[0], MAX_DEPTH);
+       exit(1);
+}
+
+/**
+       Fill the queue with operations that complete at once, and check that no
+       more are accepted until their completions have been reaped: completed
+       operations still hold their slot in the completion ring.
+*/
+void check_queue_limit(struct libvchan_aio *aio, struct libvchan *ctrl)
+{
+       struct libvchan_sqe sqe[MAX_DEPTH];
+       struct libvchan_cqe cqe[MAX_DEPTH];
+       int i, n, pass;
+
+       for (pass = 0; pass < 2; pass++) {
+               // zero-length writes do not wait for the peer
+               for (i = 0; i < depth; i++) {
+                       sqe[i].opcode = VCHAN_AIO_WRITE;
+                       sqe[i].ctrl = ctrl;
+                       sqe[i].buf = buf;
+                       sqe[i].len = 0;
+                       sqe[i].user_data = pass * depth + i;
+               }
+               if (libvchan_aio_submit(aio, sqe, depth) != depth) {
+                       fprintf(stderr, "aio queue refused %d operations\n", depth);
+                       exit(1);
+               }
+               if (libvchan_aio_submit(aio, sqe, 1) != -1) {
+                       fprintf(stderr, "aio queue accepted more operations than it can complete\n");
+                       exit(1);
+               }
+               n = libvchan_aio_reap(aio, cqe, MAX_DEPTH, 0);
+               if (n != depth) {
+                       fprintf(stderr, "reaped %d completions, expected %d\n", n, depth);
+                       exit(1);
+               }
+               for (i = 0; i < n; i++) {
+                       if (cqe[i].user_data != (uint64_t)(pass * depth + i) || cqe[i].res != 0) {
+                               fprintf(stderr, "completion %d out of order\n", i);
+                               exit(1);
+                       }
+               }
+       }
+}
+
+/**
+       Move total_size bytes with up to depth reads or writes in flight.
+*/
+void run(struct libvchan_aio *aio, struct libvchan *ctrl, int wr)
+{
+       struct libvchan_sqe sqe[MAX_DEPTH];
+       struct libvchan_cqe cqe[MAX_DEPTH];
+       unsigned long long submitted = 0, done = 0;
+       int outstanding = 0, size, n, i;
+       struct timeval tv1, tv2;
+       long t;
+
+       gettimeofday(&tv1, NULL);
+       while (done < total_size) {
+               // reads return what is ready, so the reader keeps asking until done
+               for (n = 0; outstanding + n < depth && (!wr || submitted < total_size); n++) {
+                       size = submitted + blocksize > total_size && wr ? total_size - submitted : blocksize;
+                       sqe[n].opcode = wr ? VCHAN_AIO_WRITE : VCHAN_AIO_READ;
+                       sqe[n].ctrl = ctrl;
+                       sqe[n].buf = buf;
+                       sqe[n].len = size;
+                       sqe[n].user_data = 0;
+                       submitted += size;
+               }
+               if (n && libvchan_aio_submit(aio, sqe, n) != n) {
+                       perror("libvchan_aio_submit");
+                       exit(1);
+               }
+               outstanding += n;
+               n = libvchan_aio_reap(aio, cqe, MAX_DEPTH, -1);
+               if (n < 0) {
+                       perror("libvchan_aio_reap");
+                       exit(1);
+               }
+               for (i = 0; i < n; i++) {
+                       if (cqe[i].res < 0) {
+                               perror(wr ? "vchan write" : "read vchan");
+                               exit(1);
+                       }
+                       done += cqe[i].res;
+                       outstanding--;
+               }
+       }
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       printf("BW: %.3f MB/s (%llu bytes in %ld usec), Size: %.2fMB, time: %.3fsec\n", BW(done,t), done, t, ((double)done/(1024*1024)), ((double)t/1000000));
+}
+
+
+/**
+       Queued libvchan application, both client and server.
+       One side does writing, the other side does reading.
+*/
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl = 0;
+       struct libvchan_aio *aio;
+       int wr;
+       if (argc < 8)
+               usage(argv);
+       if (!strcmp(argv[2], "read"))
+               wr = 0;
+       else if (!strcmp(argv[2], "write"))
+               wr = 1;
+       else
+               usage(argv);
+
+       blocksize = atoi(argv[5]);
+       total_size = atoll(argv[6]);
+       depth = atoi(argv[7]);
+       if (blocksize <= 0 || depth < 1 || depth > MAX_DEPTH || (depth & (depth - 1)))
+               usage(argv);
+       buf = (char*) malloc(blocksize);
+       if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+       }
+
+       printf("Running queued bandwidth test with domain %d on port %d, blocksize %d transfer_size %llu depth %d\n",
+              atoi(argv[3]), atoi(argv[4]), blocksize, total_size, depth);
+
+       if (!strcmp(argv[1], "server")) {
+               if (argc < 10)
+                    usage(argv);
+               ctrl = libvchan_server_init(atoi(argv[3]), atoi(argv[4]), atoi(argv[8]), atoi(argv[9]));
+       } else if (!strcmp(argv[1], "client"))
+               ctrl = libvchan_client_init(atoi(argv[3]), atoi(argv[4]));
+       else
+               usage(argv);
+       if (!ctrl) {
+               perror("libvchan_*_init");
+               exit(1);
+       }
+       aio = libvchan_aio_create(depth);
+       if (!aio) {
+               perror("libvchan_aio_create");
+               exit(1);
+       }
+
+       check_queue_limit(aio, ctrl);
+       run(aio, ctrl, wr);
+       // reads still queued past the end complete with -1 on close
+       libvchan_close(ctrl);
+       libvchan_aio_destroy(aio);
+       free(buf);
+       return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * This is a program designed to test full-duplex bandwidth between two Xen domains:
+ * both sides write and read at the same time, so all four ring indexes are hot.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "libvchan.h"
+
+char *wbuf, *rbuf;
+unsigned long long total_size;
+int blocksize;
+
+inline double BW(unsigned long long bytes, long usec) {
+    double bw;
+    // uncomment below to measure in Mbit/s
+    bw = (double) ((((double)bytes/**8*/)/(1024*1024)) / (((double)usec)/1000000.0));
+    return bw;
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client domid nodeid blocksize transfer_size\n"
+               "%s server domid nodeid blocksize transfer_size read_buffer_size write_buffer_size [1|2]\n"
+               "the last server argument selects the shared page layout (default 2)\n", argv[0], argv[0]);
+       exit(1);
+}
+
+/**
+ * Interleave nonblocking writes and reads until transfer_size bytes have
+ * gone each way.
+ */
+void duplex(struct libvchan *ctrl)
+{
+       unsigned long long read_size = 0, write_size = 0;
+       int size;
+       struct timeval tv1, tv2;
+       long t;
+
+       gettimeofday(&tv1, NULL);
+       while (read_size < total_size || write_size < total_size) {
+               if (write_size < total_size) {
+                       size = write_size + blocksize > total_size ? total_size - write_size : blocksize;
+                       size = libvchan_write(ctrl, wbuf, size);
+                       if (size < 0) {
+                               perror("vchan write");
+                               exit(1);
+                       }
+                       write_size += size;
+               }
+               if (read_size < total_size) {
+                       size = read_size + blocksize > total_size ? total_size - read_size : blocksize;
+                       size = libvchan_read(ctrl, rbuf, size);
+                       if (size < 0) {
+                               perror("read vchan");
+                               libvchan_close(ctrl);
+                               exit(1);
+                       }
+                       read_size += size;
+               }
+       }
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       printf("Layout v%d: BW: %.3f MB/s each way, %.3f MB/s total (%llu bytes each way in %ld usec)\n",
+              ctrl->version, BW(write_size, t), BW(read_size + write_size, t), write_size, t);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl = 0;
+       int version = VCHAN_VERSION_2;
+       if (argc < 6)
+               usage(argv);
+
+       blocksize = atoi(argv[4]);
+       total_size = atoll(argv[5]);
+       wbuf = (char*) malloc(blocksize);
+       rbuf = (char*) malloc(blocksize);
+       if (wbuf == NULL || rbuf == NULL) {
+            perror("malloc");
+            exit(1);
+       }
+
+       printf("Running full-duplex bandwidth test with domain %d on port %d, blocksize %d transfer_size %llu\n",
+              atoi(argv[2]), atoi(argv[3]), blocksize, total_size);
+
+       if (!strcmp(argv[1], "server")) {
+               if (argc < 8)
+                    usage(argv);
+               if (argc > 8)
+                    version = atoi(argv[8]);
+               ctrl = libvchan_server_init_version(atoi(argv[2]), atoi(argv[3]), atoi(argv[6]), atoi(argv[7]), version);
+       } else if (!strcmp(argv[1], "client"))
+               ctrl = libvchan_client_init(atoi(argv[2]), atoi(argv[3]));
+       else
+               usage(argv);
+       if (!ctrl) {
+               perror("libvchan_*_init");
+               exit(1);
+       }
+
+       duplex(ctrl);
+       libvchan_close(ctrl);
+       free(wbuf);
+       free(rbuf);
+       return 0;
+}
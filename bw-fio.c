@@ -0,0 +1,117 @@
+/**
+ * This is a program designed to test how forwarding file writes with
+ * libvchan_fio improves on the lockstep pattern of bw-file, where the
+ * writer waits for a 12-byte ack after each block. The client writes
+ * transfer_size bytes to a file served by vchan-fiod in blocks of blocksize
+ * bytes, fsyncs and closes it, first waiting for each write to be
+ * acknowledged, which is lockstep, then with a window of unacknowledged
+ * bytes.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#include "libvchan.h"
+
+unsigned long long total_size;
+int blocksize;
+char *buf;
+
+inline double BW(unsigned long long bytes, long usec) {
+    double bw;
+    // uncomment below to measure in Mbit/s
+    bw = (double) ((((double)bytes/**8*/)/(1024*1024)) / (((double)usec)/1000000.0));
+    return bw;
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s domid nodeid blocksize transfer_size window path\n"
+               "with vchan-fiod serving the directory of path on the other domain\n",
+               argv[0]);
+       exit(1);
+}
+
+void writer(struct libvchan *ctrl, size_t window, const char *path)
+{
+       struct libvchan_fio *fio = libvchan_fio_create(ctrl, window);
+       unsigned long long sent = 0;
+       struct timeval tv1, tv2;
+       size_t size;
+       long t;
+       int fd;
+
+       if (!fio) {
+               perror("libvchan_fio_create");
+               exit(1);
+       }
+       gettimeofday(&tv1, NULL);
+       fd = libvchan_fio_open(fio, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+       if (fd < 0) {
+               perror(path);
+               exit(1);
+       }
+       while (sent < total_size) {
+               size = sent + blocksize > total_size ? total_size - sent : blocksize;
+               if (libvchan_fio_pwrite(fio, fd, buf, size, sent) < 0) {
+                       perror("libvchan_fio_pwrite");
+                       exit(1);
+               }
+               sent += size;
+       }
+       if (libvchan_fio_wait(fio, libvchan_fio_fsync(fio, fd)) || libvchan_fio_close(fio, fd)) {
+               perror("libvchan_fio_fsync");
+               exit(1);
+       }
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       printf("window %10zu: BW: %.3f MB/s (%llu bytes in %ld usec)\n",
+              window, BW(sent, t), sent, t);
+       libvchan_fio_destroy(fio);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl;
+       int domid, nodeid;
+       size_t window;
+
+       if (argc < 7)
+               usage(argv);
+       domid = atoi(argv[1]);
+       nodeid = atoi(argv[2]);
+       blocksize = atoi(argv[3]);
+       total_size = atoll(argv[4]);
+       window = atoll(argv[5]);
+       if (blocksize < 1)
+               usage(argv);
+       buf = malloc(blocksize);
+       if (!buf) {
+               perror("malloc");
+               exit(1);
+       }
+       memset(buf, 0x5a, blocksize);
+
+       printf("Running file forwarding test with domain %d on port %d, blocksize %d transfer_size %llu\n",
+              domid, nodeid, blocksize, total_size);
+
+       ctrl = libvchan_client_init(domid, nodeid);
+       if (!ctrl) {
+               perror("libvchan_client_init");
+               exit(1);
+       }
+       // one pass in lockstep, as bw-file does, then one pipelined
+       writer(ctrl, 0, argv[6]);
+       writer(ctrl, window, argv[6]);
+       libvchan_close(ctrl);
+       free(buf);
+       return 0;
+}
@@ -3,6 +3,7 @@
  * It is based off the example test programs that accompany libxenvchan.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,12 +13,19 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <mpi.h>
 
 #include "libvchan.h"
 
 #define DEBUG       0
 #define Printf(fmt, ...)   if(DEBUG) printf(fmt, ##__VA_ARGS__)
+// move file data straight between the file and the ring instead of going through buf
+#define ZEROCOPY    1
+// stream the whole file and have the reader write it with O_DIRECT from the
+// ring through libvchan_sink, SINK_DEPTH writes in flight, with no acks
+#define DIRECT_SINK 0
+#define SINK_DEPTH  8
 
 char *buf;
 char *path;
@@ -117,6 +125,72 @@ inline int recv_blocking(struct libvchan *ctrl, void *msg, size_t size)
     return sz;
 }
 
+/**
+ * Read size bytes of f directly into free ring space and publish them,
+ * as much as fits at a time.
+ */
+int send_from_file(struct libvchan *ctrl, int f, size_t size)
+{
+    struct iovec span[2];
+    size_t pos = 0;
+    int avail, ret;
+
+    while (pos < size) {
+        avail = libvchan_buffer_space(ctrl);
+        if (avail < 0)
+            return -1;
+        // the ring is full: sleep until the reader frees some of it
+        if (avail == 0) {
+            if (libvchan_wait(ctrl) < 0)
+                return -1;
+            continue;
+        }
+        if (avail > size - pos)
+            avail = size - pos;
+        if (libvchan_write_reserve(ctrl, avail, &span[0], &span[1]) != avail)
+            return -1;
+        ret = readv(f, span, span[1].iov_len ? 2 : 1);
+        if (ret <= 0) {
+            libvchan_write_commit(ctrl, 0);
+            return pos;
+        }
+        if (libvchan_write_commit(ctrl, ret) < 0)
+            return -1;
+        pos += ret;
+    }
+    return pos;
+}
+
+/**
+ * Write size bytes from the read ring directly to f, releasing them as
+ * they are written.
+ */
+int recv_to_file(struct libvchan *ctrl, int f, size_t size)
+{
+    struct iovec iov[2];
+    size_t pos = 0;
+    int avail, ret;
+
+    while (pos < size) {
+        avail = libvchan_read_peek(ctrl, iov, size - pos);
+        if (avail < 0)
+            return -1;
+        // nothing ready: sleep until the writer sends more
+        if (avail == 0) {
+            if (libvchan_wait(ctrl) < 0)
+                return -1;
+            continue;
+        }
+        ret = writev(f, iov, iov[1].iov_len ? 2 : 1);
+        if (ret <= 0)
+            return pos;
+        if (libvchan_read_release(ctrl, ret) < 0)
+            return -1;
+        pos += ret;
+    }
+    return pos;
+}
+
 void reader(struct libvchan *ctrl)
 {
        unsigned long long read_size = 0, wr_size = 0;
@@ -135,25 +209,49 @@ void reader(struct libvchan *ctrl)
            perror("open");
        }
        int r;
+       if (DIRECT_SINK) {
+               struct libvchan_sink *sink = libvchan_sink_create(ctrl, SINK_DEPTH, 65536);
+               close(f);
+               f = open(filename, O_WRONLY | O_CREAT | O_DIRECT, 0666);
+               if (!sink || f < 0) {
+                       perror("libvchan_sink_create");
+                       exit(1);
+               }
+               gettimeofday(&tv1, NULL);
+               if (libvchan_sink_write(sink, f, 0, total_size) < 0) {
+                       perror("libvchan_sink_write");
+                       exit(1);
+               }
+               gettimeofday(&tv2, NULL);
+               t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+               read_size = total_size;
+               libvchan_sink_destroy(sink);
+       }
        /*if ((r = lseek(f, (off_t)rank*total_size, SEEK_SET)) < 0) {
            perror("lseek");
        }
        printf("starting at %ld, %d\n", (long int)lseek(f, 0, SEEK_CUR), r);
        */
 
-       while (read_size < total_size) {
+       while (!DIRECT_SINK && read_size < total_size) {
                size = read_size + blocksize > total_size ? total_size - read_size : blocksize;
 
                gettimeofday(&tv1, NULL);
                recv_blocking(ctrl, buf, 8);
-               size = recv_blocking(ctrl, buf, 65536);
+               if (ZEROCOPY) {
+                   size = recv_to_file(ctrl, f, 65536);
+                   if (size != 65536)
+                       printf("write fail: requested %d wrote %d\n", 65536, size);
+                   wr_size += size;
+               } else
+                   size = recv_blocking(ctrl, buf, 65536);
                //size = libvchan_recv(ctrl, buf, size);
                if (size < 0) {
                        perror("read vchan");
                        libvchan_close(ctrl);
                        exit(1);
                }
-               if (size > 0) {
+               if (!ZEROCOPY && size > 0) {
                   sz = write(f, buf, size);
                   wr_size += sz;
                   if (sz != size)
@@ -186,18 +284,42 @@ void writer(struct libvchan *ctrl)
 
        send_blocking(ctrl, (int*)&rank, sizeof(rank));
 
-       while (write_size < total_size) {
+       if (DIRECT_SINK) {
+               gettimeofday(&tv1, NULL);
+               if (libvchan_sink_pad(ctrl) || send_from_file(ctrl, f, total_size) != total_size ||
+                   libvchan_sink_pad(ctrl)) {
+                       perror("send file");
+                       exit(1);
+               }
+               gettimeofday(&tv2, NULL);
+               t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+               write_size = total_size;
+       }
+
+       while (!DIRECT_SINK && write_size < total_size) {
                size = write_size + blocksize > total_size ? total_size - write_size : blocksize;
-               sz = read(f, buf, size);
-               wr_size += sz;
-               if (sz != size) {
-                   perror("file read");
-                   printf("read fail: requested %d read %d at offset %ld\n", size, sz, lseek(f, 0, SEEK_CUR));
-                   exit(1);
+               if (!ZEROCOPY) {
+                   sz = read(f, buf, size);
+                   wr_size += sz;
+                   if (sz != size) {
+                       perror("file read");
+                       printf("read fail: requested %d read %d at offset %ld\n", size, sz, lseek(f, 0, SEEK_CUR));
+                       exit(1);
+                   }
                }
                gettimeofday(&tv1, NULL);
                send_blocking(ctrl, buf, 8);
-               size = send_blocking(ctrl, buf, 65536);
+               if (ZEROCOPY) {
+                   // the file read is part of the send now, so it is timed
+                   size = send_from_file(ctrl, f, 65536);
+                   if (size != 65536) {
+                       perror("file read");
+                       printf("read fail: requested %d read %d at offset %ld\n", 65536, size, lseek(f, 0, SEEK_CUR));
+                       exit(1);
+                   }
+                   wr_size += size;
+               } else
+                   size = send_blocking(ctrl, buf, 65536);
                recv_blocking(ctrl, buf, 12);
                //size = send_blocking(ctrl, buf, sz);
                gettimeofday(&tv2, NULL);
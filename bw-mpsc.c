@@ -0,0 +1,170 @@
+/**
+ * This is a program designed to test the message rate of many threads
+ * sending over one vchan. The server sends from producer_threads threads,
+ * either through VCHAN_THREAD_MPSC or with every send wrapped in a global
+ * mutex; the client receives from one thread. The number of threads doubles
+ * from 1 to max_threads, each step on the next node id.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "libvchan.h"
+
+unsigned long long total_msgs;
+int msgsize;
+int use_mutex;
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+inline double OPS(unsigned long long ops, long usec) {
+    return (double)ops / (((double)usec)/1000000.0);
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client domid nodeid max_threads msgsize num_msgs\n"
+               "%s server domid nodeid max_threads msgsize num_msgs ring_size [mpsc|mutex]\n"
+               "num_msgs is the total over all threads\n", argv[0], argv[0]);
+       exit(1);
+}
+
+struct producer {
+       struct libvchan *ctrl;
+       unsigned long long count;
+       pthread_t thread;
+};
+
+void *producer_thread(void *arg)
+{
+       struct producer *p = arg;
+       char *buf = malloc(msgsize);
+       unsigned long long i;
+       int rv;
+
+       if (!buf) {
+               perror("malloc");
+               exit(1);
+       }
+       memset(buf, 0x5a, msgsize);
+       for (i = 0; i < p->count; i++) {
+               if (use_mutex)
+                       pthread_mutex_lock(&send_lock);
+               rv = libvchan_send(p->ctrl, buf, msgsize);
+               if (use_mutex)
+                       pthread_mutex_unlock(&send_lock);
+               if (rv != msgsize) {
+                       perror("vchan send");
+                       exit(1);
+               }
+       }
+       free(buf);
+       return NULL;
+}
+
+void server(struct libvchan *ctrl, int nthreads)
+{
+       struct producer p[nthreads];
+       struct libvchan_stats stats;
+       struct timeval tv1, tv2;
+       long t;
+       int i;
+
+       if (!use_mutex && libvchan_set_threaded(ctrl, VCHAN_THREAD_MPSC)) {
+               perror("libvchan_set_threaded");
+               exit(1);
+       }
+       gettimeofday(&tv1, NULL);
+       for (i = 0; i < nthreads; i++) {
+               p[i].ctrl = ctrl;
+               p[i].count = total_msgs / nthreads + (i < total_msgs % nthreads);
+               pthread_create(&p[i].thread, NULL, producer_thread, &p[i]);
+       }
+       for (i = 0; i < nthreads; i++)
+               pthread_join(p[i].thread, NULL);
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       libvchan_get_stats(ctrl, &stats);
+       printf("%2d threads (%s): %.0f msgs/s, %.3f notifies/1k msgs (%llu msgs in %ld usec)\n",
+              nthreads, use_mutex ? "mutex" : "mpsc", OPS(total_msgs, t),
+              1000.0 * stats.notify_sent / total_msgs, total_msgs, t);
+}
+
+void client(struct libvchan *ctrl)
+{
+       char *buf = malloc(msgsize);
+       unsigned long long i;
+
+       if (!buf) {
+               perror("malloc");
+               exit(1);
+       }
+       for (i = 0; i < total_msgs; i++) {
+               if (libvchan_recv(ctrl, buf, msgsize) != msgsize) {
+                       perror("vchan recv");
+                       exit(1);
+               }
+       }
+       free(buf);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl;
+       int domid, nodeid, max_threads, nthreads, ring_size = 0, tries, is_server = 0;
+
+       if (argc < 7)
+               usage(argv);
+       if (!strcmp(argv[1], "server")) {
+               if (argc < 8)
+                       usage(argv);
+               is_server = 1;
+               ring_size = atoi(argv[7]);
+               if (argc > 8)
+                       use_mutex = !strcmp(argv[8], "mutex");
+       } else if (strcmp(argv[1], "client"))
+               usage(argv);
+
+       domid = atoi(argv[2]);
+       nodeid = atoi(argv[3]);
+       max_threads = atoi(argv[4]);
+       msgsize = atoi(argv[5]);
+       total_msgs = atoll(argv[6]);
+       if (max_threads < 1 || msgsize < 1)
+               usage(argv);
+
+       printf("Running multi-producer message rate test with domain %d on port %d, up to %d threads, "
+              "msgsize %d num_msgs %llu\n", domid, nodeid, max_threads, msgsize, total_msgs);
+
+       for (nthreads = 1; nthreads <= max_threads; nthreads *= 2, nodeid++) {
+               if (is_server)
+                       ctrl = libvchan_server_init(domid, nodeid, ring_size, ring_size);
+               else {
+                       // wait for the server to publish the next vchan
+                       for (tries = 0; tries < 100; tries++) {
+                               ctrl = libvchan_client_init(domid, nodeid);
+                               if (ctrl)
+                                       break;
+                               usleep(100000);
+                       }
+               }
+               if (!ctrl) {
+                       perror("libvchan_*_init");
+                       exit(1);
+               }
+               ctrl->blocking = 1;
+               if (is_server)
+                       server(ctrl, nthreads);
+               else
+                       client(ctrl);
+               libvchan_close(ctrl);
+       }
+       return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * This is a program designed to test how bandwidth between two Xen domains
+ * scales with the number of queues of a multi-queue vchan. Each queue is
+ * driven by its own thread on both sides; the server writes, the client reads.
+ * The number of queues doubles from 1 to max_queues, each step on the next
+ * node id.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "libvchan.h"
+
+unsigned long long total_size;
+int blocksize;
+int is_server;
+
+inline double BW(unsigned long long bytes, long usec) {
+    double bw;
+    // uncomment below to measure in Mbit/s
+    bw = (double) ((((double)bytes/**8*/)/(1024*1024)) / (((double)usec)/1000000.0));
+    return bw;
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client domid nodeid max_queues blocksize transfer_size\n"
+               "%s server domid nodeid max_queues blocksize transfer_size ring_size\n"
+               "transfer_size is per queue\n", argv[0], argv[0]);
+       exit(1);
+}
+
+/**
+ * Move transfer_size bytes through one queue, writing on the server and
+ * reading on the client.
+ */
+void *queue_thread(void *arg)
+{
+       struct libvchan *ctrl = arg;
+       unsigned long long done = 0;
+       char *buf = malloc(blocksize);
+       int size;
+
+       if (!buf) {
+               perror("malloc");
+               exit(1);
+       }
+       memset(buf, 0x5a, blocksize);
+       ctrl->blocking = 1;
+       while (done < total_size) {
+               size = done + blocksize > total_size ? total_size - done : blocksize;
+               if (is_server)
+                       size = libvchan_write(ctrl, buf, size);
+               else
+                       size = libvchan_read(ctrl, buf, size);
+               if (size < 0) {
+                       perror("vchan io");
+                       exit(1);
+               }
+               done += size;
+       }
+       free(buf);
+       return NULL;
+}
+
+void run(struct libvchan_mq *mq)
+{
+       pthread_t threads[VCHAN_MQ_MAX];
+       struct timeval tv1, tv2;
+       long t;
+       int i;
+
+       gettimeofday(&tv1, NULL);
+       for (i = 0; i < mq->nqueues; i++)
+               pthread_create(&threads[i], NULL, queue_thread, libvchan_mq_queue(mq, i));
+       for (i = 0; i < mq->nqueues; i++)
+               pthread_join(threads[i], NULL);
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       printf("%2d queues: BW: %.3f MB/s total, %.3f MB/s per queue (%llu bytes in %ld usec)\n",
+              mq->nqueues, BW(total_size * mq->nqueues, t), BW(total_size, t),
+              total_size * mq->nqueues, t);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan_mq *mq;
+       int domid, nodeid, max_queues, nqueues, ring_size = 0, tries;
+
+       if (argc < 7)
+               usage(argv);
+       if (!strcmp(argv[1], "server")) {
+               if (argc < 8)
+                       usage(argv);
+               is_server = 1;
+               ring_size = atoi(argv[7]);
+       } else if (strcmp(argv[1], "client"))
+               usage(argv);
+
+       domid = atoi(argv[2]);
+       nodeid = atoi(argv[3]);
+       max_queues = atoi(argv[4]);
+       blocksize = atoi(argv[5]);
+       total_size = atoll(argv[6]);
+       if (max_queues < 1 || max_queues > VCHAN_MQ_MAX)
+               usage(argv);
+
+       printf("Running multi-queue bandwidth test with domain %d on port %d, up to %d queues, "
+              "blocksize %d transfer_size %llu per queue\n",
+              domid, nodeid, max_queues, blocksize, total_size);
+
+       for (nqueues = 1; nqueues <= max_queues; nqueues *= 2, nodeid++) {
+               if (is_server)
+                       mq = libvchan_mq_server_init(domid, nodeid, nqueues, ring_size, ring_size);
+               else {
+                       // wait for the server to publish the next vchan
+                       for (tries = 0; tries < 100; tries++) {
+                               mq = libvchan_mq_client_init(domid, nodeid);
+                               if (mq)
+                                       break;
+                               usleep(100000);
+                       }
+               }
+               if (!mq) {
+                       perror("libvchan_mq_*_init");
+                       exit(1);
+               }
+               run(mq);
+               libvchan_mq_close(mq);
+       }
+       return 0;
+}
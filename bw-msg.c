@@ -0,0 +1,162 @@
+/**
+ * This is a program designed to test the small message rate between two Xen domains.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "libvchan.h"
+
+#define MAX_BATCH   1024
+
+char *buf;
+struct iovec msgs[MAX_BATCH];
+unsigned long long total_msgs;
+int msgsize;
+int batch;
+
+inline double OPS(unsigned long long ops, long usec) {
+    return (double)ops / (((double)usec)/1000000.0);
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client [read|write] domid nodeid msgsize msg_count batch\n"
+               "%s server [read|write] domid nodeid msgsize msg_count batch read_buffer_size write_buffer_size\n"
+               "batch is the number of messages per call; 1 uses libvchan_send/recv\n", argv[0], argv[0]);
+       exit(1);
+}
+
+void report(struct libvchan *ctrl, unsigned long long ops, long t)
+{
+       struct libvchan_stats st;
+
+       libvchan_get_stats(ctrl, &st);
+       printf("Rate: %.0f msgs/s (%llu msgs of %d bytes in %ld usec), BW: %.3f MB/s, notifies: %llu (%.3f/msg)\n",
+              OPS(ops, t), ops, msgsize, t,
+              ((double)ops*msgsize/(1024*1024)) / (((double)t)/1000000.0),
+              st.notify_sent, (double)st.notify_sent/ops);
+}
+
+void reader(struct libvchan *ctrl)
+{
+       unsigned long long done = 0;
+       int n, count;
+       struct timeval tv1, tv2;
+       long t;
+
+       gettimeofday(&tv1, NULL);
+       while (done < total_msgs) {
+               count = done + batch > total_msgs ? total_msgs - done : batch;
+               if (batch == 1) {
+                       // one message per call: count it, keeping errors
+                       n = libvchan_recv(ctrl, buf, msgsize);
+                       if (n > 0)
+                               n = 1;
+               } else
+                       n = libvchan_recv_batch(ctrl, msgs, count);
+               if (n < 0) {
+                       perror("read vchan");
+                       libvchan_close(ctrl);
+                       exit(1);
+               }
+               done += n;
+       }
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       report(ctrl, done, t);
+}
+
+void writer(struct libvchan *ctrl)
+{
+       unsigned long long done = 0;
+       int n, count;
+       struct timeval tv1, tv2;
+       long t;
+
+       gettimeofday(&tv1, NULL);
+       while (done < total_msgs) {
+               count = done + batch > total_msgs ? total_msgs - done : batch;
+               if (batch == 1) {
+                       // one message per call: count it, keeping errors
+                       n = libvchan_send(ctrl, buf, msgsize);
+                       if (n > 0)
+                               n = 1;
+               } else
+                       n = libvchan_send_batch(ctrl, msgs, count);
+               if (n < 0) {
+                       perror("vchan write");
+                       exit(1);
+               }
+               done += n;
+       }
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       report(ctrl, done, t);
+}
+
+
+/**
+       Small message libvchan application, both client and server.
+       One side does writing, the other side does reading.
+*/
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl = 0;
+       int wr, i;
+       if (argc < 8)
+               usage(argv);
+       if (!strcmp(argv[2], "read"))
+               wr = 0;
+       else if (!strcmp(argv[2], "write"))
+               wr = 1;
+       else
+               usage(argv);
+
+       msgsize = atoi(argv[5]);
+       total_msgs = atoll(argv[6]);
+       batch = atoi(argv[7]);
+       if (batch < 1 || batch > MAX_BATCH)
+               usage(argv);
+       buf = (char*) malloc(msgsize * batch);
+       if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+       }
+       for (i = 0; i < batch; i++) {
+               msgs[i].iov_base = buf + i * msgsize;
+               msgs[i].iov_len = msgsize;
+       }
+
+       printf("Running message rate test with domain %d on port %d, msgsize %d msg_count %llu batch %d\n",
+              atoi(argv[3]), atoi(argv[4]), msgsize, total_msgs, batch);
+
+       if (!strcmp(argv[1], "server")) {
+               if (argc < 10)
+                    usage(argv);
+               ctrl = libvchan_server_init(atoi(argv[3]), atoi(argv[4]), atoi(argv[8]), atoi(argv[9]));
+       } else if (!strcmp(argv[1], "client"))
+               ctrl = libvchan_client_init(atoi(argv[3]), atoi(argv[4]));
+       else
+               usage(argv);
+       if (!ctrl) {
+               perror("libvchan_*_init");
+               exit(1);
+       }
+
+       if (wr)
+               writer(ctrl);
+       else
+               reader(ctrl);
+       libvchan_close(ctrl);
+       free(buf);
+       return 0;
+}
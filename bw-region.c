@@ -0,0 +1,206 @@
+/**
+ * This is a program designed to test the bandwidth of shared regions between two Xen domains.
+ * The server registers a region and sends its descriptor; the client maps it and
+ * copies blocks into it (put) or out of it (get) with libvchan_region_put/get.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "libvchan.h"
+
+char *buf;
+unsigned long long total_size;
+int blocksize;
+
+inline double BW(unsigned long long bytes, long usec) {
+    double bw;
+    // uncomment below to measure in Mbit/s
+    bw = (double) ((((double)bytes/**8*/)/(1024*1024)) / (((double)usec)/1000000.0));
+    return bw;
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client [put|get] domid evt-port blocksize transfer_size [xen|local]\n"
+               "%s server [put|get] domid evt-port blocksize transfer_size read_buffer_size write_buffer_size [xen|local]\n"
+               "the region is blocksize bytes, at most 64 MiB; local needs both ends in one host\n", argv[0], argv[0]);
+       exit(1);
+}
+
+void fill(char *data, int size)
+{
+       int i;
+
+       for (i = 0; i < size; i++)
+               data[i] = i * 7;
+}
+
+/* check the block against fill(), so that both ends agree on what was copied */
+int check(char *data, int size)
+{
+       int i;
+
+       for (i = 0; i < size; i++)
+               if (data[i] != (char)(i * 7))
+                       return -1;
+       return 0;
+}
+
+/**
+       Register the region, send it and wait for the client to finish with it.
+*/
+void server(struct libvchan *ctrl, int put, int backend)
+{
+       struct libvchan_region *region;
+       char done;
+
+       region = libvchan_region_alloc(ctrl, blocksize, backend);
+       if (!region) {
+               perror("libvchan_region_alloc");
+               exit(1);
+       }
+       if (!put)
+               fill(region->addr, blocksize);
+       if (libvchan_region_send(ctrl, region) < 0) {
+               perror("libvchan_region_send");
+               exit(1);
+       }
+       if (libvchan_recv(ctrl, &done, 1) != 1) {
+               perror("read vchan");
+               exit(1);
+       }
+       if (put && check(region->addr, blocksize)) {
+               fprintf(stderr, "region does not hold the data put by the client\n");
+               exit(1);
+       }
+       libvchan_region_free(region);
+}
+
+/**
+       Map the server's region and copy blocksize bytes at a time through it.
+*/
+void client(struct libvchan *ctrl, int put)
+{
+       struct libvchan_region *region;
+       unsigned long long done_size = 0;
+       int size;
+       struct timeval tv1, tv2;
+       long t;
+       char done = 0;
+
+       region = libvchan_region_recv(ctrl);
+       if (!region) {
+               perror("libvchan_region_recv");
+               exit(1);
+       }
+       if (put)
+               fill(buf, blocksize);
+
+       gettimeofday(&tv1, NULL);
+       while (done_size < total_size) {
+               size = done_size + blocksize > total_size ? total_size - done_size : blocksize;
+               if (put)
+                       size = libvchan_region_put(ctrl, region, 0, buf, size);
+               else
+                       size = libvchan_region_get(ctrl, region, 0, buf, size);
+               if (size < 0) {
+                       perror(put ? "libvchan_region_put" : "libvchan_region_get");
+                       exit(1);
+               }
+               done_size += size;
+       }
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+
+       if (!put && check(buf, size)) {
+               fprintf(stderr, "data read from the region does not match the server's\n");
+               exit(1);
+       }
+       if (put) {
+               // the last block must reach the region whole for the server's check
+               fill(buf, blocksize);
+               libvchan_region_put(ctrl, region, 0, buf, blocksize);
+       }
+       libvchan_region_unmap(ctrl, region);
+       if (libvchan_send(ctrl, &done, 1) != 1) {
+               perror("vchan write");
+               exit(1);
+       }
+       printf("BW: %.3f MB/s (%llu bytes in %ld usec), Size: %.2fMB, time: %.3fsec\n", BW(done_size,t), done_size, t, ((double)done_size/(1024*1024)), ((double)t/1000000));
+}
+
+
+/**
+       Shared region libvchan application, both client and server.
+       The client puts to or gets from a region the server registered.
+*/
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl = 0;
+       int put, backend = VCHAN_REGION_XEN;
+       char *mode = NULL;
+       if (argc < 7)
+               usage(argv);
+       if (!strcmp(argv[2], "put"))
+               put = 1;
+       else if (!strcmp(argv[2], "get"))
+               put = 0;
+       else
+               usage(argv);
+
+       blocksize = atoi(argv[5]);
+       total_size = atoll(argv[6]);
+       if (blocksize <= 0)
+               usage(argv);
+       buf = (char*) malloc(blocksize);
+       if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+       }
+
+       if (!strcmp(argv[1], "server")) {
+               if (argc < 9)
+                    usage(argv);
+               if (argc > 9)
+                    mode = argv[9];
+       } else if (!strcmp(argv[1], "client")) {
+               if (argc > 7)
+                    mode = argv[7];
+       } else
+               usage(argv);
+       if (mode && !strcmp(mode, "local"))
+               backend = VCHAN_REGION_LOCAL;
+       else if (mode && strcmp(mode, "xen"))
+               usage(argv);
+
+       printf("Running region %s test with domain %d on port %d, blocksize %d transfer_size %llu backend %s\n",
+              argv[2], atoi(argv[3]), atoi(argv[4]), blocksize, total_size,
+              backend == VCHAN_REGION_LOCAL ? "local" : "xen");
+
+       if (!strcmp(argv[1], "server"))
+               ctrl = libvchan_server_init(atoi(argv[3]), atoi(argv[4]), atoi(argv[7]), atoi(argv[8]));
+       else
+               ctrl = libvchan_client_init(atoi(argv[3]), atoi(argv[4]));
+       if (!ctrl) {
+               perror("libvchan_*_init");
+               exit(1);
+       }
+       if (backend == VCHAN_REGION_LOCAL)
+               libvchan_region_allow_local(ctrl, 1);
+
+       if (!strcmp(argv[1], "server"))
+               server(ctrl, put, backend);
+       else
+               client(ctrl, put);
+       libvchan_close(ctrl);
+       free(buf);
+       return 0;
+}
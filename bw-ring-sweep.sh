@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Run bw over a range of ring sizes to get a throughput-vs-ring-size curve.
+# Start the server side first, then the client side with the same arguments
+# in the peer domain. Each size uses its own node id, starting at nodeid.
+# Rings over 1 MiB use indirect grant pages.
+#
+
+if [ $# -lt 5 ]; then
+    echo "usage: $0 [client|server] [read|write] domid nodeid blocksize [transfer_size]" >&2
+    exit 1
+fi
+
+ROLE=$1
+DIR=$2
+DOMID=$3
+NODE=$4
+BLOCKSIZE=$5
+TRANSFER=${6:-1073741824}
+BW=${BW:-./bw}
+
+for KB in 64 256 1024 4096 16384 65536; do
+    SIZE=$((KB * 1024))
+    if [ "$ROLE" = server ]; then
+        printf "ring %6d KiB: " $KB
+        $BW server $DIR $DOMID $NODE $BLOCKSIZE $TRANSFER $SIZE $SIZE | grep '^BW'
+    else
+        # give the server time to publish the next vchan
+        sleep 2
+        $BW client $DIR $DOMID $NODE $BLOCKSIZE $TRANSFER > /dev/null
+    fi
+    NODE=$((NODE + 1))
+done
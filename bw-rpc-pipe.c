@@ -0,0 +1,167 @@
+/**
+ * This is a program designed to test how pipelining RPC calls over one vchan
+ * improves on the lockstep pattern of bw-rpc, where the writer waits for a
+ * 12-byte reply before sending the next block. The client makes calls of
+ * blocksize bytes through libvchan_rpc, first with a window of 1 call, which
+ * is lockstep, then with a window of the given size; the server replies to
+ * each call with 12 bytes. A last pipelined pass runs with the integrity
+ * trailers of framed messages on, to show what the CRC32C costs.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "libvchan.h"
+
+unsigned long long total_size;
+int blocksize;
+char *buf;
+unsigned long long replies;
+
+inline double BW(unsigned long long bytes, long usec) {
+    double bw;
+    // uncomment below to measure in Mbit/s
+    bw = (double) ((((double)bytes/**8*/)/(1024*1024)) / (((double)usec)/1000000.0));
+    return bw;
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client domid nodeid blocksize transfer_size window\n"
+               "%s server domid nodeid blocksize transfer_size read_buffer_size write_buffer_size\n",
+               argv[0], argv[0]);
+       exit(1);
+}
+
+void reply_done(void *arg, int status, const void *reply, size_t size)
+{
+       if (status != 0 || size != 12) {
+               fprintf(stderr, "bad reply: status %d size %zu\n", status, size);
+               exit(1);
+       }
+       replies++;
+}
+
+void client(struct libvchan *ctrl, int window, int integrity)
+{
+       struct libvchan_rpc *rpc = libvchan_rpc_create(ctrl, window);
+       unsigned long long sent = 0;
+       struct timeval tv1, tv2;
+       struct iovec iov;
+       long t;
+
+       if (!rpc) {
+               perror("libvchan_rpc_create");
+               exit(1);
+       }
+       replies = 0;
+       gettimeofday(&tv1, NULL);
+       while (sent < total_size) {
+               iov.iov_base = buf;
+               iov.iov_len = sent + blocksize > total_size ? total_size - sent : blocksize;
+               if (libvchan_rpc_call(rpc, &iov, 1, reply_done, NULL) < 0) {
+                       perror("libvchan_rpc_call");
+                       exit(1);
+               }
+               sent += iov.iov_len;
+       }
+       if (libvchan_rpc_wait_all(rpc)) {
+               perror("libvchan_rpc_wait_all");
+               exit(1);
+       }
+       gettimeofday(&tv2, NULL);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       printf("window %3d, integrity %-3s: BW: %.3f MB/s (%llu bytes in %ld usec), %.0f calls/s\n",
+              window, integrity ? "on" : "off", BW(sent, t), sent, t,
+              (double)replies / ((double)t / 1000000.0));
+       libvchan_rpc_destroy(rpc);
+}
+
+void server(struct libvchan *ctrl)
+{
+       struct libvchan_rpc *rpc = libvchan_rpc_create(ctrl, 1);
+       unsigned long long received = 0;
+       char ack[12] = "ack";
+       struct iovec iov = { ack, sizeof(ack) };
+       uint32_t id;
+       void *data;
+       int size;
+
+       if (!rpc) {
+               perror("libvchan_rpc_create");
+               exit(1);
+       }
+       while (received < total_size) {
+               size = libvchan_rpc_recv(rpc, &id, &data);
+               if (size < 0 || libvchan_rpc_reply(rpc, id, 0, &iov, 1)) {
+                       perror("vchan rpc");
+                       exit(1);
+               }
+               received += size;
+       }
+       libvchan_rpc_destroy(rpc);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl;
+       int domid, nodeid, window = 0, is_server;
+
+       if (argc < 7)
+               usage(argv);
+       is_server = !strcmp(argv[1], "server");
+       if (!is_server && strcmp(argv[1], "client"))
+               usage(argv);
+       if (is_server && argc < 8)
+               usage(argv);
+
+       domid = atoi(argv[2]);
+       nodeid = atoi(argv[3]);
+       blocksize = atoi(argv[4]);
+       total_size = atoll(argv[5]);
+       if (!is_server)
+               window = atoi(argv[6]);
+       if (blocksize < 1 || (!is_server && window < 1))
+               usage(argv);
+       buf = malloc(blocksize);
+       if (!buf) {
+               perror("malloc");
+               exit(1);
+       }
+       memset(buf, 0x5a, blocksize);
+
+       printf("Running pipelined RPC test with domain %d on port %d, blocksize %d transfer_size %llu\n",
+              domid, nodeid, blocksize, total_size);
+
+       if (is_server)
+               ctrl = libvchan_server_init(domid, nodeid, atoi(argv[6]), atoi(argv[7]));
+       else
+               ctrl = libvchan_client_init(domid, nodeid);
+       if (!ctrl) {
+               perror("libvchan_*_init");
+               exit(1);
+       }
+       // one pass in lockstep, as bw-rpc does, then pipelined without and
+       // with integrity trailers
+       if (is_server) {
+               server(ctrl);
+               server(ctrl);
+               libvchan_set_integrity(ctrl, 1);
+               server(ctrl);
+       } else {
+               client(ctrl, 1, 0);
+               client(ctrl, window, 0);
+               libvchan_set_integrity(ctrl, 1);
+               client(ctrl, window, 1);
+       }
+       libvchan_close(ctrl);
+       free(buf);
+       return 0;
+}
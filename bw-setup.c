@@ -0,0 +1,112 @@
+/**
+ * This is a program designed to test how fast vchans can be set up. The
+ * server creates count vchans on consecutive node ids, holds them open for
+ * hold seconds so that a client can connect to them, and closes them; the
+ * client connects to each of them and closes it. In plain mode every vchan
+ * is set up with its own device and xenstore handles, in ctx mode through
+ * one libvchan_context.
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "libvchan.h"
+
+inline double OPS(unsigned long long ops, long usec) {
+    return (double)ops / (((double)usec)/1000000.0);
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client domid nodeid count [plain|ctx]\n"
+               "%s server domid nodeid count ring_size hold [plain|ctx]\n", argv[0], argv[0]);
+       exit(1);
+}
+
+long elapsed(struct timeval *tv1, struct timeval *tv2)
+{
+       return (tv2->tv_sec*1000000 + tv2->tv_usec) - (tv1->tv_sec*1000000 + tv1->tv_usec);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan **chans;
+       struct libvchan_context *ctx = NULL;
+       struct timeval tv1, tv2;
+       int domid, nodeid, count, ring_size = 0, hold = 0, use_ctx = 0, is_server = 0, i;
+
+       if (argc < 5)
+               usage(argv);
+       if (!strcmp(argv[1], "server")) {
+               if (argc < 7)
+                       usage(argv);
+               is_server = 1;
+               ring_size = atoi(argv[5]);
+               hold = atoi(argv[6]);
+               if (argc > 7)
+                       use_ctx = !strcmp(argv[7], "ctx");
+       } else if (!strcmp(argv[1], "client")) {
+               if (argc > 5)
+                       use_ctx = !strcmp(argv[5], "ctx");
+       } else
+               usage(argv);
+
+       domid = atoi(argv[2]);
+       nodeid = atoi(argv[3]);
+       count = atoi(argv[4]);
+       if (count < 1)
+               usage(argv);
+       chans = calloc(count, sizeof(*chans));
+       if (!chans) {
+               perror("calloc");
+               exit(1);
+       }
+
+       printf("Running setup rate test with domain %d on ports %d-%d, %s mode\n",
+              domid, nodeid, nodeid + count - 1, use_ctx ? "ctx" : "plain");
+
+       gettimeofday(&tv1, NULL);
+       if (use_ctx) {
+               ctx = libvchan_context_create(NULL);
+               if (!ctx) {
+                       perror("libvchan_context_create");
+                       exit(1);
+               }
+       }
+       for (i = 0; i < count; i++) {
+               if (is_server)
+                       chans[i] = use_ctx ?
+                               libvchan_server_init_ctx(ctx, domid, nodeid + i, ring_size, ring_size) :
+                               libvchan_server_init(domid, nodeid + i, ring_size, ring_size);
+               else
+                       chans[i] = use_ctx ?
+                               libvchan_client_init_ctx(ctx, domid, nodeid + i) :
+                               libvchan_client_init(domid, nodeid + i);
+               if (!chans[i]) {
+                       perror("libvchan_*_init");
+                       exit(1);
+               }
+       }
+       gettimeofday(&tv2, NULL);
+       printf("setup: %.1f vchans/s (%d in %ld usec)\n",
+              OPS(count, elapsed(&tv1, &tv2)), count, elapsed(&tv1, &tv2));
+
+       if (hold)
+               sleep(hold);
+       gettimeofday(&tv1, NULL);
+       for (i = 0; i < count; i++)
+               libvchan_close(chans[i]);
+       libvchan_context_destroy(ctx);
+       gettimeofday(&tv2, NULL);
+       printf("close: %.1f vchans/s (%d in %ld usec)\n",
+              OPS(count, elapsed(&tv1, &tv2)), count, elapsed(&tv1, &tv2));
+       free(chans);
+       return 0;
+}
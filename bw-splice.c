@@ -0,0 +1,155 @@
+/**
+ * This is a program designed to test how splicing a file through a vchan
+ * improves on bw-file, where the writer reads the file into a buffer and
+ * sends it, and the reader receives into a buffer and writes it out. The
+ * writer streams file "a" to the reader, which stores it as file "b", first
+ * copying through a user buffer of blocksize bytes, then with
+ * libvchan_splice_from_fd() and libvchan_splice_to_fd().
+ * It is based off the example test programs that accompany libxenvchan.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#include "libvchan.h"
+
+unsigned long long total_size;
+int blocksize;
+char *buf;
+
+inline double BW(unsigned long long bytes, long usec) {
+    double bw;
+    // uncomment below to measure in Mbit/s
+    bw = (double) ((((double)bytes/**8*/)/(1024*1024)) / (((double)usec)/1000000.0));
+    return bw;
+}
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s client domid nodeid blocksize transfer_size\n"
+               "%s server domid nodeid blocksize transfer_size read_buffer_size write_buffer_size\n",
+               argv[0], argv[0]);
+       exit(1);
+}
+
+void writer(struct libvchan *ctrl, int splice)
+{
+       unsigned long long sent = 0;
+       off_t offset = 0;
+       int f = open("a", O_RDONLY);
+       int size, sz;
+
+       if (f < 0) {
+               perror("open a");
+               exit(1);
+       }
+       while (sent < total_size) {
+               size = sent + blocksize > total_size ? total_size - sent : blocksize;
+               if (splice) {
+                       sz = libvchan_splice_from_fd(ctrl, f, &offset, size);
+               } else {
+                       sz = pread(f, buf, size, sent);
+                       if (sz > 0 && libvchan_write(ctrl, buf, sz) != sz)
+                               sz = -1;
+               }
+               if (sz <= 0) {
+                       perror("send file");
+                       exit(1);
+               }
+               sent += sz;
+       }
+       close(f);
+}
+
+void reader(struct libvchan *ctrl, int splice)
+{
+       unsigned long long received = 0;
+       struct timeval tv1, tv2;
+       off_t offset = 0;
+       int f = open("b", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+       int size, sz;
+       long t;
+
+       if (f < 0) {
+               perror("open b");
+               exit(1);
+       }
+       gettimeofday(&tv1, NULL);
+       while (received < total_size) {
+               size = received + blocksize > total_size ? total_size - received : blocksize;
+               if (splice) {
+                       sz = libvchan_splice_to_fd(ctrl, f, &offset, size);
+               } else {
+                       sz = libvchan_read(ctrl, buf, size);
+                       if (sz > 0 && pwrite(f, buf, sz, received) != sz)
+                               sz = -1;
+               }
+               if (sz <= 0) {
+                       perror("receive file");
+                       exit(1);
+               }
+               received += sz;
+       }
+       gettimeofday(&tv2, NULL);
+       close(f);
+       t = (tv2.tv_sec*1000000 + tv2.tv_usec) - (tv1.tv_sec*1000000 + tv1.tv_usec);
+       printf("%s: BW: %.3f MB/s (%llu bytes in %ld usec)\n", splice ? "splice" : "copy  ",
+              BW(received, t), received, t);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl;
+       int domid, nodeid, is_server;
+
+       if (argc < 6)
+               usage(argv);
+       is_server = !strcmp(argv[1], "server");
+       if (!is_server && strcmp(argv[1], "client"))
+               usage(argv);
+       if (is_server && argc < 8)
+               usage(argv);
+
+       domid = atoi(argv[2]);
+       nodeid = atoi(argv[3]);
+       blocksize = atoi(argv[4]);
+       total_size = atoll(argv[5]);
+       if (blocksize < 1)
+               usage(argv);
+       buf = malloc(blocksize);
+       if (!buf) {
+               perror("malloc");
+               exit(1);
+       }
+
+       printf("Running splice test with domain %d on port %d, blocksize %d transfer_size %llu\n",
+              domid, nodeid, blocksize, total_size);
+
+       if (is_server)
+               ctrl = libvchan_server_init(domid, nodeid, atoi(argv[6]), atoi(argv[7]));
+       else
+               ctrl = libvchan_client_init(domid, nodeid);
+       if (!ctrl) {
+               perror("libvchan_*_init");
+               exit(1);
+       }
+       ctrl->blocking = 1;
+       // the server writes the file out, the client reads it in
+       if (is_server) {
+               reader(ctrl, 0);
+               reader(ctrl, 1);
+       } else {
+               writer(ctrl, 0);
+               writer(ctrl, 1);
+       }
+       libvchan_close(ctrl);
+       free(buf);
+       return 0;
+}
@@ -0,0 +1,358 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Copy engines used to move data into and out of the rings. Each engine has
+ *  a temporal kernel and a non-temporal one; the latter uses streaming stores
+ *  so that large transfers do not evict the producer's working set, and
+ *  prefetches the source ahead of the copy. The engine is picked by CPUID
+ *  when a vchan is set up.
+ *
+ *  Copy-and-checksum kernels fold each word into a CRC32C as it is copied,
+ *  for the integrity trailers of framed messages, so the data is only read
+ *  once: with the SSE4.2 crc32 instruction where the CPU has it, and with
+ *  slicing-by-8 tables otherwise.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libvchan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// how far ahead of the copy to prefetch the source
+#define PREFETCH_DISTANCE 512
+
+// default size from which the send path uses non-temporal stores
+#define DEFAULT_NT_THRESHOLD (256 * 1024)
+
+// CRC32C (Castagnoli) polynomial, bit-reflected
+#define CRC32C_POLY 0x82f63b78
+
+static void copy_memcpy(void *dst, const void *src, size_t size)
+{
+   memcpy(dst, src, size);
+}
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+   uint32_t crc;
+   int i, j;
+   for (i = 0; i < 256; i++) {
+       crc = i;
+       for (j = 0; j < 8; j++)
+           crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+       crc_table[0][i] = crc;
+   }
+   for (i = 0; i < 256; i++)
+       for (j = 1; j < 8; j++)
+           crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+}
+
+static uint32_t copy_crc_table(void *dst, const void *src, size_t size, uint32_t crc)
+{
+   const uint8_t *s = src;
+   uint8_t *d = dst;
+   uint64_t v;
+   size_t i = 0;
+   for (; i + 8 <= size; i += 8) {
+       memcpy(&v, s + i, 8);
+       memcpy(d + i, &v, 8);
+       // slicing-by-8 takes the word in little-endian order
+       v ^= crc;
+       crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff] ^
+             crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff] ^
+             crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff] ^
+             crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+   }
+   for (; i < size; i++) {
+       d[i] = s[i];
+       crc = (crc >> 8) ^ crc_table[0][(crc ^ s[i]) & 0xff];
+   }
+   return crc;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/**
+ * Copy the unaligned head with memcpy so that dst is aligned to align,
+ * returning the number of bytes copied.
+ */
+static size_t copy_head(void *dst, const void *src, size_t size, size_t align)
+{
+   size_t head = (align - ((uintptr_t)dst & (align - 1))) & (align - 1);
+   if (head > size)
+       head = size;
+   memcpy(dst, src, head);
+   return head;
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2(void *dst, const void *src, size_t size)
+{
+   size_t i = copy_head(dst, src, size, 16);
+   for (; i + 64 <= size; i += 64) {
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE, _MM_HINT_T0);
+       __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+       __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+       __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+       __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+       _mm_store_si128((__m128i *)(dst + i), a);
+       _mm_store_si128((__m128i *)(dst + i + 16), b);
+       _mm_store_si128((__m128i *)(dst + i + 32), c);
+       _mm_store_si128((__m128i *)(dst + i + 48), d);
+   }
+   memcpy(dst + i, src + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2_nt(void *dst, const void *src, size_t size)
+{
+   size_t i = copy_head(dst, src, size, 16);
+   for (; i + 64 <= size; i += 64) {
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE, _MM_HINT_NTA);
+       __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+       __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+       __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+       __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+       _mm_stream_si128((__m128i *)(dst + i), a);
+       _mm_stream_si128((__m128i *)(dst + i + 16), b);
+       _mm_stream_si128((__m128i *)(dst + i + 32), c);
+       _mm_stream_si128((__m128i *)(dst + i + 48), d);
+   }
+   // streaming stores are weakly ordered; fence before the index update
+   _mm_sfence();
+   memcpy(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(void *dst, const void *src, size_t size)
+{
+   size_t i = copy_head(dst, src, size, 32);
+   for (; i + 128 <= size; i += 128) {
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE, _MM_HINT_T0);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 64, _MM_HINT_T0);
+       __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+       __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+       __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+       __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+       _mm256_store_si256((__m256i *)(dst + i), a);
+       _mm256_store_si256((__m256i *)(dst + i + 32), b);
+       _mm256_store_si256((__m256i *)(dst + i + 64), c);
+       _mm256_store_si256((__m256i *)(dst + i + 96), d);
+   }
+   memcpy(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2_nt(void *dst, const void *src, size_t size)
+{
+   size_t i = copy_head(dst, src, size, 32);
+   for (; i + 128 <= size; i += 128) {
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE, _MM_HINT_NTA);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 64, _MM_HINT_NTA);
+       __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+       __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+       __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+       __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+       _mm256_stream_si256((__m256i *)(dst + i), a);
+       _mm256_stream_si256((__m256i *)(dst + i + 32), b);
+       _mm256_stream_si256((__m256i *)(dst + i + 64), c);
+       _mm256_stream_si256((__m256i *)(dst + i + 96), d);
+   }
+   _mm_sfence();
+   memcpy(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(void *dst, const void *src, size_t size)
+{
+   size_t i = copy_head(dst, src, size, 64);
+   for (; i + 256 <= size; i += 256) {
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE, _MM_HINT_T0);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 64, _MM_HINT_T0);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 128, _MM_HINT_T0);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 192, _MM_HINT_T0);
+       __m512i a = _mm512_loadu_si512(src + i);
+       __m512i b = _mm512_loadu_si512(src + i + 64);
+       __m512i c = _mm512_loadu_si512(src + i + 128);
+       __m512i d = _mm512_loadu_si512(src + i + 192);
+       _mm512_store_si512(dst + i, a);
+       _mm512_store_si512(dst + i + 64, b);
+       _mm512_store_si512(dst + i + 128, c);
+       _mm512_store_si512(dst + i + 192, d);
+   }
+   memcpy(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512_nt(void *dst, const void *src, size_t size)
+{
+   size_t i = copy_head(dst, src, size, 64);
+   for (; i + 256 <= size; i += 256) {
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE, _MM_HINT_NTA);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 64, _MM_HINT_NTA);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 128, _MM_HINT_NTA);
+       _mm_prefetch((const char *)src + i + PREFETCH_DISTANCE + 192, _MM_HINT_NTA);
+       __m512i a = _mm512_loadu_si512(src + i);
+       __m512i b = _mm512_loadu_si512(src + i + 64);
+       __m512i c = _mm512_loadu_si512(src + i + 128);
+       __m512i d = _mm512_loadu_si512(src + i + 192);
+       _mm512_stream_si512(dst + i, a);
+       _mm512_stream_si512(dst + i + 64, b);
+       _mm512_stream_si512(dst + i + 128, c);
+       _mm512_stream_si512(dst + i + 192, d);
+   }
+   _mm_sfence();
+   memcpy(dst + i, src + i, size - i);
+}
+
+#ifdef __x86_64__
+#define HAVE_CRC_SSE42 1
+
+__attribute__((target("sse4.2")))
+static uint32_t copy_crc_sse42(void *dst, const void *src, size_t size, uint32_t crc)
+{
+   const uint8_t *s = src;
+   uint8_t *d = dst;
+   uint64_t a, b, c, e, v = crc;
+   size_t i = 0;
+   for (; i + 32 <= size; i += 32) {
+       memcpy(&a, s + i, 8);
+       memcpy(&b, s + i + 8, 8);
+       memcpy(&c, s + i + 16, 8);
+       memcpy(&e, s + i + 24, 8);
+       memcpy(d + i, &a, 8);
+       memcpy(d + i + 8, &b, 8);
+       memcpy(d + i + 16, &c, 8);
+       memcpy(d + i + 24, &e, 8);
+       v = _mm_crc32_u64(v, a);
+       v = _mm_crc32_u64(v, b);
+       v = _mm_crc32_u64(v, c);
+       v = _mm_crc32_u64(v, e);
+   }
+   for (; i + 8 <= size; i += 8) {
+       memcpy(&a, s + i, 8);
+       memcpy(d + i, &a, 8);
+       v = _mm_crc32_u64(v, a);
+   }
+   crc = v;
+   for (; i < size; i++) {
+       d[i] = s[i];
+       crc = _mm_crc32_u8(crc, s[i]);
+   }
+   return crc;
+}
+
+#endif
+
+#endif
+
+static const struct {
+   const char *name;
+   libvchan_copy_fn copy, copy_nt;
+} engines[VCHAN_COPY_AVX512 + 1] = {
+   [VCHAN_COPY_MEMCPY] = { "memcpy", copy_memcpy, copy_memcpy },
+#ifdef HAVE_X86_KERNELS
+   [VCHAN_COPY_SSE2] = { "sse2", copy_sse2, copy_sse2_nt },
+   [VCHAN_COPY_AVX2] = { "avx2", copy_avx2, copy_avx2_nt },
+   [VCHAN_COPY_AVX512] = { "avx512", copy_avx512, copy_avx512_nt },
+#endif
+};
+
+static int engine_supported(int engine)
+{
+   if (engine <= VCHAN_COPY_AUTO || engine > VCHAN_COPY_AVX512 || !engines[engine].copy)
+       return 0;
+#ifdef HAVE_X86_KERNELS
+   __builtin_cpu_init();
+   if (engine == VCHAN_COPY_SSE2)
+       return __builtin_cpu_supports("sse2");
+   if (engine == VCHAN_COPY_AVX2)
+       return __builtin_cpu_supports("avx2");
+   if (engine == VCHAN_COPY_AVX512)
+       return __builtin_cpu_supports("avx512f");
+#endif
+   return 1;
+}
+
+libvchan_crc_fn libvchan_crc_kernel(int engine)
+{
+   pthread_once(&crc_table_once, crc_table_init);
+   if (engine == VCHAN_CRC_TABLE)
+       return copy_crc_table;
+#ifdef HAVE_CRC_SSE42
+   __builtin_cpu_init();
+   if (engine == VCHAN_CRC_SSE42 && __builtin_cpu_supports("sse4.2"))
+       return copy_crc_sse42;
+#endif
+   return NULL;
+}
+
+const char *libvchan_copy_name(int engine)
+{
+   if (!engine_supported(engine))
+       return NULL;
+   return engines[engine].name;
+}
+
+libvchan_copy_fn libvchan_copy_kernel(int engine, int nontemporal)
+{
+   if (!engine_supported(engine))
+       return NULL;
+   return nontemporal ? engines[engine].copy_nt : engines[engine].copy;
+}
+
+int libvchan_copy_init(struct libvchan_copy *copy, int engine, size_t nt_threshold)
+{
+   int best;
+   for (best = VCHAN_COPY_AVX512; best > VCHAN_COPY_MEMCPY; best--)
+       if (engine_supported(best))
+           break;
+   if (engine == VCHAN_COPY_AUTO) {
+       // plain copies are left to the C library, which already does them well
+       copy->copy = copy_memcpy;
+       copy->copy_nt = engines[best].copy_nt;
+       engine = best;
+   } else if (engine_supported(engine)) {
+       copy->copy = engines[engine].copy;
+       copy->copy_nt = engines[engine].copy_nt;
+   } else {
+       return -1;
+   }
+   copy->copy_crc = libvchan_crc_kernel(VCHAN_CRC_SSE42);
+   if (!copy->copy_crc)
+       copy->copy_crc = libvchan_crc_kernel(VCHAN_CRC_TABLE);
+   copy->engine = engine;
+   copy->nt_threshold = nt_threshold ? nt_threshold : DEFAULT_NT_THRESHOLD;
+   return 0;
+}
+
+int libvchan_set_copy(struct libvchan *ctrl, int engine, size_t nt_threshold)
+{
+   return libvchan_copy_init(&ctrl->copy, engine, nt_threshold);
+}
@@ -0,0 +1,614 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Remote file I/O forwarding over a vchan, as framed messages. The server
+ *  runs requests in order. Writes are not answered one by one: the server
+ *  acknowledges the bytes written since its last ack whenever it runs out
+ *  of requests or that count reaches VCHAN_FIO_ACK_BYTES, and the client
+ *  keeps sending while less than a window of written bytes is
+ *  unacknowledged. An fsync is handed to a server
+ *  thread, so that the writes after it go on while it runs, and completes
+ *  on its own message.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "libvchan.h"
+
+#ifdef __NR_openat2
+#include <linux/openat2.h>
+#define HAVE_OPENAT2
+#endif
+
+// the server acknowledges writes at least every this many bytes
+#define VCHAN_FIO_ACK_BYTES (1 << 20)
+#define MAX_PATH 4096
+
+enum {
+   FIO_OPEN = 1,
+   FIO_PWRITE,
+   FIO_PREAD,
+   FIO_FSYNC,
+   FIO_CLOSE,
+};
+
+enum {
+   /* result of an open, pread or close, followed by the data read */
+   FIO_RESULT = 1,
+   /* bytes written since the last ack, and the errno of the first that failed */
+   FIO_ACK,
+   /* result of an fsync */
+   FIO_SYNCED,
+};
+
+struct fio_request {
+   uint32_t op;
+   int32_t fd;
+   uint64_t seq;
+   uint64_t offset;
+   uint64_t len;
+   /* open(2) flags and mode */
+   int32_t flags;
+   uint32_t mode;
+};
+
+struct fio_reply {
+   uint32_t type;
+   /* errno, or 0 */
+   int32_t error;
+   uint64_t seq;
+   int64_t result;
+};
+
+struct libvchan_fio {
+   struct libvchan *ctrl;
+   size_t window;
+   uint64_t seq;
+   /* bytes of pwrite data sent, and acknowledged by the server */
+   uint64_t written, acked;
+   /* sequence number of the latest completed fsync */
+   uint64_t synced;
+   /* first error of a write or fsync; later calls fail with it */
+   int error;
+};
+
+struct libvchan_fio *libvchan_fio_create(struct libvchan *ctrl, size_t window)
+{
+   struct libvchan_fio *fio = calloc(1, sizeof(*fio));
+   if (!fio)
+       return NULL;
+   fio->ctrl = ctrl;
+   fio->window = window;
+   ctrl->blocking = 1;
+   return fio;
+}
+
+void libvchan_fio_destroy(struct libvchan_fio *fio)
+{
+   free(fio);
+}
+
+static int send_request(struct libvchan_fio *fio, struct fio_request *req,
+                        const void *data, size_t size)
+{
+   struct iovec iov[2] = { { req, sizeof(*req) }, { (void *)data, size } };
+   req->seq = ++fio->seq;
+   if (libvchan_msg_sendv(fio->ctrl, iov, size ? 2 : 1) <= 0) {
+       errno = EIO;
+       return -1;
+   }
+   return 0;
+}
+
+/**
+ * Handle one reply, waiting for it unless wait is 0. The reply to the
+ * request seq, if any, is returned through result and its data copied to
+ * data.
+ * returns 0 if there was no reply, -1 on error, 1 for another reply, or 2
+ * for the reply to seq
+ */
+static int handle_reply(struct libvchan_fio *fio, int wait, uint64_t seq,
+                        int64_t *result, void *data, size_t size)
+{
+   struct fio_reply *reply;
+   void *msg;
+   int rv;
+
+   fio->ctrl->blocking = wait;
+   rv = libvchan_msg_recv_pooled(fio->ctrl, &msg);
+   fio->ctrl->blocking = 1;
+   if (rv == 0)
+       return 0;
+   if (rv < (int)sizeof(*reply)) {
+       errno = EIO;
+       return -1;
+   }
+   reply = msg;
+   switch (reply->type) {
+   case FIO_ACK:
+       fio->acked += reply->result;
+       break;
+   case FIO_SYNCED:
+       fio->synced = reply->seq;
+       break;
+   case FIO_RESULT:
+       if (reply->seq != seq)
+           break;
+       *result = reply->result;
+       if (reply->result < 0)
+           errno = reply->error;
+       else if (data)
+           memcpy(data, reply + 1, (size_t)rv - sizeof(*reply) < size ?
+                  (size_t)rv - sizeof(*reply) : size);
+       return 2;
+   }
+   if (reply->error && !fio->error)
+       fio->error = reply->error;
+   return 1;
+}
+
+/**
+ * Wait for the reply to request seq.
+ * returns -1 on error, or its result
+ */
+static int64_t wait_result(struct libvchan_fio *fio, uint64_t seq, void *data, size_t size)
+{
+   int64_t result = -1;
+   int rv;
+   do {
+       rv = handle_reply(fio, 1, seq, &result, data, size);
+       if (rv < 0)
+           return -1;
+   } while (rv != 2);
+   return result;
+}
+
+/** Take the replies that have arrived, without waiting. */
+static int drain_replies(struct libvchan_fio *fio)
+{
+   int rv;
+   while ((rv = handle_reply(fio, 0, 0, NULL, NULL, 0)) > 0)
+       ;
+   return rv;
+}
+
+static int check_error(struct libvchan_fio *fio)
+{
+   if (fio->error) {
+       errno = fio->error;
+       return -1;
+   }
+   return 0;
+}
+
+int libvchan_fio_open(struct libvchan_fio *fio, const char *path, int flags, mode_t mode)
+{
+   struct fio_request req = { .op = FIO_OPEN, .flags = flags, .mode = mode };
+   size_t len = strlen(path) + 1;
+   if (len > MAX_PATH) {
+       errno = ENAMETOOLONG;
+       return -1;
+   }
+   req.len = len;
+   if (send_request(fio, &req, path, len))
+       return -1;
+   return wait_result(fio, req.seq, NULL, 0);
+}
+
+ssize_t libvchan_fio_pwrite(struct libvchan_fio *fio, int fd, const void *buf, size_t len, off_t offset)
+{
+   struct fio_request req = { .op = FIO_PWRITE, .fd = fd, .offset = offset, .len = len };
+
+   if (drain_replies(fio) < 0 || check_error(fio))
+       return -1;
+   // keep at most a window of unacknowledged bytes in flight
+   while (fio->written - fio->acked >= fio->window && fio->written != fio->acked) {
+       if (handle_reply(fio, 1, 0, NULL, NULL, 0) < 0)
+           return -1;
+   }
+   if (check_error(fio) || send_request(fio, &req, buf, len))
+       return -1;
+   fio->written += len;
+   return len;
+}
+
+ssize_t libvchan_fio_pread(struct libvchan_fio *fio, int fd, void *buf, size_t len, off_t offset)
+{
+   struct fio_request req = { .op = FIO_PREAD, .fd = fd, .offset = offset, .len = len };
+   if (send_request(fio, &req, NULL, 0))
+       return -1;
+   return wait_result(fio, req.seq, buf, len);
+}
+
+int64_t libvchan_fio_fsync(struct libvchan_fio *fio, int fd)
+{
+   struct fio_request req = { .op = FIO_FSYNC, .fd = fd };
+   if (drain_replies(fio) < 0 || check_error(fio) || send_request(fio, &req, NULL, 0))
+       return -1;
+   return req.seq;
+}
+
+int libvchan_fio_wait(struct libvchan_fio *fio, int64_t ticket)
+{
+   if (ticket < 0)
+       return -1;
+   while (fio->synced < (uint64_t)ticket) {
+       if (handle_reply(fio, 1, 0, NULL, NULL, 0) < 0)
+           return -1;
+   }
+   return check_error(fio);
+}
+
+int libvchan_fio_close(struct libvchan_fio *fio, int fd)
+{
+   struct fio_request req = { .op = FIO_CLOSE, .fd = fd };
+   if (send_request(fio, &req, NULL, 0))
+       return -1;
+   // the server closes after the writes before, so their acks come first
+   if (wait_result(fio, req.seq, NULL, 0) < 0)
+       return -1;
+   return check_error(fio);
+}
+
+/*
+ * Server side
+ */
+
+struct fsync_job {
+   int fd;
+   uint64_t seq;
+   struct fsync_job *next;
+};
+
+struct fio_server {
+   struct libvchan *ctrl;
+   int dirfd;
+   /* bytes written, those acknowledged, and the first write error since */
+   uint64_t written, acked;
+   int error;
+   /* fsyncs for the sync thread, oldest first */
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   struct fsync_job *head, *tail;
+   int stop;
+   /* nonzero for the fds opened for the client, which may use no others */
+   unsigned char *fds;
+   int nfds;
+   /* buffer for pread data, after room for the reply */
+   void *buf;
+   size_t buf_size;
+};
+
+static int send_reply(struct fio_server *srv, struct fio_reply *reply, const void *data, size_t size)
+{
+   struct iovec iov[2] = { { reply, sizeof(*reply) }, { (void *)data, size } };
+   return libvchan_msg_sendv(srv->ctrl, iov, size ? 2 : 1) > 0 ? 0 : -1;
+}
+
+static int send_ack(struct fio_server *srv)
+{
+   struct fio_reply reply = { .type = FIO_ACK, .error = srv->error,
+                              .result = srv->written - srv->acked };
+   srv->acked = srv->written;
+   srv->error = 0;
+   return send_reply(srv, &reply, NULL, 0);
+}
+
+static void *sync_thread(void *arg)
+{
+   struct fio_server *srv = arg;
+   struct fio_reply reply = { .type = FIO_SYNCED };
+   struct fsync_job *job;
+
+   pthread_mutex_lock(&srv->lock);
+   while (1) {
+       while (!srv->head && !srv->stop)
+           pthread_cond_wait(&srv->cond, &srv->lock);
+       job = srv->head;
+       if (!job)
+           break;
+       srv->head = job->next;
+       if (!srv->head)
+           srv->tail = NULL;
+       pthread_mutex_unlock(&srv->lock);
+       reply.seq = job->seq;
+       reply.result = fsync(job->fd);
+       reply.error = reply.result < 0 ? errno : 0;
+       close(job->fd);
+       free(job);
+       send_reply(srv, &reply, NULL, 0);
+       pthread_mutex_lock(&srv->lock);
+   }
+   pthread_mutex_unlock(&srv->lock);
+   return NULL;
+}
+
+static int queue_fsync(struct fio_server *srv, int fd, uint64_t seq)
+{
+   struct fsync_job *job = malloc(sizeof(*job));
+   if (!job)
+       return -1;
+   // the client may close fd before the fsync runs
+   job->fd = dup(fd);
+   job->seq = seq;
+   job->next = NULL;
+   pthread_mutex_lock(&srv->lock);
+   if (srv->tail)
+       srv->tail->next = job;
+   else
+       srv->head = job;
+   srv->tail = job;
+   pthread_cond_signal(&srv->cond);
+   pthread_mutex_unlock(&srv->lock);
+   return 0;
+}
+
+/** Whether a path may lead out of the served directory */
+static int path_escapes(const char *path)
+{
+   const char *p = path;
+   if (*p == '/')
+       return 1;
+   while (*p) {
+       if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+           return 1;
+       p = strchrnul(p, '/');
+       while (*p == '/')
+           p++;
+   }
+   return 0;
+}
+
+/**
+ * Open path beneath dirfd a component at a time, refusing symbolic links,
+ * for kernels without openat2().
+ */
+static int open_nofollow(int dirfd, const char *path, int flags, mode_t mode)
+{
+   char *copy = strdup(path), *name, *next;
+   int dir = dirfd, fd, err;
+
+   if (!copy)
+       return -1;
+   name = copy;
+   while ((next = strchr(name, '/'))) {
+       *next++ = '\0';
+       while (*next == '/')
+           next++;
+       // a trailing slash ends the last component
+       if (*next == '\0')
+           break;
+       fd = openat(dir, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+       if (dir != dirfd)
+           close(dir);
+       if (fd < 0) {
+           free(copy);
+           return -1;
+       }
+       dir = fd;
+       name = next;
+   }
+   fd = openat(dir, name, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+   err = errno;
+   if (dir != dirfd)
+       close(dir);
+   free(copy);
+   errno = err;
+   return fd;
+}
+
+/** Open path without leaving dirfd or following symbolic links */
+static int open_beneath(int dirfd, const char *path, int flags, mode_t mode)
+{
+#ifdef HAVE_OPENAT2
+   struct open_how how = { .flags = flags | O_CLOEXEC,
+                           .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS };
+   int fd;
+   // openat2() refuses a mode that open() would ignore
+   if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+       how.mode = mode;
+   fd = syscall(__NR_openat2, dirfd, path, &how, sizeof(how));
+   if (fd >= 0 || errno != ENOSYS)
+       return fd;
+#endif
+   return open_nofollow(dirfd, path, flags, mode);
+}
+
+/** Record fd as opened for the client; returns -1 on error, or 0 */
+static int own_fd(struct fio_server *srv, int fd)
+{
+   unsigned char *fds;
+   int n;
+
+   if (fd >= srv->nfds) {
+       for (n = srv->nfds ? srv->nfds : 64; n <= fd; n *= 2)
+           ;
+       fds = realloc(srv->fds, n);
+       if (!fds)
+           return -1;
+       memset(fds + srv->nfds, 0, n - srv->nfds);
+       srv->fds = fds;
+       srv->nfds = n;
+   }
+   srv->fds[fd] = 1;
+   return 0;
+}
+
+static int owns_fd(struct fio_server *srv, int fd)
+{
+   return fd >= 0 && fd < srv->nfds && srv->fds[fd];
+}
+
+/** Run one request; returns -1 if the connection failed, or 0 */
+static int serve_request(struct fio_server *srv, struct fio_request *req, void *data, size_t size)
+{
+   struct fio_reply reply = { .type = FIO_RESULT, .seq = req->seq };
+   char *path;
+   ssize_t rv;
+
+   switch (req->op) {
+   case FIO_PWRITE:
+       if (size != req->len)
+           return -1;
+       if (!owns_fd(srv, req->fd)) {
+           rv = -1;
+           errno = EBADF;
+       } else
+           rv = pwrite(req->fd, data, size, req->offset);
+       if (rv != (ssize_t)size && !srv->error)
+           srv->error = rv < 0 ? errno : EIO;
+       srv->written += size;
+       return 0;
+   case FIO_FSYNC:
+       // the errors of the writes before must reach the client before
+       // the fsync can complete
+       if (srv->written != srv->acked && send_ack(srv))
+           return -1;
+       reply.type = FIO_SYNCED;
+       reply.result = -1;
+       if (!owns_fd(srv, req->fd)) {
+           reply.error = EBADF;
+           break;
+       }
+       if (queue_fsync(srv, req->fd, req->seq) == 0)
+           return 0;
+       reply.error = ENOMEM;
+       break;
+   case FIO_OPEN:
+       path = data;
+       if (size == 0 || path[size - 1] != '\0')
+           return -1;
+       if (path_escapes(path)) {
+           reply.result = -1;
+           reply.error = EACCES;
+           break;
+       }
+       reply.result = open_beneath(srv->dirfd, path, req->flags, req->mode);
+       if (reply.result >= 0 && own_fd(srv, reply.result)) {
+           close(reply.result);
+           reply.result = -1;
+           reply.error = ENOMEM;
+       }
+       break;
+   case FIO_PREAD:
+       if (!owns_fd(srv, req->fd)) {
+           reply.result = -1;
+           reply.error = EBADF;
+           break;
+       }
+       if (req->len > srv->buf_size) {
+           void *buf = realloc(srv->buf, req->len);
+           if (!buf) {
+               reply.result = -1;
+               reply.error = ENOMEM;
+               break;
+           }
+           srv->buf = buf;
+           srv->buf_size = req->len;
+       }
+       reply.result = pread(req->fd, srv->buf, req->len, req->offset);
+       if (reply.result < 0)
+           reply.error = errno;
+       return send_reply(srv, &reply, srv->buf, reply.result > 0 ? reply.result : 0);
+   case FIO_CLOSE:
+       if (!owns_fd(srv, req->fd)) {
+           reply.result = -1;
+           reply.error = EBADF;
+           break;
+       }
+       srv->fds[req->fd] = 0;
+       reply.result = close(req->fd);
+       break;
+   default:
+       reply.result = -1;
+       reply.error = EINVAL;
+       break;
+   }
+   if (reply.result < 0 && !reply.error)
+       reply.error = errno;
+   return send_reply(srv, &reply, NULL, 0);
+}
+
+int libvchan_fio_serve(struct libvchan *ctrl, int dirfd)
+{
+   struct fio_server srv = { .ctrl = ctrl, .dirfd = dirfd };
+   struct fio_request *req;
+   pthread_t thread;
+   void *msg;
+   int size, fd, rv = 0;
+
+   // the sync thread sends its replies alongside ours
+   if (libvchan_set_threaded(ctrl, VCHAN_THREAD_SHARED))
+       return -1;
+   ctrl->blocking = 1;
+   pthread_mutex_init(&srv.lock, NULL);
+   pthread_cond_init(&srv.cond, NULL);
+   if (pthread_create(&thread, NULL, sync_thread, &srv))
+       return -1;
+
+   while (1) {
+       size = libvchan_msg_recv_pooled(ctrl, &msg);
+       if (size < 0) {
+           // a close by the client ends the session
+           rv = libvchan_is_open(ctrl) ? -1 : 0;
+           break;
+       }
+       if (size < (int)sizeof(*req)) {
+           rv = -1;
+           break;
+       }
+       req = msg;
+       if (serve_request(&srv, req, req + 1, size - sizeof(*req))) {
+           rv = -1;
+           break;
+       }
+       // acknowledge writes once we run out of requests, or every so often
+       if (srv.written != srv.acked &&
+           (srv.written - srv.acked >= VCHAN_FIO_ACK_BYTES || libvchan_data_ready(ctrl) == 0) &&
+           send_ack(&srv)) {
+           rv = -1;
+           break;
+       }
+   }
+
+   pthread_mutex_lock(&srv.lock);
+   srv.stop = 1;
+   pthread_cond_signal(&srv.cond);
+   pthread_mutex_unlock(&srv.lock);
+   pthread_join(thread, NULL);
+   pthread_mutex_destroy(&srv.lock);
+   pthread_cond_destroy(&srv.cond);
+   // the client's files are not left open for the next session
+   for (fd = 0; fd < srv.nfds; fd++)
+       if (srv.fds[fd])
+           close(fd);
+   free(srv.fds);
+   free(srv.buf);
+   return rv;
+}
@@ -44,35 +44,256 @@
 #include <xen/sys/gntalloc.h>
 #include <xen/sys/gntdev.h>
 #include "libvchan.h"
-
-#ifndef PAGE_SHIFT
-#define PAGE_SHIFT 12
-#endif
-
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
+#include "libvchan_private.h"
 
 #ifndef offsetof
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 #endif
 
 #define max(a,b) ((a > b) ? a : b)
+#define min(a,b) ((a < b) ? a : b)
+
+// largest ring whose page grants are listed directly in the shared page
+#define MAX_DIRECT_ORDER (PAGE_SHIFT + 8)
+// largest ring (64 MiB), whose grants are listed in indirect pages (v2 only)
+#define MAX_INDIRECT_ORDER (PAGE_SHIFT + 14)
+// pages granted or mapped per ioctl
+#define GNT_BATCH 256
+
+struct libvchan_context {
+   /* event channel fd shared through this poller, if any */
+   struct libvchan_poller *poller;
+   /* opened on first use, -1 or NULL until then */
+   int gntalloc_fd;
+   int gntdev_fd;
+   struct xs_handle *xs_srv;
+   struct xs_handle *xs_cli;
+   /* our domain id, read from xs_srv */
+   int domid;
+};
+
+struct libvchan_context *libvchan_context_create(struct libvchan_poller *poller)
+{
+   struct libvchan_context *ctx = calloc(1, sizeof(*ctx));
+   if (!ctx)
+       return NULL;
+   ctx->poller = poller;
+   ctx->gntalloc_fd = ctx->gntdev_fd = -1;
+   ctx->domid = -1;
+   return ctx;
+}
+
+void libvchan_context_destroy(struct libvchan_context *ctx)
+{
+   if (!ctx)
+       return;
+   if (ctx->gntalloc_fd != -1)
+       close(ctx->gntalloc_fd);
+   if (ctx->gntdev_fd != -1)
+       close(ctx->gntdev_fd);
+   if (ctx->xs_srv)
+       xs_daemon_close(ctx->xs_srv);
+   if (ctx->xs_cli)
+       xs_daemon_close(ctx->xs_cli);
+   free(ctx);
+}
+
+static int ctx_gntalloc_fd(struct libvchan_context *ctx)
+{
+   if (ctx->gntalloc_fd == -1)
+       ctx->gntalloc_fd = open("/dev/xen/gntalloc", O_RDWR);
+   return ctx->gntalloc_fd;
+}
+
+static int ctx_gntdev_fd(struct libvchan_context *ctx)
+{
+   if (ctx->gntdev_fd == -1)
+       ctx->gntdev_fd = open("/dev/xen/gntdev", O_RDWR);
+   return ctx->gntdev_fd;
+}
+
+/**
+ * The xenstore connection of the server side, and our domain id.
+ * returns NULL on error
+ */
+static struct xs_handle *ctx_xs_srv(struct libvchan_context *ctx, int *domid)
+{
+   char *domid_str;
+   if (!ctx->xs_srv) {
+       ctx->xs_srv = xs_domain_open();
+       if (!ctx->xs_srv)
+           return NULL;
+   }
+   if (ctx->domid == -1) {
+       domid_str = xs_read(ctx->xs_srv, 0, "domid", NULL);
+       if (!domid_str)
+           return NULL;
+       ctx->domid = atoi(domid_str);
+       free(domid_str);
+   }
+   *domid = ctx->domid;
+   return ctx->xs_srv;
+}
+
+static struct xs_handle *ctx_xs_cli(struct libvchan_context *ctx)
+{
+   if (!ctx->xs_cli) {
+       ctx->xs_cli = xs_daemon_open();
+       if (!ctx->xs_cli)
+           ctx->xs_cli = xs_domain_open();
+   }
+   return ctx->xs_cli;
+}
+
+/**
+ * Point the control structure at the indexes and flags of the shared page
+ * for the layout in ctrl->version, and return the grant list.
+ * left is client write, server read; right is client read, server write.
+ */
+static uint32_t *init_layout(struct libvchan *ctrl)
+{
+   struct libvchan_ring *left = ctrl->is_server ? &ctrl->read : &ctrl->write;
+   struct libvchan_ring *right = ctrl->is_server ? &ctrl->write : &ctrl->read;
+   if (ctrl->version == VCHAN_VERSION_2) {
+       struct vchan_interface_v2 *v2 = (struct vchan_interface_v2 *)ctrl->ring;
+       left->cons = &v2->left_cons;
+       left->prod = &v2->left_prod;
+       right->cons = &v2->right_cons;
+       right->prod = &v2->right_prod;
+       ctrl->cli_live = &v2->cli_live;
+       ctrl->srv_live = &v2->srv_live;
+       ctrl->cli_notify = &v2->cli_notify;
+       ctrl->srv_notify = &v2->srv_notify;
+       ctrl->cli_mark = v2->cli_mark;
+       ctrl->srv_mark = v2->srv_mark;
+       return v2->grants;
+   }
+   left->cons = &ctrl->ring->left.cons;
+   left->prod = &ctrl->ring->left.prod;
+   right->cons = &ctrl->ring->right.cons;
+   right->prod = &ctrl->ring->right.prod;
+   ctrl->cli_live = &ctrl->ring->cli_live;
+   ctrl->srv_live = &ctrl->ring->srv_live;
+   ctrl->cli_notify = &ctrl->ring->cli_notify;
+   ctrl->srv_notify = &ctrl->ring->srv_notify;
+   ctrl->cli_mark = ctrl->srv_mark = NULL;
+   return ctrl->ring->grants;
+}
+
+/**
+ * Start the local index copies from the values in the shared page; a
+ * reconnecting client may find a ring that is already in use.
+ */
+static void init_ring_indexes(struct libvchan *ctrl)
+{
+   ctrl->read.local = *ctrl->read.cons;
+   ctrl->read.peer = *ctrl->read.prod;
+   ctrl->write.local = *ctrl->write.prod;
+   ctrl->write.peer = *ctrl->write.cons;
+   ctrl->read.pending = ctrl->write.pending = 0;
+   ctrl->read.threshold = ctrl->write.threshold = 0;
+   ctrl->read.crc_on = 0;
+   ctrl->read.watermark = ctrl->write.watermark = 0;
+   ctrl->read.deferred = ctrl->write.deferred = 0;
+}
+
+/**
+ * Drop the device's own reference to count grants from index. They stay
+ * alive as long as they are mapped, so an fd kept open by a context does
+ * not accumulate the grants of every vchan ever created through it.
+ */
+static void release_gnt_alloc(int fd, uint64_t index, uint32_t count)
+{
+   struct ioctl_gntalloc_dealloc_gref arg = { .index = index, .count = count };
+   ioctl(fd, IOCTL_GNTALLOC_DEALLOC_GREF, &arg);
+}
+
+static void release_gnt_map(int fd, uint64_t index, uint32_t count)
+{
+   struct ioctl_gntdev_unmap_grant_ref arg = { .index = index, .count = count };
+   ioctl(fd, IOCTL_GNTDEV_UNMAP_GRANT_REF, &arg);
+}
+
+/**
+ * Grant npages pages to the peer, GNT_BATCH at a time, and map them
+ * contiguously. The grant references are stored in refs.
+ * Returns the mapping, or NULL on error.
+ */
+void *vchan_gnt_alloc_pages(int fd, int domid, uint32_t *refs, int npages)
+{
+   struct ioctl_gntalloc_alloc_gref *gref_info;
+   void *area;
+   int done, count;
+
+   area = mmap(NULL, npages * PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (area == MAP_FAILED)
+       return NULL;
+   gref_info = malloc(sizeof(*gref_info) + GNT_BATCH * sizeof(uint32_t));
+   if (!gref_info)
+       goto fail;
+   gref_info->domid = domid;
+   gref_info->flags = GNTALLOC_FLAG_WRITABLE;
+
+   for (done = 0; done < npages; done += count) {
+       count = min(npages - done, GNT_BATCH);
+       gref_info->count = count;
+       if (ioctl(fd, IOCTL_GNTALLOC_ALLOC_GREF, gref_info))
+           goto fail;
+       if (mmap(area + done * PAGE_SIZE, count * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, gref_info->index) == MAP_FAILED) {
+           release_gnt_alloc(fd, gref_info->index, count);
+           goto fail;
+       }
+       release_gnt_alloc(fd, gref_info->index, count);
+       memcpy(refs + done, gref_info->gref_ids, count * sizeof(uint32_t));
+   }
+   free(gref_info);
+   return area;
+ fail:
+   free(gref_info);
+   munmap(area, npages * PAGE_SIZE);
+   return NULL;
+}
+
+/**
+ * Allocate the pages of a multi-page ring and list their grants, directly
+ * in grants, or for rings over MAX_DIRECT_ORDER in indirect pages whose own
+ * grants go in grants. Returns the number of entries used in grants, or -1.
+ */
+static int init_ring_srv(struct libvchan *ctrl, int fd, struct libvchan_ring *ring, uint32_t *grants)
+{
+   int pages = 1 << (ring->order - PAGE_SHIFT);
+   int indirect = (pages + GRANTS_PER_PAGE - 1) / GRANTS_PER_PAGE;
+
+   if (ring->order <= MAX_DIRECT_ORDER) {
+       ring->buffer = vchan_gnt_alloc_pages(fd, ctrl->other_domain_id, grants, pages);
+       return ring->buffer ? pages : -1;
+   }
+   ring->indirect = vchan_gnt_alloc_pages(fd, ctrl->other_domain_id, grants, indirect);
+   if (!ring->indirect)
+       return -1;
+   ring->buffer = vchan_gnt_alloc_pages(fd, ctrl->other_domain_id, ring->indirect, pages);
+   if (!ring->buffer) {
+       munmap(ring->indirect, indirect * PAGE_SIZE);
+       ring->indirect = NULL;
+       return -1;
+   }
+   return indirect;
+}
 
 static int init_gnt_srv(struct libvchan *ctrl)
 {
-   int pages_left = ctrl->read.order >= PAGE_SHIFT ? 1 << (ctrl->read.order - PAGE_SHIFT) : 0;
-   int pages_right = ctrl->write.order >= PAGE_SHIFT ? 1 << (ctrl->write.order - PAGE_SHIFT) : 0;
    struct ioctl_gntalloc_alloc_gref *gref_info = NULL;
-   int ring_fd = open("/dev/xen/gntalloc", O_RDWR);
+   int ring_fd = ctrl->ctx ? ctx_gntalloc_fd(ctrl->ctx) : open("/dev/xen/gntalloc", O_RDWR);
    int ring_ref = -1;
-   int err;
-   void *ring, *area;
+   int err, used_left = 0, used_right;
+   void *ring;
+   uint32_t *grants;
 
    if (ring_fd < 0)
        return -1;
 
-   gref_info = malloc(sizeof(*gref_info) + max(pages_left, pages_right)*sizeof(uint32_t));
+   gref_info = malloc(sizeof(*gref_info) + sizeof(uint32_t));
 
    gref_info->domid = ctrl->other_domain_id;
    gref_info->flags = GNTALLOC_FLAG_WRITABLE;
@@ -84,47 +305,52 @@ static int init_gnt_srv(struct libvchan *ctrl)
 
    ring = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, gref_info->index);
 
-   if (ring == MAP_FAILED)
+   if (ring == MAP_FAILED) {
+       release_gnt_alloc(ring_fd, gref_info->index, 1);
        goto out;
+   }
 
    ctrl->ring = ring;
    ring_ref = gref_info->gref_ids[0];
 
    memset(ring, 0, PAGE_SIZE);
 
-   ctrl->read.shr = &ctrl->ring->left;
-   ctrl->write.shr = &ctrl->ring->right;
-   ctrl->ring->left_order = ctrl->read.order;
-   ctrl->ring->right_order = ctrl->write.order;
-   ctrl->ring->cli_live = 2;
-   ctrl->ring->srv_live = 1;
-   ctrl->ring->debug = 0xabcd;
+   grants = init_layout(ctrl);
+   init_ring_indexes(ctrl);
+   if (ctrl->version == VCHAN_VERSION_2) {
+       struct vchan_interface_v2 *v2 = ring;
+       v2->version = VCHAN_VERSION_2;
+       v2->left_order = ctrl->read.order;
+       v2->right_order = ctrl->write.order;
+   } else {
+       ctrl->ring->left_order = ctrl->read.order;
+       ctrl->ring->right_order = ctrl->write.order;
+   }
+   *ctrl->cli_live = 2;
+   *ctrl->srv_live = 1;
+   *ctrl->cli_notify = VCHAN_NOTIFY_WRITE;
+   *ctrl->srv_notify = VCHAN_NOTIFY_WRITE;
 
 #ifdef IOCTL_GNTALLOC_SET_UNMAP_NOTIFY
    {
        struct ioctl_gntalloc_unmap_notify arg;
-       arg.index = gref_info->index + offsetof(struct vchan_interface, srv_live);
+       arg.index = gref_info->index + ((void*)ctrl->srv_live - ring);
        arg.action = UNMAP_NOTIFY_CLEAR_BYTE | UNMAP_NOTIFY_SEND_EVENT;
        arg.event_channel_port = ctrl->event_port;
        ioctl(ring_fd, IOCTL_GNTALLOC_SET_UNMAP_NOTIFY, &arg);
    }
 #endif
+   // the notify is looked up by index, so it has to be set up first
+   release_gnt_alloc(ring_fd, gref_info->index, 1);
 
    if (ctrl->read.order == 10) {
        ctrl->read.buffer = ((void*)ctrl->ring) + 1024;
    } else if (ctrl->read.order == 11) {
        ctrl->read.buffer = ((void*)ctrl->ring) + 2048;
    } else {
-       gref_info->count = pages_left;
-       err = ioctl(ring_fd, IOCTL_GNTALLOC_ALLOC_GREF, gref_info);
-       if (err)
-           goto out_ring;
-       area = mmap(NULL, pages_left * PAGE_SIZE, PROT_READ | PROT_WRITE,
-           MAP_SHARED, ring_fd, gref_info->index);
-       if (area == MAP_FAILED)
+       used_left = init_ring_srv(ctrl, ring_fd, &ctrl->read, grants);
+       if (used_left < 0)
            goto out_ring;
-       ctrl->read.buffer = area;
-       memcpy(ctrl->ring->grants, gref_info->gref_ids, pages_left * sizeof(uint32_t));
    }
 
    if (ctrl->write.order == 10) {
@@ -132,26 +358,23 @@ static int init_gnt_srv(struct libvchan *ctrl)
    } else if (ctrl->write.order == 11) {
        ctrl->write.buffer = ((void*)ctrl->ring) + 2048;
    } else {
-       gref_info->count = pages_right;
-       err = ioctl(ring_fd, IOCTL_GNTALLOC_ALLOC_GREF, gref_info);
-       if (err)
+       used_right = init_ring_srv(ctrl, ring_fd, &ctrl->write, grants + used_left);
+       if (used_right < 0)
            goto out_unmap_left;
-       area = mmap(NULL, pages_right * PAGE_SIZE, PROT_READ | PROT_WRITE,
-           MAP_SHARED, ring_fd, gref_info->index);
-       if (area == MAP_FAILED)
-           goto out_unmap_left;
-       ctrl->write.buffer = area;
-       memcpy(ctrl->ring->grants + pages_left,
-              gref_info->gref_ids, pages_right * sizeof(uint32_t));
    }
 
 out:
-   close(ring_fd);
+   if (!ctrl->ctx)
+       close(ring_fd);
    free(gref_info);
    return ring_ref;
 out_unmap_left:
-   if (ctrl->read.order > 11)
-       munmap(ctrl->read.buffer, pages_left * PAGE_SIZE);
+   if (ctrl->read.order > 11) {
+       munmap(ctrl->read.buffer, 1 << ctrl->read.order);
+       if (ctrl->read.indirect)
+           munmap(ctrl->read.indirect, used_left * PAGE_SIZE);
+       ctrl->read.indirect = NULL;
+   }
 out_ring:
    munmap(ring, PAGE_SIZE);
    ring_ref = -1;
@@ -160,7 +383,7 @@ out_ring:
    goto out;
 }
 
-static void* do_gnt_map(int fd, int domid, uint32_t* pages, size_t npages, uint64_t *index)
+static void* do_gnt_map(int fd, int domid, uint32_t* pages, size_t npages, uint64_t *index, void *addr)
 {
    int i, rv;
    void* area = NULL;
@@ -179,60 +402,115 @@ static void* do_gnt_map(int fd, int domid, uint32_t* pages, size_t npages, uint6
    }
    if (index)
        *index = gref_info->index;
-   area = mmap(NULL, PAGE_SIZE * npages, PROT_READ | PROT_WRITE, MAP_SHARED, fd, gref_info->index);
+   area = mmap(addr, PAGE_SIZE * npages, PROT_READ | PROT_WRITE,
+               MAP_SHARED | (addr ? MAP_FIXED : 0), fd, gref_info->index);
    if (area == MAP_FAILED) {
        perror("mmap");
-       struct ioctl_gntdev_unmap_grant_ref undo = {
-           .index = gref_info->index,
-           .count = gref_info->count
-       };
-       ioctl(fd, IOCTL_GNTDEV_UNMAP_GRANT_REF, &undo);
+       release_gnt_map(fd, gref_info->index, gref_info->count);
        area = NULL;
+   } else if (!index) {
+       // the mapping keeps the grants; a caller asking for the index
+       // releases them once it is done with it
+       release_gnt_map(fd, gref_info->index, gref_info->count);
    }
  out:
    free(gref_info);
    return area;
 }
 
+/**
+ * Map the npages grants in refs contiguously, GNT_BATCH at a time.
+ */
+void *vchan_gnt_map_pages(int fd, int domid, uint32_t *refs, int npages)
+{
+   void *area;
+   int done, count;
+
+   area = mmap(NULL, npages * PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (area == MAP_FAILED)
+       return NULL;
+   for (done = 0; done < npages; done += count) {
+       count = min(npages - done, GNT_BATCH);
+       if (!do_gnt_map(fd, domid, refs + done, count, NULL, area + done * PAGE_SIZE)) {
+           munmap(area, npages * PAGE_SIZE);
+           return NULL;
+       }
+   }
+   return area;
+}
+
+/**
+ * Map the pages of a multi-page ring from its grant list entries, going
+ * through the indirect pages for rings over MAX_DIRECT_ORDER. Returns the
+ * number of entries used in grants, or -1.
+ */
+static int init_ring_cli(struct libvchan *ctrl, int fd, struct libvchan_ring *ring, uint32_t *grants)
+{
+   int pages = 1 << (ring->order - PAGE_SHIFT);
+   int indirect = (pages + GRANTS_PER_PAGE - 1) / GRANTS_PER_PAGE;
+   uint32_t *refs;
+
+   if (ring->order <= MAX_DIRECT_ORDER) {
+       ring->buffer = vchan_gnt_map_pages(fd, ctrl->other_domain_id, grants, pages);
+       return ring->buffer ? pages : -1;
+   }
+   // the list of data page grants is only needed while mapping them
+   refs = do_gnt_map(fd, ctrl->other_domain_id, grants, indirect, NULL, NULL);
+   if (!refs)
+       return -1;
+   ring->buffer = vchan_gnt_map_pages(fd, ctrl->other_domain_id, refs, pages);
+   munmap(refs, indirect * PAGE_SIZE);
+   return ring->buffer ? indirect : -1;
+}
+
 static int init_gnt_cli(struct libvchan *ctrl, uint32_t ring_ref)
 {
-   int ring_fd = open("/dev/xen/gntdev", O_RDWR);
+   int ring_fd = ctrl->ctx ? ctx_gntdev_fd(ctrl->ctx) : open("/dev/xen/gntdev", O_RDWR);
    int rv = -1;
    uint64_t ring_index;
    uint32_t *grants;
+   int max_order, used;
    if (ring_fd < 0)
        return -1;
 
-   ctrl->ring = do_gnt_map(ring_fd, ctrl->other_domain_id, &ring_ref, 1, &ring_index);
+   ctrl->ring = do_gnt_map(ring_fd, ctrl->other_domain_id, &ring_ref, 1, &ring_index, NULL);
 
    if (!ctrl->ring) {
        perror("do_gnt_map");
        goto out;
    }
 
-   ctrl->write.order = ctrl->ring->left_order;
-   ctrl->read.order = ctrl->ring->right_order;
-   ctrl->write.shr = &ctrl->ring->left;
-   ctrl->read.shr = &ctrl->ring->right;
-   if (ctrl->write.order < 10 || ctrl->write.order > 24)
+   // a v2 page looks like a v1 page with invalid ring orders
+   if (ctrl->ring->left_order == 0 && ctrl->ring->right_order == 0 &&
+       ((struct vchan_interface_v2 *)ctrl->ring)->version == VCHAN_VERSION_2) {
+       struct vchan_interface_v2 *v2 = (struct vchan_interface_v2 *)ctrl->ring;
+       ctrl->version = VCHAN_VERSION_2;
+       ctrl->write.order = v2->left_order;
+       ctrl->read.order = v2->right_order;
+   } else {
+       ctrl->version = VCHAN_VERSION_1;
+       ctrl->write.order = ctrl->ring->left_order;
+       ctrl->read.order = ctrl->ring->right_order;
+   }
+   grants = init_layout(ctrl);
+   init_ring_indexes(ctrl);
+   max_order = ctrl->version == VCHAN_VERSION_2 ? MAX_INDIRECT_ORDER : 24;
+   if (ctrl->write.order < 10 || ctrl->write.order > max_order)
        goto out_unmap_ring;
-   if (ctrl->read.order < 10 || ctrl->read.order > 24)
+   if (ctrl->read.order < 10 || ctrl->read.order > max_order)
        goto out_unmap_ring;
    if (ctrl->read.order == ctrl->write.order && ctrl->read.order < 12)
        goto out_unmap_ring;
 
-   grants = ctrl->ring->grants;
-
    if (ctrl->write.order == 10) {
        ctrl->write.buffer = ((void*)ctrl->ring) + 1024;
    } else if (ctrl->write.order == 11) {
        ctrl->write.buffer = ((void*)ctrl->ring) + 2048;
    } else {
-       int pages_left = 1 << (ctrl->write.order - PAGE_SHIFT);
-       ctrl->write.buffer = do_gnt_map(ring_fd, ctrl->other_domain_id, grants, pages_left, NULL);
-       if (!ctrl->write.buffer)
+       used = init_ring_cli(ctrl, ring_fd, &ctrl->write, grants);
+       if (used < 0)
            goto out_unmap_ring;
-       grants += pages_left;
+       grants += used;
    }
 
    if (ctrl->read.order == 10) {
@@ -240,30 +518,31 @@ static int init_gnt_cli(struct libvchan *ctrl, uint32_t ring_ref)
    } else if (ctrl->read.order == 11) {
        ctrl->read.buffer = ((void*)ctrl->ring) + 2048;
    } else {
-       int pages_right = 1 << (ctrl->read.order - PAGE_SHIFT);
-       ctrl->read.buffer = do_gnt_map(ring_fd, ctrl->other_domain_id, grants, pages_right, NULL);
-       if (!ctrl->read.buffer)
+       if (init_ring_cli(ctrl, ring_fd, &ctrl->read, grants) < 0)
            goto out_unmap_left;
    }
 
 #ifdef IOCTL_GNTDEV_SET_UNMAP_NOTIFY
    {
        struct ioctl_gntdev_unmap_notify arg;
-       arg.index = ring_index + offsetof(struct vchan_interface, cli_live);
+       arg.index = ring_index + ((void*)ctrl->cli_live - (void*)ctrl->ring);
        arg.action = UNMAP_NOTIFY_CLEAR_BYTE | UNMAP_NOTIFY_SEND_EVENT;
        arg.event_channel_port = ctrl->event_port;
        ioctl(ring_fd, IOCTL_GNTDEV_SET_UNMAP_NOTIFY, &arg);
    }
 #endif
+   release_gnt_map(ring_fd, ring_index, 1);
 
    rv = 0;
  out:
-   close(ring_fd);
+   if (!ctrl->ctx)
+       close(ring_fd);
    return rv;
  out_unmap_left:
    if (ctrl->write.order >= PAGE_SHIFT)
        munmap(ctrl->write.buffer, 1 << ctrl->write.order);
  out_unmap_ring:
+   release_gnt_map(ring_fd, ring_index, 1);
    munmap(ctrl->ring, PAGE_SIZE);
    ctrl->ring = 0;
    ctrl->write.order = ctrl->read.order = 0;
@@ -274,34 +553,62 @@ static int init_gnt_cli(struct libvchan *ctrl, uint32_t ring_ref)
 static int init_evt_srv(struct libvchan *ctrl)
 {
    struct ioctl_evtchn_bind_unbound_port bind;
-   ctrl->event_fd = open("/dev/xen/evtchn", O_RDWR);
+   int port;
+   if (ctrl->poller)
+       ctrl->event_fd = libvchan_poller_fd(ctrl->poller);
+   else
+       ctrl->event_fd = open("/dev/xen/evtchn", O_RDWR);
    if (ctrl->event_fd < 0)
        return -1;
    bind.remote_domain = ctrl->other_domain_id;
-   ctrl->event_port = ioctl(ctrl->event_fd, IOCTL_EVTCHN_BIND_UNBOUND_PORT, &bind);
-   if (ctrl->event_port < 0)
+   port = ioctl(ctrl->event_fd, IOCTL_EVTCHN_BIND_UNBOUND_PORT, &bind);
+   if (port < 0)
+       return -1;
+   ctrl->event_port = port;
+   if (ctrl->poller && vchan_poller_attach(ctrl->poller, ctrl))
        return -1;
    write(ctrl->event_fd, &ctrl->event_port, sizeof(ctrl->event_port));
    return 0;
 }
 
+/**
+ * Print the xenstore path of key for this vchan, relative to the domain
+ * of the client: data/vchan/<devno>/key, or data/vchan/<devno>/queue-<n>/key
+ * for a queue of a multi-queue vchan.
+ */
+static void xs_path(char *buf, size_t len, struct libvchan *ctrl, const char *key)
+{
+   if (ctrl->queue < 0)
+       snprintf(buf, len, "data/vchan/%d/%s", ctrl->device_number, key);
+   else
+       snprintf(buf, len, "data/vchan/%d/queue-%d/%s", ctrl->device_number, ctrl->queue, key);
+}
+
 static int init_xs_srv(struct libvchan *ctrl, int ring_ref)
 {
    int ret = -1;
    struct xs_handle *xs;
    struct xs_permissions perms[2];
-   char buf[64];
+   char buf[96];
    char ref[16];
    char* domid_str = NULL;
-   xs = xs_domain_open();
-   if (!xs)
-       goto fail;
-   domid_str = xs_read(xs, 0, "domid", NULL);
-   if (!domid_str)
-       goto fail_xs_open;
+   int len, domid;
+   if (ctrl->ctx) {
+       xs = ctx_xs_srv(ctrl->ctx, &domid);
+       if (!xs)
+           goto fail;
+   } else {
+       xs = xs_domain_open();
+       if (!xs)
+           goto fail;
+       domid_str = xs_read(xs, 0, "domid", NULL);
+       if (!domid_str)
+           goto fail_xs_open;
+       domid = atoi(domid_str);
+   }
 
    // owner domain is us
-   perms[0].id = atoi(domid_str);
+   perms[0].id = domid;
    // permissions for domains not listed = none
    perms[0].perms = XS_PERM_NONE;
    // other domains
@@ -309,14 +616,15 @@ static int init_xs_srv(struct libvchan *ctrl, int ring_ref)
    perms[1].perms = XS_PERM_READ;
 
    snprintf(ref, sizeof ref, "%d", ring_ref);
-   snprintf(buf, sizeof buf, "/local/domain/%d/data/vchan/%d/ring-ref", ctrl->other_domain_id, ctrl->device_number);
+   len = snprintf(buf, sizeof buf, "/local/domain/%d/", ctrl->other_domain_id);
+   xs_path(buf + len, sizeof buf - len, ctrl, "ring-ref");
    if (!xs_write(xs, 0, buf, ref, strlen(ref)))
        goto fail_xs_open;
    if (!xs_set_permissions(xs, 0, buf, perms, 2))
        goto fail_xs_open;
 
    snprintf(ref, sizeof ref, "%d", ctrl->event_port);
-   snprintf(buf, sizeof buf, "/local/domain/%d/data/vchan/%d/event-channel", ctrl->other_domain_id, ctrl->device_number);
+   xs_path(buf + len, sizeof buf - len, ctrl, "event-channel");
    if (!xs_write(xs, 0, buf, ref, strlen(ref)))
        goto fail_xs_open;
    if (!xs_set_permissions(xs, 0, buf, perms, 2))
@@ -325,7 +633,8 @@ static int init_xs_srv(struct libvchan *ctrl, int ring_ref)
    ret = 0;
  fail_xs_open:
    free(domid_str);
-   xs_daemon_close(xs);
+   if (!ctrl->ctx)
+       xs_daemon_close(xs);
  fail:
    return ret;
 }
@@ -338,14 +647,59 @@ static int min_order(size_t siz)
    return rv;
 }
 
+static struct libvchan *server_init(struct libvchan_context *ctx, struct libvchan_poller *poller,
+                                    int domain, int devno, int queue,
+                                    size_t left_min, size_t right_min, int version);
+
+/**
+ * Layout for rings of the given sizes: v1 clients cannot map rings over
+ * MAX_DIRECT_ORDER anyway, so nothing is lost by using v2 for them.
+ */
+static int default_version(size_t left_min, size_t right_min)
+{
+   return left_min > 1 << MAX_DIRECT_ORDER || right_min > 1 << MAX_DIRECT_ORDER ?
+          VCHAN_VERSION_2 : VCHAN_VERSION_1;
+}
+
 struct libvchan *libvchan_server_init(int domain, int devno, size_t left_min, size_t right_min)
 {
-   // if you go over this size, you'll have too many grants to fit in the shared page.
-   size_t MAX_RING_SIZE = 256 * PAGE_SIZE;
+   return libvchan_server_init_version(domain, devno, left_min, right_min,
+                                       default_version(left_min, right_min));
+}
+
+struct libvchan *libvchan_server_init_version(int domain, int devno, size_t left_min,
+                                             size_t right_min, int version)
+{
+   return server_init(NULL, NULL, domain, devno, -1, left_min, right_min, version);
+}
+
+struct libvchan *libvchan_server_init_poller(struct libvchan_poller *poller, int domain, int devno,
+                                             size_t left_min, size_t right_min)
+{
+   return server_init(NULL, poller, domain, devno, -1, left_min, right_min,
+                      default_version(left_min, right_min));
+}
+
+struct libvchan *libvchan_server_init_ctx(struct libvchan_context *ctx, int domain, int devno,
+                                          size_t left_min, size_t right_min)
+{
+   return server_init(ctx, ctx->poller, domain, devno, -1, left_min, right_min,
+                      default_version(left_min, right_min));
+}
+
+static struct libvchan *server_init(struct libvchan_context *ctx, struct libvchan_poller *poller,
+                                    int domain, int devno, int queue,
+                                    size_t left_min, size_t right_min, int version)
+{
+   // if you go over this size, you'll have too many grants to fit in the shared page;
+   // bigger rings list their grants in indirect pages, which needs the v2 layout.
+   size_t MAX_RING_SIZE = version == VCHAN_VERSION_2 ? 1 << MAX_INDIRECT_ORDER : 1 << MAX_DIRECT_ORDER;
    struct libvchan *ctrl;
    int ring_ref;
    if (left_min > MAX_RING_SIZE || right_min > MAX_RING_SIZE)
        return 0;
+   if (version != VCHAN_VERSION_1 && version != VCHAN_VERSION_2)
+       return 0;
 
    ctrl = malloc(sizeof(*ctrl));
    if (!ctrl)
@@ -353,10 +707,32 @@ struct libvchan *libvchan_server_init(int domain, int devno, size_t left_min, si
 
    ctrl->other_domain_id = domain;
    ctrl->device_number = devno;
+   ctrl->queue = queue;
    ctrl->ring = NULL;
    ctrl->event_fd = -1;
+   ctrl->poller = poller;
    ctrl->is_server = 1;
    ctrl->server_persist = 0;
+   ctrl->version = version;
+   ctrl->read.indirect = ctrl->write.indirect = NULL;
+   ctrl->write_reserved = ctrl->read_peeked = 0;
+   ctrl->thread_mode = VCHAN_THREAD_NONE;
+   ctrl->sync = NULL;
+   ctrl->spin_max_ns = ctrl->spin_ns = ctrl->spin_gap_ns = 0;
+   ctrl->spin_adaptive = 0;
+   ctrl->notify_window_ns = 0;
+   ctrl->notify_last_ns = 0;
+   libvchan_copy_init(&ctrl->copy, VCHAN_COPY_AUTO, 0);
+   memset(&ctrl->stats, 0, sizeof(ctrl->stats));
+   ctrl->regions = NULL;
+   ctrl->nregions = 0;
+   ctrl->local_regions = 0;
+   ctrl->ctx = ctx;
+   ctrl->aio = NULL;
+   ctrl->msg_header = 0;
+   ctrl->msg_pool = NULL;
+   ctrl->msg_pool_size = 0;
+   ctrl->integrity = 0;
 
    ctrl->read.order = min_order(left_min);
    ctrl->write.order = min_order(right_min);
@@ -391,24 +767,64 @@ out:
 static int init_evt_cli(struct libvchan *ctrl)
 {
    struct ioctl_evtchn_bind_interdomain bind;
-   ctrl->event_fd = open("/dev/xen/evtchn", O_RDWR);
+   int port;
+   if (ctrl->poller)
+       ctrl->event_fd = libvchan_poller_fd(ctrl->poller);
+   else
+       ctrl->event_fd = open("/dev/xen/evtchn", O_RDWR);
    if (ctrl->event_fd < 0)
        return -1;
 
    bind.remote_domain = ctrl->other_domain_id;
    bind.remote_port = ctrl->event_port;
-   ctrl->event_port = ioctl(ctrl->event_fd, IOCTL_EVTCHN_BIND_INTERDOMAIN, &bind);
-   if (ctrl->event_port < 0)
+   port = ioctl(ctrl->event_fd, IOCTL_EVTCHN_BIND_INTERDOMAIN, &bind);
+   if (port < 0)
+       return -1;
+   ctrl->event_port = port;
+   if (ctrl->poller && vchan_poller_attach(ctrl->poller, ctrl))
        return -1;
    return 0;
 }
 
 
+static struct libvchan *client_init(struct libvchan_context *ctx, struct xs_handle *xs,
+                                    struct libvchan_poller *poller,
+                                    int domain, int devno, int queue);
+
 struct libvchan *libvchan_client_init(int domain, int devno)
+{
+   return libvchan_client_init_poller(NULL, domain, devno);
+}
+
+struct libvchan *libvchan_client_init_poller(struct libvchan_poller *poller, int domain, int devno)
+{
+   struct libvchan *ctrl;
+   struct xs_handle *xs;
+
+   xs = xs_daemon_open();
+   if (!xs)
+       xs = xs_domain_open();
+   if (!xs)
+       return 0;
+   ctrl = client_init(NULL, xs, poller, domain, devno, -1);
+   xs_daemon_close(xs);
+   return ctrl;
+}
+
+struct libvchan *libvchan_client_init_ctx(struct libvchan_context *ctx, int domain, int devno)
+{
+   struct xs_handle *xs = ctx_xs_cli(ctx);
+   if (!xs)
+       return 0;
+   return client_init(ctx, xs, ctx->poller, domain, devno, -1);
+}
+
+static struct libvchan *client_init(struct libvchan_context *ctx, struct xs_handle *xs,
+                                    struct libvchan_poller *poller,
+                                    int domain, int devno, int queue)
 {
    struct libvchan *ctrl = malloc(sizeof(struct libvchan));
-   struct xs_handle *xs = NULL;
-   char buf[64];
+   char buf[96];
    char *ref;
    int ring_ref;
    unsigned int len;
@@ -416,19 +832,34 @@ struct libvchan *libvchan_client_init(int domain, int devno)
        return 0;
    ctrl->other_domain_id = domain;
    ctrl->device_number = devno;
+   ctrl->queue = queue;
    ctrl->ring = NULL;
    ctrl->event_fd = -1;
+   ctrl->poller = poller;
    ctrl->write.order = ctrl->read.order = 0;
+   ctrl->read.indirect = ctrl->write.indirect = NULL;
    ctrl->is_server = 0;
-
-   xs = xs_daemon_open();
-   if (!xs)
-       xs = xs_domain_open();
-   if (!xs)
-       goto fail;
+   ctrl->write_reserved = ctrl->read_peeked = 0;
+   ctrl->thread_mode = VCHAN_THREAD_NONE;
+   ctrl->sync = NULL;
+   ctrl->spin_max_ns = ctrl->spin_ns = ctrl->spin_gap_ns = 0;
+   ctrl->spin_adaptive = 0;
+   ctrl->notify_window_ns = 0;
+   ctrl->notify_last_ns = 0;
+   libvchan_copy_init(&ctrl->copy, VCHAN_COPY_AUTO, 0);
+   memset(&ctrl->stats, 0, sizeof(ctrl->stats));
+   ctrl->regions = NULL;
+   ctrl->nregions = 0;
+   ctrl->local_regions = 0;
+   ctrl->ctx = ctx;
+   ctrl->aio = NULL;
+   ctrl->msg_header = 0;
+   ctrl->msg_pool = NULL;
+   ctrl->msg_pool_size = 0;
+   ctrl->integrity = 0;
 
 // find xenstore entry
-   snprintf(buf, sizeof buf, "data/vchan/%d/ring-ref", ctrl->device_number);
+   xs_path(buf, sizeof buf, ctrl, "ring-ref");
    ref = xs_read(xs, 0, buf, &len);
    if (!ref) {
        perror("xs_read ring-ref");
@@ -440,7 +871,7 @@ struct libvchan *libvchan_client_init(int domain, int devno)
        perror("atoi(ring-ref)");
        goto fail;
    }
-   snprintf(buf, sizeof buf, "data/vchan/%d/event-channel", ctrl->device_number);
+   xs_path(buf, sizeof buf, ctrl, "event-channel");
    ref = xs_read(xs, 0, buf, &len);
    if (!ref) {
        perror("xs_read event-channel");
@@ -465,15 +896,113 @@ struct libvchan *libvchan_client_init(int domain, int devno)
        goto fail;
    }
 
-   ctrl->ring->cli_live = 1;
-   ctrl->ring->debug = 0xabce;
-
- out:
-   if (xs)
-       xs_daemon_close(xs);
+   *ctrl->cli_live = 1;
    return ctrl;
+
  fail:
    libvchan_close(ctrl);
-   ctrl = NULL;
-   goto out;
+   return NULL;
+}
+
+/**
+ * Advertise the number of queues of a multi-queue vchan, once they are all
+ * ready, so that clients find either none of the queues or all of them.
+ */
+static int init_xs_mq_srv(int domain, int devno, int nqueues)
+{
+   int ret = -1;
+   struct xs_handle *xs;
+   struct xs_permissions perms[2];
+   char buf[64];
+   char val[16];
+   char* domid_str = NULL;
+   xs = xs_domain_open();
+   if (!xs)
+       goto fail;
+   domid_str = xs_read(xs, 0, "domid", NULL);
+   if (!domid_str)
+       goto fail_xs_open;
+
+   perms[0].id = atoi(domid_str);
+   perms[0].perms = XS_PERM_NONE;
+   perms[1].id = domain;
+   perms[1].perms = XS_PERM_READ;
+
+   snprintf(val, sizeof val, "%d", nqueues);
+   snprintf(buf, sizeof buf, "/local/domain/%d/data/vchan/%d/queues", domain, devno);
+   if (!xs_write(xs, 0, buf, val, strlen(val)))
+       goto fail_xs_open;
+   if (!xs_set_permissions(xs, 0, buf, perms, 2))
+       goto fail_xs_open;
+
+   ret = 0;
+ fail_xs_open:
+   free(domid_str);
+   xs_daemon_close(xs);
+ fail:
+   return ret;
+}
+
+struct libvchan_mq *libvchan_mq_server_init(int domain, int devno, int nqueues,
+                                            size_t read_min, size_t write_min)
+{
+   int version = default_version(read_min, write_min);
+   struct libvchan_mq *mq;
+
+   if (nqueues < 1 || nqueues > VCHAN_MQ_MAX)
+       return 0;
+   mq = calloc(1, sizeof(*mq) + nqueues * sizeof(mq->queue[0]));
+   if (!mq)
+       return 0;
+   for (mq->nqueues = 0; mq->nqueues < nqueues; mq->nqueues++) {
+       mq->queue[mq->nqueues] = server_init(NULL, NULL, domain, devno, mq->nqueues, read_min, write_min, version);
+       if (!mq->queue[mq->nqueues])
+           goto fail;
+   }
+   if (init_xs_mq_srv(domain, devno, nqueues))
+       goto fail;
+   return mq;
+ fail:
+   libvchan_mq_close(mq);
+   return 0;
+}
+
+struct libvchan_mq *libvchan_mq_client_init(int domain, int devno)
+{
+   struct libvchan_mq *mq = NULL;
+   struct xs_handle *xs;
+   char buf[64];
+   char *ref;
+   unsigned int len;
+   int nqueues;
+
+   xs = xs_daemon_open();
+   if (!xs)
+       xs = xs_domain_open();
+   if (!xs)
+       return 0;
+   snprintf(buf, sizeof buf, "data/vchan/%d/queues", devno);
+   ref = xs_read(xs, 0, buf, &len);
+   if (!ref) {
+       perror("xs_read queues");
+       goto out;
+   }
+   nqueues = atoi(ref);
+   free(ref);
+   if (nqueues < 1 || nqueues > VCHAN_MQ_MAX)
+       goto out;
+   mq = calloc(1, sizeof(*mq) + nqueues * sizeof(mq->queue[0]));
+   if (!mq)
+       goto out;
+   for (mq->nqueues = 0; mq->nqueues < nqueues; mq->nqueues++) {
+       mq->queue[mq->nqueues] = client_init(NULL, xs, NULL, domain, devno, mq->nqueues);
+       if (!mq->queue[mq->nqueues]) {
+           libvchan_mq_close(mq);
+           mq = NULL;
+           break;
+       }
+   }
+ out:
+   xs_daemon_close(xs);
+   return mq;
 }
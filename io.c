@@ -36,17 +36,14 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
 
 #include <xenctrl.h>
 #include "libvchan.h"
-
-#ifndef PAGE_SHIFT
-#define PAGE_SHIFT 12
-#endif
-
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
+#include "libvchan_private.h"
 
 // allow vchan data to be easily observed in strace by doing a
 // writev() to FD -1 with the data being read/written.
@@ -55,29 +52,63 @@
 #endif
 
 #define barrier() asm volatile("" ::: "memory")
+#define mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
 
-static uint32_t rd_prod(struct libvchan *ctrl)
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() asm volatile("pause" ::: "memory")
+#else
+#define cpu_relax() barrier()
+#endif
+
+// how many spin iterations between clock reads
+#define SPIN_CLOCK_MASK 63
+
+// MPSC publish spins between yields while an earlier producer finishes
+#define MPSC_YIELD_MASK 1023
+
+// directions, as indexes into the wait queues of struct libvchan_sync
+#define DIR_READ 0
+#define DIR_WRITE 1
+
+// counters are shared by the reading and writing threads in threaded modes
+#define stat_inc(ctrl, field) do { \
+       if ((ctrl)->sync) \
+           __atomic_fetch_add(&(ctrl)->stats.field, 1, __ATOMIC_RELAXED); \
+       else \
+           (ctrl)->stats.field++; \
+   } while (0)
+
+static uint32_t load_acquire(const uint32_t *idx)
 {
-   return ctrl->read.shr->prod;
+   return __atomic_load_n(idx, __ATOMIC_ACQUIRE);
 }
 
-static uint32_t* _rd_cons(struct libvchan *ctrl)
+static void store_release(uint32_t *idx, uint32_t val)
 {
-   return &ctrl->read.shr->cons;
+   __atomic_store_n(idx, val, __ATOMIC_RELEASE);
 }
-#define rd_cons(x) (*_rd_cons(x))
 
-static uint32_t* _wr_prod(struct libvchan *ctrl)
+/**
+ * The peer's indexes live in the shared page; reading them refreshes our
+ * cached copy, which is what the fast paths check first.
+ */
+static uint32_t rd_prod(struct libvchan *ctrl)
 {
-   return &ctrl->write.shr->prod;
+   return ctrl->read.peer = load_acquire(ctrl->read.prod);
 }
-#define wr_prod(x) (*_wr_prod(x))
 
 static uint32_t wr_cons(struct libvchan *ctrl)
 {
-   return ctrl->write.shr->cons;
+   return ctrl->write.peer = load_acquire(ctrl->write.cons);
 }
 
+/**
+ * Our own indexes are kept locally and may run ahead of the copy published
+ * in the shared page by up to the ring's publish threshold.
+ */
+#define rd_cons(x) ((x)->read.local)
+#define wr_prod(x) ((x)->write.local)
+
 static const void* rd_ring(struct libvchan *ctrl)
 {
    return ctrl->read.buffer;
@@ -98,27 +129,356 @@ static uint32_t rd_ring_size(struct libvchan *ctrl)
    return (1 << ctrl->read.order);
 }
 
-int libvchan_data_ready(struct libvchan *ctrl)
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int do_notify(struct libvchan *ctrl)
+{
+   struct ioctl_evtchn_notify notify;
+   notify.port = ctrl->event_port;
+   stat_inc(ctrl, notify_sent);
+   return ioctl(ctrl->event_fd, IOCTL_EVTCHN_NOTIFY, &notify);
+}
+
+/**
+ * Ask the peer to notify us the next time it performs the action in bit.
+ * Must be followed by a re-read of the relevant index before blocking.
+ */
+static void request_notify(struct libvchan *ctrl, uint8_t bit)
+{
+   uint8_t *notify = ctrl->is_server ? ctrl->cli_notify : ctrl->srv_notify;
+   // a watermark left over from an earlier request no longer applies
+   if (ctrl->cli_mark)
+       __atomic_fetch_and(notify, ~(bit << 2), __ATOMIC_SEQ_CST);
+   __atomic_fetch_or(notify, bit, __ATOMIC_SEQ_CST);
+   mb(); // post the request before the caller re-reads any indexes
+}
+
+/**
+ * Ask the peer to notify us once the index behind bit reaches mark. Without
+ * marks in the shared page, or in threaded modes where waiters of different
+ * sizes share the request, any move will do.
+ */
+static void request_notify_at(struct libvchan *ctrl, uint8_t bit, uint32_t mark)
+{
+   uint8_t *notify = ctrl->is_server ? ctrl->cli_notify : ctrl->srv_notify;
+   uint32_t *marks = ctrl->is_server ? ctrl->cli_mark : ctrl->srv_mark;
+   if (!marks || ctrl->sync) {
+       request_notify(ctrl, bit);
+       return;
+   }
+   // the mark must be in place before the peer can see the bit
+   __atomic_store_n(&marks[bit == VCHAN_NOTIFY_READ ? VCHAN_MARK_READ : VCHAN_MARK_WRITE],
+                    mark, __ATOMIC_RELEASE);
+   __atomic_fetch_or(notify, bit | bit << 2, __ATOMIC_SEQ_CST);
+   mb(); // post the request before the caller re-reads any indexes
+}
+
+/**
+ * Whether a notify of the action in bit, requested as req, has to wait:
+ * the published index is short of the peer's watermark, or we notified
+ * less than the moderation window ago.
+ */
+static int hold_notify(struct libvchan *ctrl, uint8_t bit, uint8_t req)
+{
+   uint32_t *marks = ctrl->is_server ? ctrl->srv_mark : ctrl->cli_mark;
+   if (marks && (req & bit << 2)) {
+       uint32_t idx, mark;
+       if (bit == VCHAN_NOTIFY_WRITE) {
+           idx = *ctrl->write.prod;
+           mark = __atomic_load_n(&marks[VCHAN_MARK_WRITE], __ATOMIC_ACQUIRE);
+       } else {
+           idx = *ctrl->read.cons;
+           mark = __atomic_load_n(&marks[VCHAN_MARK_READ], __ATOMIC_ACQUIRE);
+       }
+       if ((int32_t)(idx - mark) < 0)
+           return 1;
+   }
+   return ctrl->notify_window_ns && now_ns() - ctrl->notify_last_ns < ctrl->notify_window_ns;
+}
+
+/**
+ * Notify the peer of the action in bit, if it asked to be told about it or
+ * is a legacy peer that never asks, unless hold_notify() says it can wait;
+ * the ring then remembers to send it when we flush.
+ */
+static int send_notify(struct libvchan *ctrl, uint8_t bit)
+{
+   struct libvchan_ring *ring = bit == VCHAN_NOTIFY_WRITE ? &ctrl->write : &ctrl->read;
+   uint8_t *notify, prev;
+   mb(); // index update must be visible before we decide whether to notify
+   notify = ctrl->is_server ? ctrl->srv_notify : ctrl->cli_notify;
+   // threaded modes have no flush point before a thread blocks, so no holding
+   if (!ctrl->sync) {
+       prev = __atomic_load_n(notify, __ATOMIC_SEQ_CST);
+       if (!(prev & (bit | VCHAN_NOTIFY_LEGACY))) {
+           stat_inc(ctrl, notify_suppressed);
+           return 0;
+       }
+       if (hold_notify(ctrl, bit, prev)) {
+           if (!ring->deferred)
+               stat_inc(ctrl, notify_deferred);
+           ring->deferred = 1;
+           return 0;
+       }
+   }
+   ring->deferred = 0;
+   prev = __atomic_fetch_and(notify, ~(bit | bit << 2), __ATOMIC_SEQ_CST);
+   if (prev & (bit | VCHAN_NOTIFY_LEGACY)) {
+       if (ctrl->notify_window_ns)
+           ctrl->notify_last_ns = now_ns();
+       return do_notify(ctrl);
+   }
+   stat_inc(ctrl, notify_suppressed);
+   return 0;
+}
+
+/**
+ * Send the notifies held back by send_notify(), whatever the watermarks and
+ * the moderation window say, as we are about to go idle.
+ */
+static int send_deferred(struct libvchan *ctrl)
+{
+   uint8_t bits = (ctrl->write.deferred ? VCHAN_NOTIFY_WRITE : 0) |
+                  (ctrl->read.deferred ? VCHAN_NOTIFY_READ : 0);
+   uint8_t *notify = ctrl->is_server ? ctrl->srv_notify : ctrl->cli_notify;
+   uint8_t prev;
+   ctrl->write.deferred = ctrl->read.deferred = 0;
+   prev = __atomic_fetch_and(notify, ~(bits | bits << 2), __ATOMIC_SEQ_CST);
+   // one event covers both directions
+   if (prev & (bits | VCHAN_NOTIFY_LEGACY)) {
+       if (ctrl->notify_window_ns)
+           ctrl->notify_last_ns = now_ns();
+       return do_notify(ctrl);
+   }
+   return 0;
+}
+
+static int publish_rd_cons(struct libvchan *ctrl)
+{
+   ctrl->read.pending = 0;
+   // reads from the ring must complete before the space is handed back
+   store_release(ctrl->read.cons, rd_cons(ctrl));
+   return send_notify(ctrl, VCHAN_NOTIFY_READ);
+}
+
+static int publish_wr_prod(struct libvchan *ctrl)
+{
+   ctrl->write.pending = 0;
+   // data must be in the ring prior to the increment
+   store_release(ctrl->write.prod, wr_prod(ctrl));
+   return send_notify(ctrl, VCHAN_NOTIFY_WRITE);
+}
+
+static int advance_rd_cons(struct libvchan *ctrl, size_t size)
+{
+   rd_cons(ctrl) += size;
+   ctrl->read.pending += size;
+   if (ctrl->read.pending >= ctrl->read.threshold)
+       return publish_rd_cons(ctrl);
+   return 0;
+}
+
+static int advance_wr_prod(struct libvchan *ctrl, size_t size)
+{
+   wr_prod(ctrl) += size;
+   ctrl->write.pending += size;
+   if (ctrl->write.pending >= ctrl->write.threshold)
+       return publish_wr_prod(ctrl);
+   return 0;
+}
+
+int libvchan_flush(struct libvchan *ctrl)
+{
+   int rv = 0;
+   // threaded modes publish every operation, so nothing is left pending
+   if (ctrl->sync)
+       return 0;
+   if (ctrl->read.pending && publish_rd_cons(ctrl) < 0)
+       rv = -1;
+   if (ctrl->write.pending && publish_wr_prod(ctrl) < 0)
+       rv = -1;
+   if ((ctrl->read.deferred || ctrl->write.deferred) && send_deferred(ctrl) < 0)
+       rv = -1;
+   return rv;
+}
+
+void libvchan_set_publish_threshold(struct libvchan *ctrl, size_t read_bytes, size_t write_bytes)
+{
+   if (ctrl->sync)
+       return;
+   libvchan_flush(ctrl);
+   ctrl->read.threshold = read_bytes;
+   ctrl->write.threshold = write_bytes;
+}
+
+void libvchan_set_watermarks(struct libvchan *ctrl, size_t read_bytes, size_t write_bytes)
+{
+   ctrl->read.watermark = read_bytes;
+   ctrl->write.watermark = write_bytes;
+}
+
+void libvchan_set_notify_moderation(struct libvchan *ctrl, unsigned int usec)
+{
+   libvchan_flush(ctrl);
+   ctrl->notify_window_ns = (uint64_t)usec * 1000;
+   ctrl->notify_last_ns = 0;
+}
+
+/**
+ * What a streaming call that can use any part of size bytes in ring waits
+ * for: up to the ring's watermark, and at least one byte.
+ */
+static size_t stream_wake(struct libvchan_ring *ring, size_t size)
+{
+   if (size > ring->watermark)
+       size = ring->watermark;
+   return size ? size : 1;
+}
+
+static int raw_get_data_ready(struct libvchan *ctrl)
 {
    return rd_prod(ctrl) - rd_cons(ctrl);
 }
 
-int libvchan_buffer_space(struct libvchan *ctrl)
+/**
+ * Data ready, requesting a notify from the peer once wake bytes are
+ * available if less than request bytes are. The shared page is only read
+ * if the cached producer index does not already show enough data.
+ */
+static int fast_get_data_ready(struct libvchan *ctrl, size_t request, size_t wake)
+{
+   int ready = ctrl->read.peer - rd_cons(ctrl);
+   if (ready >= request)
+       return ready;
+   ready = raw_get_data_ready(ctrl);
+   if (ready >= request)
+       return ready;
+   // we may be about to block; the peer must see everything we did so far
+   libvchan_flush(ctrl);
+   // we plan to consume all data; please tell us once there is enough
+   if (wake > rd_ring_size(ctrl))
+       wake = rd_ring_size(ctrl);
+   request_notify_at(ctrl, VCHAN_NOTIFY_WRITE, rd_cons(ctrl) + wake);
+   // rd_prod may have moved before our request was posted
+   return raw_get_data_ready(ctrl);
+}
+
+int libvchan_data_ready(struct libvchan *ctrl)
+{
+   libvchan_flush(ctrl);
+   request_notify(ctrl, VCHAN_NOTIFY_WRITE);
+   return raw_get_data_ready(ctrl);
+}
+
+static int raw_get_buffer_space(struct libvchan *ctrl)
 {
    return wr_ring_size(ctrl) - (wr_prod(ctrl) - wr_cons(ctrl));
 }
 
-static int do_notify(struct libvchan *ctrl)
+/**
+ * Buffer space, requesting a notify from the peer once wake bytes are free
+ * if less than request bytes are. The shared page is only read if the
+ * cached consumer index does not already show enough space.
+ */
+static int fast_get_buffer_space(struct libvchan *ctrl, size_t request, size_t wake)
 {
-   struct ioctl_evtchn_notify notify;
-   notify.port = ctrl->event_port;
-   return ioctl(ctrl->event_fd, IOCTL_EVTCHN_NOTIFY, &notify);
+   int space = wr_ring_size(ctrl) - (wr_prod(ctrl) - ctrl->write.peer);
+   if (space >= request)
+       return space;
+   space = raw_get_buffer_space(ctrl);
+   if (space >= request)
+       return space;
+   // we may be about to block; the peer must see everything we did so far
+   libvchan_flush(ctrl);
+   // we plan to fill the buffer; please tell us once you've read enough
+   if (wake > wr_ring_size(ctrl))
+       wake = wr_ring_size(ctrl);
+   request_notify_at(ctrl, VCHAN_NOTIFY_READ, wr_prod(ctrl) + wake - wr_ring_size(ctrl));
+   // wr_cons may have moved before our request was posted
+   return raw_get_buffer_space(ctrl);
 }
 
-int libvchan_wait(struct libvchan *ctrl)
+int libvchan_buffer_space(struct libvchan *ctrl)
+{
+   libvchan_flush(ctrl);
+   request_notify(ctrl, VCHAN_NOTIFY_READ);
+   if (ctrl->thread_mode == VCHAN_THREAD_MPSC)
+       return wr_ring_size(ctrl) - (__atomic_load_n(&ctrl->sync->mp_head, __ATOMIC_RELAXED) -
+                                    load_acquire(ctrl->write.cons));
+   return raw_get_buffer_space(ctrl);
+}
+
+void libvchan_get_stats(struct libvchan *ctrl, struct libvchan_stats *stats)
+{
+   *stats = ctrl->stats;
+}
+
+void libvchan_set_spin(struct libvchan *ctrl, unsigned int max_ns, int adaptive)
+{
+   ctrl->spin_max_ns = max_ns;
+   ctrl->spin_ns = max_ns;
+   ctrl->spin_adaptive = !!adaptive;
+   ctrl->spin_gap_ns = 0;
+}
+
+/**
+ * Poll the peer-owned indexes and live flags for up to spin_ns.
+ * returns 1 if anything changed, 0 if the budget ran out
+ */
+static int spin_wait(struct libvchan *ctrl, uint64_t start)
+{
+   uint32_t prod = rd_prod(ctrl);
+   uint32_t cons = wr_cons(ctrl);
+   int open = libvchan_is_open(ctrl);
+   unsigned int i = 0;
+   while (1) {
+       cpu_relax();
+       if (rd_prod(ctrl) != prod || wr_cons(ctrl) != cons ||
+           libvchan_is_open(ctrl) != open)
+           return 1;
+       if ((++i & SPIN_CLOCK_MASK) == 0 && now_ns() - start >= ctrl->spin_ns)
+           return 0;
+   }
+}
+
+/**
+ * Track the average time it takes the peer to wake us and spin for about
+ * twice that; if the peer is usually slower than spin_max_ns, spinning is
+ * wasted, so back off towards blocking straight away.
+ */
+static void spin_tune(struct libvchan *ctrl, uint64_t gap)
+{
+   if (!ctrl->spin_adaptive)
+       return;
+   // in 64 bits, as spin_max_ns may take up all of an unsigned int
+   if (gap > ctrl->spin_max_ns)
+       gap = (uint64_t)ctrl->spin_max_ns + 1;
+   // rounded up, so that a peer always slower than spin_max_ns gets there
+   ctrl->spin_gap_ns = ctrl->spin_gap_ns ? (7 * ctrl->spin_gap_ns + gap + 7) / 8 : gap;
+   if (ctrl->spin_gap_ns <= ctrl->spin_max_ns)
+       ctrl->spin_ns = ctrl->spin_gap_ns * 2 < ctrl->spin_max_ns ?
+                       ctrl->spin_gap_ns * 2 : ctrl->spin_max_ns;
+   else
+       ctrl->spin_ns /= 2;
+}
+
+/**
+ * Block until the event channel fires, and unmask it again.
+ */
+static int read_event(struct libvchan *ctrl)
 {
-   int ret;
    uint32_t dummy;
+   int ret;
+   // the shared fd carries the events of all the poller's vchans
+   if (ctrl->poller) {
+       errno = EINVAL;
+       return -1;
+   }
    ret = read(ctrl->event_fd, &dummy, sizeof(dummy));
    if (ret == -1)
        return -1;
@@ -126,12 +486,221 @@ int libvchan_wait(struct libvchan *ctrl)
    return 0;
 }
 
+int libvchan_wait(struct libvchan *ctrl)
+{
+   uint64_t start = 0;
+   // the peer may be waiting on notifies we held back
+   if (libvchan_flush(ctrl) < 0)
+       return -1;
+   stat_inc(ctrl, waits);
+   if (ctrl->spin_max_ns) {
+       start = now_ns();
+       if (ctrl->spin_ns && spin_wait(ctrl, start)) {
+           stat_inc(ctrl, spins);
+           spin_tune(ctrl, now_ns() - start);
+           return 0;
+       }
+   }
+   if (read_event(ctrl))
+       return -1;
+   stat_inc(ctrl, wakeups);
+   if (ctrl->spin_max_ns)
+       spin_tune(ctrl, now_ns() - start);
+   return 0;
+}
+
+int libvchan_set_threaded(struct libvchan *ctrl, int mode)
+{
+   struct libvchan_sync *sync = ctrl->sync;
+   int i;
+
+   if (mode != VCHAN_THREAD_NONE && mode != VCHAN_THREAD_DUPLEX &&
+       mode != VCHAN_THREAD_SHARED && mode != VCHAN_THREAD_MPSC)
+       return -1;
+   if (mode != VCHAN_THREAD_NONE && (ctrl->write_reserved || ctrl->read_peeked))
+       return -1;
+   // the producers' shadow index becomes the real one again
+   if (ctrl->thread_mode == VCHAN_THREAD_MPSC)
+       ctrl->write.local = ctrl->sync->mp_tail;
+   if (mode == VCHAN_THREAD_NONE) {
+       if (sync) {
+           pthread_mutex_destroy(&sync->lock);
+           for (i = 0; i < 2; i++) {
+               pthread_cond_destroy(&sync->cond[i]);
+               pthread_mutex_destroy(&sync->dir_lock[i]);
+           }
+           free(sync);
+       }
+       ctrl->sync = NULL;
+       ctrl->thread_mode = mode;
+       return 0;
+   }
+   if (!sync) {
+       // keep the MPSC indexes on cache lines of their own
+       if (posix_memalign((void **)&sync, VCHAN_CACHELINE, sizeof(*sync)))
+           return -1;
+       memset(sync, 0, sizeof(*sync));
+       pthread_mutex_init(&sync->lock, NULL);
+       for (i = 0; i < 2; i++) {
+           pthread_cond_init(&sync->cond[i], NULL);
+           pthread_mutex_init(&sync->dir_lock[i], NULL);
+       }
+   }
+   // publish thresholds would leave one direction's index to the other thread
+   libvchan_flush(ctrl);
+   ctrl->read.threshold = ctrl->write.threshold = 0;
+   sync->seen_prod = load_acquire(ctrl->read.prod);
+   sync->seen_cons = load_acquire(ctrl->write.cons);
+   sync->seen_open = libvchan_is_open(ctrl);
+   sync->mp_head = sync->mp_tail = ctrl->write.local;
+   ctrl->sync = sync;
+   ctrl->thread_mode = mode;
+   return 0;
+}
+
 /**
- * returns -1 on error, or size on success
+ * Called by the thread that read the event channel: wake the threads whose
+ * direction the peer moved, or all of them if the vchan opened or closed.
  */
-static int do_send(struct libvchan *ctrl, const void *data, size_t size)
+static void wake_waiters(struct libvchan *ctrl)
 {
-   int real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
+   struct libvchan_sync *sync = ctrl->sync;
+   uint32_t prod = load_acquire(ctrl->read.prod);
+   uint32_t cons = load_acquire(ctrl->write.cons);
+   int open = libvchan_is_open(ctrl);
+   if (prod != sync->seen_prod || open != sync->seen_open)
+       pthread_cond_broadcast(&sync->cond[DIR_READ]);
+   if (cons != sync->seen_cons || open != sync->seen_open)
+       pthread_cond_broadcast(&sync->cond[DIR_WRITE]);
+   sync->seen_prod = prod;
+   sync->seen_cons = cons;
+   sync->seen_open = open;
+}
+
+/**
+ * Whether the peer moved an index, or opened or closed the vchan, since the
+ * polling thread last woke the waiters.
+ */
+static int sync_moved(struct libvchan *ctrl)
+{
+   struct libvchan_sync *sync = ctrl->sync;
+   return load_acquire(ctrl->read.prod) != sync->seen_prod ||
+          load_acquire(ctrl->write.cons) != sync->seen_cons ||
+          libvchan_is_open(ctrl) != sync->seen_open;
+}
+
+static int spin_dir(struct libvchan *ctrl, uint32_t *idx, uint32_t seen, int open)
+{
+   uint64_t start = now_ns();
+   unsigned int i = 0;
+   while (1) {
+       cpu_relax();
+       if (load_acquire(idx) != seen || libvchan_is_open(ctrl) != open)
+           return 1;
+       if ((++i & SPIN_CLOCK_MASK) == 0 && now_ns() - start >= ctrl->spin_max_ns)
+           return 0;
+   }
+}
+
+/**
+ * Wait for the peer to move the index of direction dir past seen, or for a
+ * close. One waiter reads the event channel on behalf of all the others.
+ */
+static int wait_index(struct libvchan *ctrl, int dir, uint32_t seen)
+{
+   struct libvchan_sync *sync = ctrl->sync;
+   uint32_t *idx = dir == DIR_READ ? ctrl->read.prod : ctrl->write.cons;
+   int open = libvchan_is_open(ctrl);
+   int ret = 0, others;
+
+   stat_inc(ctrl, waits);
+   if (ctrl->spin_max_ns && spin_dir(ctrl, idx, seen, open)) {
+       stat_inc(ctrl, spins);
+       return 0;
+   }
+
+   pthread_mutex_lock(&sync->lock);
+   while (load_acquire(idx) == seen && libvchan_is_open(ctrl) == open) {
+       if (sync->polling) {
+           sync->waiters[dir]++;
+           pthread_cond_wait(&sync->cond[dir], &sync->lock);
+           sync->waiters[dir]--;
+           continue;
+       }
+       sync->polling = 1;
+       others = sync->waiters[!dir];
+       pthread_mutex_unlock(&sync->lock);
+       // the notify a waiter asked for may have been spent on an index it
+       // had already seen, leaving only a stale event; ask again before
+       // blocking, for the other direction's waiters too
+       request_notify(ctrl, dir == DIR_READ ? VCHAN_NOTIFY_WRITE : VCHAN_NOTIFY_READ);
+       if (others)
+           request_notify(ctrl, dir == DIR_READ ? VCHAN_NOTIFY_READ : VCHAN_NOTIFY_WRITE);
+       if (load_acquire(idx) == seen && libvchan_is_open(ctrl) == open && !sync_moved(ctrl)) {
+           ret = read_event(ctrl);
+           if (!ret)
+               stat_inc(ctrl, wakeups);
+       }
+       pthread_mutex_lock(&sync->lock);
+       sync->polling = 0;
+       wake_waiters(ctrl);
+       if (ret)
+           break;
+   }
+   // someone has to take over the event channel for the threads left waiting
+   if (!sync->polling) {
+       if (sync->waiters[DIR_READ])
+           pthread_cond_signal(&sync->cond[DIR_READ]);
+       else if (sync->waiters[DIR_WRITE])
+           pthread_cond_signal(&sync->cond[DIR_WRITE]);
+   }
+   pthread_mutex_unlock(&sync->lock);
+   return ret;
+}
+
+/**
+ * Wait for the peer to move past the index the caller last saw in direction
+ * dir, through the wait queues in threaded modes.
+ */
+static int wait_dir(struct libvchan *ctrl, int dir)
+{
+   if (!ctrl->sync)
+       return libvchan_wait(ctrl);
+   return wait_index(ctrl, dir, dir == DIR_READ ? ctrl->read.peer : ctrl->write.peer);
+}
+
+/**
+ * In VCHAN_THREAD_SHARED mode, serialize the threads using one direction.
+ */
+static void lock_dir(struct libvchan *ctrl, int dir)
+{
+   if (ctrl->thread_mode == VCHAN_THREAD_SHARED)
+       pthread_mutex_lock(&ctrl->sync->dir_lock[dir]);
+}
+
+static void unlock_dir(struct libvchan *ctrl, int dir)
+{
+   if (ctrl->thread_mode == VCHAN_THREAD_SHARED)
+       pthread_mutex_unlock(&ctrl->sync->dir_lock[dir]);
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt)
+{
+   size_t size = 0;
+   int i;
+   for (i = 0; i < iovcnt; i++)
+       size += iov[i].iov_len;
+   return size;
+}
+
+/**
+ * Copy size bytes into the ring at index idx, folding them into *crc if it
+ * is not NULL.
+ */
+static void copy_to_ring(struct libvchan *ctrl, uint32_t idx, const void *data, size_t size,
+                         uint32_t *crc)
+{
+   int real_idx = idx & (wr_ring_size(ctrl) - 1);
    int avail_contig = wr_ring_size(ctrl) - real_idx;
    if (VCHAN_DEBUG) {
        char metainfo[32];
@@ -142,146 +711,663 @@ static int do_send(struct libvchan *ctrl, const void *data, size_t size)
        iov[1].iov_len = size;
        writev(-1, iov, 2);
    }
+   libvchan_copy_fn copy = size >= ctrl->copy.nt_threshold ? ctrl->copy.copy_nt : ctrl->copy.copy;
    if (avail_contig > size)
        avail_contig = size;
-   memcpy(wr_ring(ctrl) + real_idx, data, avail_contig);
+   if (crc) {
+       *crc = ctrl->copy.copy_crc(wr_ring(ctrl) + real_idx, data, avail_contig, *crc);
+       if (avail_contig < size)
+           *crc = ctrl->copy.copy_crc(wr_ring(ctrl), data + avail_contig, size - avail_contig, *crc);
+       return;
+   }
+   copy(wr_ring(ctrl) + real_idx, data, avail_contig);
    if (avail_contig < size)
    {
        // we rolled across the end of the ring
-       memcpy(wr_ring(ctrl), data + avail_contig, size - avail_contig);
+       copy(wr_ring(ctrl), data + avail_contig, size - avail_contig);
    }
-   barrier(); // data must be in the ring prior to increment
-   wr_prod(ctrl) += size;
-   barrier(); // increment must happen prior to notify
-   if (do_notify(ctrl) < 0)
+}
+
+static void copy_from_ring(struct libvchan *ctrl, uint32_t idx, void *data, size_t size)
+{
+   int real_idx = idx & (rd_ring_size(ctrl) - 1);
+   int avail_contig = rd_ring_size(ctrl) - real_idx;
+   if (avail_contig > size)
+       avail_contig = size;
+   if (ctrl->read.crc_on) {
+       ctrl->read.crc = ctrl->copy.copy_crc(data, rd_ring(ctrl) + real_idx, avail_contig,
+                                            ctrl->read.crc);
+       if (avail_contig < size)
+           ctrl->read.crc = ctrl->copy.copy_crc(data + avail_contig, rd_ring(ctrl),
+                                                size - avail_contig, ctrl->read.crc);
+   } else {
+       ctrl->copy.copy(data, rd_ring(ctrl) + real_idx, avail_contig);
+       if (avail_contig < size)
+       {
+           // we rolled across the end of the ring
+           ctrl->copy.copy(data + avail_contig, rd_ring(ctrl), size - avail_contig);
+       }
+   }
+   if (VCHAN_DEBUG) {
+       char metainfo[32];
+       struct iovec iov[2];
+       iov[0].iov_base = metainfo;
+       iov[0].iov_len = snprintf(metainfo, 32, "vchan rd %d/%d", ctrl->other_domain_id, ctrl->device_number);
+       iov[1].iov_base = data;
+       iov[1].iov_len = size;
+       writev(-1, iov, 2);
+   }
+}
+
+/**
+ * Copy size bytes, starting skip bytes into the iovec array, into the ring
+ * at index idx. If the last iovec is VCHAN_CRC_TRAILER, the CRC32C of the
+ * others is computed as they are copied, and goes in its place.
+ */
+static void copy_iov_to_ring(struct libvchan *ctrl, uint32_t idx, const struct iovec *iov,
+                             int iovcnt, size_t skip, size_t size)
+{
+   int trailer = iovcnt && iov[iovcnt - 1].iov_base == VCHAN_CRC_TRAILER;
+   uint32_t *crc = trailer ? &ctrl->write.crc : NULL;
+   uint32_t value;
+   size_t left = size;
+   int i;
+   // a streamed message is copied over several calls
+   if (trailer && skip == 0)
+       ctrl->write.crc = ~0U;
+   for (i = 0; i < iovcnt && left; i++) {
+       const void *data = iov[i].iov_base;
+       size_t len = iov[i].iov_len;
+       if (data == VCHAN_CRC_TRAILER) {
+           // everything before has been copied, so the CRC is complete
+           value = ~ctrl->write.crc;
+           data = &value;
+           crc = NULL;
+       }
+       if (skip >= len) {
+           skip -= len;
+           continue;
+       }
+       data += skip;
+       len -= skip;
+       skip = 0;
+       if (len > left)
+           len = left;
+       copy_to_ring(ctrl, idx, data, len, crc);
+       idx += len;
+       left -= len;
+   }
+}
+
+/**
+ * Copy size bytes, starting skip bytes into the iovec array, into the ring
+ * and publish them with a single index update and notify.
+ * returns -1 on error, or size on success
+ */
+static int do_sendv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt,
+                    size_t skip, size_t size)
+{
+   copy_iov_to_ring(ctrl, wr_prod(ctrl), iov, iovcnt, skip, size);
+   if (advance_wr_prod(ctrl, size) < 0)
        return -1;
    return size;
 }
 
 /**
+ * VCHAN_THREAD_MPSC send: claim size bytes of the ring by advancing the
+ * shadow producer index mp_head, copy into them concurrently with the other
+ * producers, then publish in claim order, so the index the peer sees only
+ * ever covers completely written bytes.
  * returns 0 if no buffer space is available, -1 on error, or size on success
  */
-int libvchan_send(struct libvchan *ctrl, const void *data, size_t size)
+static int mpsc_sendv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt, size_t size)
+{
+   struct libvchan_sync *sync = ctrl->sync;
+   uint32_t head, cons;
+   unsigned int spins = 0;
+
+   if (size > wr_ring_size(ctrl))
+       return -1;
+   head = __atomic_load_n(&sync->mp_head, __ATOMIC_RELAXED);
+   while (1) {
+       if (!libvchan_is_open(ctrl))
+           return -1;
+       cons = load_acquire(ctrl->write.cons);
+       if (wr_ring_size(ctrl) - (head - cons) >= size) {
+           if (__atomic_compare_exchange_n(&sync->mp_head, &head, head + size, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+               break;
+           continue;
+       }
+       // we plan to fill the buffer; please tell us when you've read it
+       request_notify(ctrl, VCHAN_NOTIFY_READ);
+       if (load_acquire(ctrl->write.cons) == cons) {
+           if (!ctrl->blocking)
+               return 0;
+           if (wait_index(ctrl, DIR_WRITE, cons))
+               return -1;
+       }
+       head = __atomic_load_n(&sync->mp_head, __ATOMIC_RELAXED);
+   }
+
+   copy_iov_to_ring(ctrl, head, iov, iovcnt, 0, size);
+
+   // producers that claimed earlier space publish first
+   while (__atomic_load_n(&sync->mp_tail, __ATOMIC_ACQUIRE) != head) {
+       cpu_relax();
+       if ((++spins & MPSC_YIELD_MASK) == 0)
+           sched_yield();
+   }
+   store_release(ctrl->write.prod, head + size);
+   store_release(&sync->mp_tail, head + size);
+   // a later claim will be published after ours, and its notify covers both
+   if (__atomic_load_n(&sync->mp_head, __ATOMIC_RELAXED) != head + size) {
+       stat_inc(ctrl, notify_suppressed);
+       return size;
+   }
+   if (send_notify(ctrl, VCHAN_NOTIFY_WRITE) < 0)
+       return -1;
+   return size;
+}
+
+static int sendv_locked(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
+   size_t size = iov_total(iov, iovcnt);
    int avail;
    while (1) {
        if (!libvchan_is_open(ctrl))
            return -1;
-       avail = libvchan_buffer_space(ctrl);
+       avail = fast_get_buffer_space(ctrl, size, size);
        if (size <= avail)
-           return do_send(ctrl, data, size);
+           return do_sendv(ctrl, iov, iovcnt, 0, size);
        if (!ctrl->blocking)
            return 0;
        if (size > wr_ring_size(ctrl))
            return -1;
-       if (libvchan_wait(ctrl))
+       if (wait_dir(ctrl, DIR_WRITE))
            return -1;
    }
 }
 
-int libvchan_write(struct libvchan *ctrl, const void *data, size_t size)
+/**
+ * returns 0 if no buffer space is available, -1 on error, or size on success
+ */
+int libvchan_sendv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
+   int rv;
+   if (ctrl->thread_mode == VCHAN_THREAD_MPSC)
+       return mpsc_sendv(ctrl, iov, iovcnt, iov_total(iov, iovcnt));
+   lock_dir(ctrl, DIR_WRITE);
+   rv = sendv_locked(ctrl, iov, iovcnt);
+   unlock_dir(ctrl, DIR_WRITE);
+   return rv;
+}
+
+int libvchan_send(struct libvchan *ctrl, const void *data, size_t size)
+{
+   struct iovec iov = { (void *)data, size };
+   return libvchan_sendv(ctrl, &iov, 1);
+}
+
+static int writev_locked(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+   size_t size = iov_total(iov, iovcnt);
    int avail;
    if (!libvchan_is_open(ctrl))
        return -1;
    if (ctrl->blocking) {
        size_t pos = 0;
        while (1) {
-           avail = libvchan_buffer_space(ctrl);
+           avail = fast_get_buffer_space(ctrl, size - pos, stream_wake(&ctrl->write, size - pos));
            if (pos + avail > size)
                avail = size - pos;
-           if (avail)
-               pos += do_send(ctrl, data + pos, avail);
-           if (pos == size)
-               return pos;
-           if (libvchan_wait(ctrl))
+           if (avail) {
+               pos += do_sendv(ctrl, iov, iovcnt, pos, avail);
+               if (pos == size)
+                   return pos;
+               // the watermark asked for was for the space we just filled
+               continue;
+           }
+           if (wait_dir(ctrl, DIR_WRITE))
                return -1;
            if (!libvchan_is_open(ctrl))
                return -1;
        }
    } else {
-       avail = libvchan_buffer_space(ctrl);
+       avail = fast_get_buffer_space(ctrl, size, stream_wake(&ctrl->write, size));
        if (size > avail)
            size = avail;
        if (size == 0)
            return 0;
-       return do_send(ctrl, data, size);
+       return do_sendv(ctrl, iov, iovcnt, 0, size);
    }
 }
 
-static int do_recv(struct libvchan *ctrl, void *data, size_t size)
+int libvchan_writev(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
-   int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
-   int avail_contig = rd_ring_size(ctrl) - real_idx;
+   int rv;
+   // a partial write could be interleaved with another producer's data
+   if (ctrl->thread_mode == VCHAN_THREAD_MPSC)
+       return mpsc_sendv(ctrl, iov, iovcnt, iov_total(iov, iovcnt));
+   lock_dir(ctrl, DIR_WRITE);
+   rv = writev_locked(ctrl, iov, iovcnt);
+   unlock_dir(ctrl, DIR_WRITE);
+   return rv;
+}
+
+int libvchan_write(struct libvchan *ctrl, const void *data, size_t size)
+{
+   struct iovec iov = { (void *)data, size };
+   return libvchan_writev(ctrl, &iov, 1);
+}
+
+/**
+ * Describe size bytes of a ring starting at index idx as at most two spans,
+ * the second one being empty unless the region wraps around.
+ */
+static void ring_spans(void *ring, uint32_t ring_size, uint32_t idx, size_t size,
+                       struct iovec *span1, struct iovec *span2)
+{
+   int real_idx = idx & (ring_size - 1);
+   int avail_contig = ring_size - real_idx;
    if (avail_contig > size)
        avail_contig = size;
-   barrier(); // data read must happen after rd_cons read
-   memcpy(data, rd_ring(ctrl) + real_idx, avail_contig);
-   if (avail_contig < size)
-   {
-       // we rolled across the end of the ring
-       memcpy(data + avail_contig, rd_ring(ctrl), size - avail_contig);
+   span1->iov_base = ring + real_idx;
+   span1->iov_len = avail_contig;
+   span2->iov_base = ring;
+   span2->iov_len = size - avail_contig;
+}
+
+static int write_reserve_locked(struct libvchan *ctrl, size_t size,
+                                struct iovec *span1, struct iovec *span2)
+{
+   int avail;
+   if (ctrl->write_reserved)
+       return -1;
+   while (1) {
+       if (!libvchan_is_open(ctrl))
+           return -1;
+       avail = fast_get_buffer_space(ctrl, size, size);
+       if (size <= avail)
+           break;
+       if (!ctrl->blocking)
+           return 0;
+       if (size > wr_ring_size(ctrl))
+           return -1;
+       if (wait_dir(ctrl, DIR_WRITE))
+           return -1;
    }
-   rd_cons(ctrl) += size;
-   if (VCHAN_DEBUG) {
-       char metainfo[32];
-       struct iovec iov[2];
-       iov[0].iov_base = metainfo;
-       iov[0].iov_len = snprintf(metainfo, 32, "vchan rd %d/%d", ctrl->other_domain_id, ctrl->device_number);
-       iov[1].iov_base = data;
-       iov[1].iov_len = size;
-       writev(-1, iov, 2);
+   ring_spans(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), size, span1, span2);
+   ctrl->write_reserved = size;
+   return size;
+}
+
+/**
+ * returns 0 if no buffer space is available, -1 on error, or size on success
+ */
+int libvchan_write_reserve(struct libvchan *ctrl, size_t size,
+                           struct iovec *span1, struct iovec *span2)
+{
+   int rv;
+   if (ctrl->thread_mode == VCHAN_THREAD_MPSC)
+       return -1;
+   lock_dir(ctrl, DIR_WRITE);
+   rv = write_reserve_locked(ctrl, size, span1, span2);
+   // the direction stays locked until the reservation is committed
+   if (rv <= 0)
+       unlock_dir(ctrl, DIR_WRITE);
+   return rv;
+}
+
+int libvchan_write_commit(struct libvchan *ctrl, size_t size)
+{
+   size_t reserved = ctrl->write_reserved;
+   int rv = size;
+   ctrl->write_reserved = 0;
+   // an oversized commit publishes nothing but still ends the reservation
+   if (size > reserved)
+       rv = -1;
+   else if (size && advance_wr_prod(ctrl, size) < 0)
+       rv = -1;
+   if (reserved)
+       unlock_dir(ctrl, DIR_WRITE);
+   return rv;
+}
+
+static int send_batch_locked(struct libvchan *ctrl, const struct iovec *msgs, int count)
+{
+   size_t size = 0;
+   int avail, n;
+   if (count <= 0)
+       return 0;
+   while (1) {
+       if (!libvchan_is_open(ctrl))
+           return -1;
+       avail = fast_get_buffer_space(ctrl, msgs[0].iov_len, msgs[0].iov_len);
+       if (msgs[0].iov_len <= avail)
+           break;
+       if (!ctrl->blocking)
+           return 0;
+       if (msgs[0].iov_len > wr_ring_size(ctrl))
+           return -1;
+       if (wait_dir(ctrl, DIR_WRITE))
+           return -1;
    }
-   barrier(); // consumption must happen prior to notify of newly freed space
-   if (do_notify(ctrl) < 0)
+   for (n = 0; n < count && size + msgs[n].iov_len <= avail; n++)
+       size += msgs[n].iov_len;
+   if (do_sendv(ctrl, msgs, n, 0, size) < 0)
        return -1;
-   return size;
+   return n;
 }
 
 /**
- * reads exactly size bytes from the vchan.
- * returns 0 if insufficient data is available, -1 on error, or size on success
+ * Sends as many of the messages in msgs as fit in the ring, each one whole,
+ * with a single index update and notify for the batch.
+ * returns 0 if no buffer space is available, -1 on error, or the number of
+ * messages sent
  */
-int libvchan_recv(struct libvchan *ctrl, void *data, size_t size)
+int libvchan_send_batch(struct libvchan *ctrl, const struct iovec *msgs, int count)
+{
+   int rv;
+   if (ctrl->thread_mode == VCHAN_THREAD_MPSC) {
+       size_t size = 0;
+       int n;
+       for (n = 0; n < count && size + msgs[n].iov_len <= wr_ring_size(ctrl); n++)
+           size += msgs[n].iov_len;
+       if (n == 0)
+           return count ? -1 : 0;
+       rv = mpsc_sendv(ctrl, msgs, n, size);
+       return rv > 0 ? n : rv;
+   }
+   lock_dir(ctrl, DIR_WRITE);
+   rv = send_batch_locked(ctrl, msgs, count);
+   unlock_dir(ctrl, DIR_WRITE);
+   return rv;
+}
+
+/**
+ * Copy size bytes from the ring into the iovec array and consume them with
+ * a single index update and notify.
+ * returns -1 on error, or size on success
+ */
+static int do_recvv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt, size_t size)
 {
+   uint32_t idx = rd_cons(ctrl);
+   size_t left = size;
+   int i;
+   for (i = 0; i < iovcnt && left; i++) {
+       size_t len = iov[i].iov_len;
+       if (len > left)
+           len = left;
+       copy_from_ring(ctrl, idx, iov[i].iov_base, len);
+       idx += len;
+       left -= len;
+   }
+   if (advance_rd_cons(ctrl, size) < 0)
+       return -1;
+   return size;
+}
+
+static int recvv_locked(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+   size_t size = iov_total(iov, iovcnt);
    while (1) {
-       int avail = libvchan_data_ready(ctrl);
+       int avail = fast_get_data_ready(ctrl, size, size);
        if (size <= avail)
-           return do_recv(ctrl, data, size);
+           return do_recvv(ctrl, iov, iovcnt, size);
        if (!libvchan_is_open(ctrl))
            return -1;
        if (!ctrl->blocking)
            return 0;
        if (size > rd_ring_size(ctrl))
            return -1;
-       if (libvchan_wait(ctrl))
+       if (wait_dir(ctrl, DIR_READ))
            return -1;
    }
 }
 
-int libvchan_read(struct libvchan *ctrl, void *data, size_t size)
+/**
+ * reads exactly the total size of iov from the vchan.
+ * returns 0 if insufficient data is available, -1 on error, or size on success
+ */
+int libvchan_recvv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
+   int rv;
+   lock_dir(ctrl, DIR_READ);
+   rv = recvv_locked(ctrl, iov, iovcnt);
+   unlock_dir(ctrl, DIR_READ);
+   return rv;
+}
+
+int libvchan_recv(struct libvchan *ctrl, void *data, size_t size)
+{
+   struct iovec iov = { data, size };
+   return libvchan_recvv(ctrl, &iov, 1);
+}
+
+static int readv_locked(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+   size_t size = iov_total(iov, iovcnt);
    while (1) {
-       int avail = libvchan_data_ready(ctrl);
+       int avail = fast_get_data_ready(ctrl, 1, stream_wake(&ctrl->read, size));
        if (avail && size > avail)
            size = avail;
        if (avail)
-           return do_recv(ctrl, data, size);
+           return do_recvv(ctrl, iov, iovcnt, size);
+       if (!libvchan_is_open(ctrl))
+           return -1;
+       if (!ctrl->blocking)
+           return 0;
+       if (wait_dir(ctrl, DIR_READ))
+           return -1;
+   }
+}
+
+int libvchan_readv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+   int rv;
+   lock_dir(ctrl, DIR_READ);
+   rv = readv_locked(ctrl, iov, iovcnt);
+   unlock_dir(ctrl, DIR_READ);
+   return rv;
+}
+
+int libvchan_read(struct libvchan *ctrl, void *data, size_t size)
+{
+   struct iovec iov = { data, size };
+   return libvchan_readv(ctrl, &iov, 1);
+}
+
+static int recv_batch_locked(struct libvchan *ctrl, const struct iovec *msgs, int count)
+{
+   size_t size = 0;
+   int avail, n;
+   if (count <= 0)
+       return 0;
+   while (1) {
+       avail = fast_get_data_ready(ctrl, msgs[0].iov_len, msgs[0].iov_len);
+       if (msgs[0].iov_len <= avail)
+           break;
+       if (!libvchan_is_open(ctrl))
+           return -1;
+       if (!ctrl->blocking)
+           return 0;
+       if (msgs[0].iov_len > rd_ring_size(ctrl))
+           return -1;
+       if (wait_dir(ctrl, DIR_READ))
+           return -1;
+   }
+   for (n = 0; n < count && size + msgs[n].iov_len <= avail; n++)
+       size += msgs[n].iov_len;
+   if (do_recvv(ctrl, msgs, n, size) < 0)
+       return -1;
+   return n;
+}
+
+/**
+ * Receives as many of the messages in msgs as are completely available,
+ * with a single index update and notify for the batch.
+ * returns 0 if insufficient data is available, -1 on error, or the number of
+ * messages received
+ */
+int libvchan_recv_batch(struct libvchan *ctrl, const struct iovec *msgs, int count)
+{
+   int rv;
+   lock_dir(ctrl, DIR_READ);
+   rv = recv_batch_locked(ctrl, msgs, count);
+   unlock_dir(ctrl, DIR_READ);
+   return rv;
+}
+
+static int read_peek_locked(struct libvchan *ctrl, struct iovec *iov, size_t max)
+{
+   int avail;
+   while (1) {
+       avail = fast_get_data_ready(ctrl, 1, stream_wake(&ctrl->read, max));
+       if (avail)
+           break;
        if (!libvchan_is_open(ctrl))
            return -1;
        if (!ctrl->blocking)
            return 0;
-       if (libvchan_wait(ctrl))
+       if (wait_dir(ctrl, DIR_READ))
            return -1;
    }
+   if (avail > max)
+       avail = max;
+   ring_spans((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl), avail, &iov[0], &iov[1]);
+   ctrl->read_peeked = avail;
+   return avail;
+}
+
+/**
+ * returns -1 on error, 0 if nonblocking and no data is available, or the
+ * number of bytes described by iov
+ */
+int libvchan_read_peek(struct libvchan *ctrl, struct iovec *iov, size_t max)
+{
+   int rv;
+   lock_dir(ctrl, DIR_READ);
+   rv = read_peek_locked(ctrl, iov, max);
+   // the direction stays locked until the data is released
+   if (rv <= 0)
+       unlock_dir(ctrl, DIR_READ);
+   return rv;
+}
+
+int libvchan_read_release(struct libvchan *ctrl, size_t size)
+{
+   size_t peeked = ctrl->read_peeked;
+   int rv = size;
+   ctrl->read_peeked = 0;
+   if (size > ctrl->read.peer - rd_cons(ctrl))
+       rv = -1;
+   else if (size && advance_rd_cons(ctrl, size) < 0)
+       rv = -1;
+   if (peeked)
+       unlock_dir(ctrl, DIR_READ);
+   return rv;
+}
+
+static int splice_from_fd_locked(struct libvchan *ctrl, int fd, off_t *offset, size_t len)
+{
+   struct iovec span[2];
+   ssize_t rv;
+   int avail;
+   while (1) {
+       if (!libvchan_is_open(ctrl))
+           return -1;
+       avail = fast_get_buffer_space(ctrl, 1, stream_wake(&ctrl->write, len));
+       if (avail)
+           break;
+       // 0 is the end of the file, so a full ring has to be told apart
+       if (!ctrl->blocking) {
+           errno = EAGAIN;
+           return -1;
+       }
+       if (wait_dir(ctrl, DIR_WRITE))
+           return -1;
+   }
+   if (avail > len)
+       avail = len;
+   // the file is read straight into the free part of the ring
+   ring_spans(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), avail, &span[0], &span[1]);
+   if (offset)
+       rv = preadv(fd, span, span[1].iov_len ? 2 : 1, *offset);
+   else
+       rv = readv(fd, span, span[1].iov_len ? 2 : 1);
+   if (rv <= 0)
+       return rv;
+   if (offset)
+       *offset += rv;
+   if (advance_wr_prod(ctrl, rv) < 0)
+       return -1;
+   return rv;
+}
+
+int libvchan_splice_from_fd(struct libvchan *ctrl, int fd, off_t *offset, size_t len)
+{
+   int rv;
+   if (ctrl->thread_mode == VCHAN_THREAD_MPSC)
+       return -1;
+   if (len == 0)
+       return 0;
+   lock_dir(ctrl, DIR_WRITE);
+   rv = splice_from_fd_locked(ctrl, fd, offset, len);
+   unlock_dir(ctrl, DIR_WRITE);
+   return rv;
+}
+
+static int splice_to_fd_locked(struct libvchan *ctrl, int fd, off_t *offset, size_t len)
+{
+   struct iovec span[2];
+   ssize_t rv;
+   int avail;
+   while (1) {
+       avail = fast_get_data_ready(ctrl, 1, stream_wake(&ctrl->read, len));
+       if (avail)
+           break;
+       if (!libvchan_is_open(ctrl))
+           return -1;
+       if (!ctrl->blocking)
+           return 0;
+       if (wait_dir(ctrl, DIR_READ))
+           return -1;
+   }
+   if (avail > len)
+       avail = len;
+   // the file is written straight from the filled part of the ring
+   ring_spans((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl), avail, &span[0], &span[1]);
+   if (offset)
+       rv = pwritev(fd, span, span[1].iov_len ? 2 : 1, *offset);
+   else
+       rv = writev(fd, span, span[1].iov_len ? 2 : 1);
+   if (rv <= 0)
+       return rv < 0 ? -1 : 0;
+   if (offset)
+       *offset += rv;
+   if (advance_rd_cons(ctrl, rv) < 0)
+       return -1;
+   return rv;
+}
+
+int libvchan_splice_to_fd(struct libvchan *ctrl, int fd, off_t *offset, size_t len)
+{
+   int rv;
+   if (len == 0)
+       return 0;
+   lock_dir(ctrl, DIR_READ);
+   rv = splice_to_fd_locked(ctrl, fd, offset, len);
+   unlock_dir(ctrl, DIR_READ);
+   return rv;
 }
 
 int libvchan_is_open(struct libvchan* ctrl)
 {
    if (ctrl->is_server)
-       return ctrl->server_persist || ctrl->ring->cli_live;
+       return ctrl->server_persist || *ctrl->cli_live;
    else
-       return ctrl->ring->srv_live;
+       return *ctrl->srv_live;
 }
 
 /// The fd to use for select() set
@@ -290,25 +1376,74 @@ int libvchan_fd_for_select(struct libvchan *ctrl)
    return ctrl->event_fd;
 }
 
+/**
+ * Size of the indirect pages of a ring, which hold one grant per ring page
+ */
+static size_t indirect_size(int order)
+{
+   size_t pages = 1 << (order - PAGE_SHIFT);
+   return (pages + GRANTS_PER_PAGE - 1) / GRANTS_PER_PAGE * PAGE_SIZE;
+}
+
 void libvchan_close(struct libvchan *ctrl)
 {
    if (!ctrl)
        return;
    if (ctrl->ring) {
+       libvchan_flush(ctrl);
        if (ctrl->is_server)
-           ctrl->ring->srv_live = 0;
+           *ctrl->srv_live = 0;
        else
-           ctrl->ring->cli_live = 0;
+           *ctrl->cli_live = 0;
        munmap(ctrl->ring, PAGE_SIZE);
    }
+   if (ctrl->aio)
+       vchan_aio_detach(ctrl);
    if (ctrl->event_fd != -1) {
        if (ctrl->event_port > 0 && ctrl->ring)
            do_notify(ctrl);
-       close(ctrl->event_fd);
+       // a poller's fd is shared; only our port goes away
+       if (ctrl->poller)
+           vchan_poller_detach(ctrl);
+       else
+           close(ctrl->event_fd);
    }
    if (ctrl->read.order >= PAGE_SHIFT)
        munmap(ctrl->read.buffer, 1 << ctrl->read.order);
    if (ctrl->write.order >= PAGE_SHIFT)
        munmap(ctrl->write.buffer, 1 << ctrl->write.order);
+   if (ctrl->read.indirect)
+       munmap(ctrl->read.indirect, indirect_size(ctrl->read.order));
+   if (ctrl->write.indirect)
+       munmap(ctrl->write.indirect, indirect_size(ctrl->write.order));
+   vchan_region_cache_free(ctrl);
+   libvchan_set_threaded(ctrl, VCHAN_THREAD_NONE);
+   free(ctrl->msg_pool);
    free(ctrl);
 }
+
+void libvchan_mq_close(struct libvchan_mq *mq)
+{
+   int i;
+   if (!mq)
+       return;
+   for (i = 0; i < mq->nqueues; i++)
+       libvchan_close(mq->queue[i]);
+   free(mq);
+}
+
+struct libvchan *libvchan_mq_queue(struct libvchan_mq *mq, int index)
+{
+   if (index < 0 || index >= mq->nqueues)
+       return NULL;
+   return mq->queue[index];
+}
+
+struct libvchan *libvchan_mq_pick(struct libvchan_mq *mq, uint64_t key)
+{
+   // mix the key so that sequential flow ids spread over the queues
+   key ^= key >> 33;
+   key *= 0xff51afd7ed558ccdULL;
+   key ^= key >> 33;
+   return mq->queue[key % mq->nqueues];
+}
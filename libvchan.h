@@ -42,10 +42,19 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#ifndef LIBVCHAN_H
+#define LIBVCHAN_H
+
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <xen/sys/evtchn.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct ring_shared {
    uint32_t cons, prod;
 };
@@ -77,9 +86,16 @@ struct vchan_interface {
     */
    uint8_t cli_live, srv_live;
    /**
-    * structure padding; magic values depending on setup stage
+    * Notification bits:
+    *  VCHAN_NOTIFY_WRITE: send notify when data is written
+    *  VCHAN_NOTIFY_READ: send notify when data is read (consumed)
+    * cli_notify is used for the client to inform the server of its action;
+    * srv_notify is used for the server to inform the client of its action.
+    * A side sets a bit in its peer's byte just before it blocks, and the
+    * peer clears it again when it sends the event, so an event is only
+    * raised when somebody is actually waiting for it.
     */
-   uint16_t debug;
+   uint8_t cli_notify, srv_notify;
    /**
     * Grant list: ordering is left, right. Must not extend into actual ring
     * or grow beyond the end of the initial shared page.
@@ -89,17 +105,255 @@ struct vchan_interface {
    uint32_t grants[0];
 };
 
+#define VCHAN_NOTIFY_WRITE 0x1
+#define VCHAN_NOTIFY_READ 0x2
+/**
+ * A v1 peer that predates the notify bytes never posts requests: it writes
+ * its setup magic, 0xabcd (server) or 0xabce (client), over both bytes and
+ * expects an event for every update. Those high bits, which no other writer
+ * sets, mean the peer has not negotiated suppression, so we always notify.
+ */
+#define VCHAN_NOTIFY_LEGACY 0xf0
+/* v2 only: the request of the bit two places down carries a watermark.
+ * Peers that predate watermarks ignore these bits and notify on any move. */
+#define VCHAN_NOTIFY_WRITE_MARK 0x4
+#define VCHAN_NOTIFY_READ_MARK 0x8
+
+#define VCHAN_MARK_WRITE 0
+#define VCHAN_MARK_READ 1
+
+#define VCHAN_VERSION_1 1
+#define VCHAN_VERSION_2 2
+
+#define VCHAN_CACHELINE 64
+
+/**
+ * vchan_interface_v2: shared page layout with every index on its own cache
+ * line, so that the producer and consumer of each ring, and the two rings
+ * of a full-duplex channel, do not false-share.
+ *
+ * The first line starts like a v1 page whose ring orders are zero. A v1-only
+ * client rejects those orders and fails to connect rather than misreading
+ * the page; a v2-aware client sees them and checks the version field.
+ */
+struct vchan_interface_v2 {
+   /* v1 header, zeroed so that v1 clients refuse the page */
+   struct ring_shared v1_left, v1_right;
+   uint16_t v1_left_order, v1_right_order;
+   uint8_t v1_live[2], v1_notify[2];
+   /* VCHAN_VERSION_2 */
+   uint32_t version;
+   /* as in v1; constant once the page is shared */
+   uint16_t left_order, right_order;
+   uint8_t pad0[VCHAN_CACHELINE - 32];
+   /* left is client write, server read */
+   uint32_t left_cons;
+   uint8_t pad1[VCHAN_CACHELINE - 4];
+   uint32_t left_prod;
+   uint8_t pad2[VCHAN_CACHELINE - 4];
+   /* right is client read, server write */
+   uint32_t right_cons;
+   uint8_t pad3[VCHAN_CACHELINE - 4];
+   uint32_t right_prod;
+   uint8_t pad4[VCHAN_CACHELINE - 4];
+   /* shutdown detection, as in v1 */
+   uint8_t cli_live, srv_live;
+   uint8_t pad5[VCHAN_CACHELINE - 2];
+   /**
+    * Notification bits, as in v1, one writer's requests per line. Each
+    * request may come with a watermark, the index (prod for
+    * VCHAN_NOTIFY_WRITE, cons for VCHAN_NOTIFY_READ) the waiter needs the
+    * notifying side to reach, valid while the matching VCHAN_NOTIFY_*_MARK
+    * bit is set. Marks are indexed by VCHAN_MARK_WRITE and VCHAN_MARK_READ.
+    */
+   uint8_t cli_notify;
+   uint8_t pad6[3];
+   uint32_t cli_mark[2];
+   uint8_t pad7[VCHAN_CACHELINE - 12];
+   uint8_t srv_notify;
+   uint8_t pad8[3];
+   uint32_t srv_mark[2];
+   uint8_t pad9[VCHAN_CACHELINE - 12];
+   /**
+    * Grant list, as in v1, except that a ring larger than 1 MiB (order 20)
+    * is listed indirectly: its entries are grants of pages which each hold
+    * the grants of the next 1024 pages of the ring. Rings may then be up to
+    * 64 MiB (order 26).
+    */
+   uint32_t grants[0];
+};
+
 struct libvchan_ring {
-   /* Pointer into the shared page. Offsets into buffer. */
-   struct ring_shared* shr;
+   /* Pointers into the shared page. Offsets into buffer. */
+   uint32_t *cons, *prod;
    /* ring data; may be its own shared page(s) depending on order */
    void* buffer;
+   /* [server only] pages listing the grants of buffer, for indirect rings */
+   void* indirect;
    /**
     * The size of the ring is (1 << order); offsets wrap around when they
     * exceed this. This copy is required because we can't trust the order
     * in the shared page to remain constant.
     */
    int order;
+   /**
+    * Our own index for this ring (cons for read, prod for write). It may
+    * be ahead of the copy in the shared page by $pending bytes.
+    */
+   uint32_t local;
+   /* Last value seen of the peer's index; only re-read when it runs out */
+   uint32_t peer;
+   /* Bytes moved since our index was last published */
+   uint32_t pending;
+   /* Publish our index once pending reaches this (0 = always publish) */
+   uint32_t threshold;
+   /* CRC32C of the framed message being moved, with an integrity trailer */
+   uint32_t crc;
+   /* [read only] fold the data copied out of the ring into crc */
+   int crc_on;
+   /**
+    * Streaming calls, which make do with part of what they asked for, ask
+    * to be woken once this many bytes (data to read, or space to write)
+    * are there; 0 means any amount.
+    */
+   uint32_t watermark;
+   /* A notify for this ring was held back by a watermark or moderation */
+   int deferred;
+};
+
+/**
+ * Copy engines for moving data into and out of the rings
+ */
+#define VCHAN_COPY_AUTO 0
+#define VCHAN_COPY_MEMCPY 1
+#define VCHAN_COPY_SSE2 2
+#define VCHAN_COPY_AVX2 3
+#define VCHAN_COPY_AVX512 4
+
+typedef void (*libvchan_copy_fn)(void *dst, const void *src, size_t size);
+/**
+ * Copy size bytes and fold them into a CRC32C, returning the new value. The
+ * CRC is not inverted on the way in or out.
+ */
+typedef uint32_t (*libvchan_crc_fn)(void *dst, const void *src, size_t size, uint32_t crc);
+
+/**
+ * Copy-and-checksum kernels
+ */
+#define VCHAN_CRC_TABLE 0
+#define VCHAN_CRC_SSE42 1
+
+struct libvchan_copy {
+   /* VCHAN_COPY_* engine the kernels were taken from */
+   int engine;
+   /* sends of at least this many bytes use copy_nt */
+   size_t nt_threshold;
+   /* temporal copy, used for receives and small sends */
+   libvchan_copy_fn copy;
+   /* streaming-store copy, which leaves our cache alone and fences itself */
+   libvchan_copy_fn copy_nt;
+   /* copy that also computes a CRC32C, for integrity trailers */
+   libvchan_crc_fn copy_crc;
+};
+
+/**
+ * Event channel statistics, for benchmarking the notification protocol
+ */
+struct libvchan_stats {
+   /* events actually sent to the peer */
+   unsigned long long notify_sent;
+   /* events skipped because the peer was not waiting */
+   unsigned long long notify_suppressed;
+   /* events held back, below the peer's watermark or within the moderation
+    * window; they are sent later, at most one per hold-back streak */
+   unsigned long long notify_deferred;
+   /* calls to libvchan_wait() */
+   unsigned long long waits;
+   /* waits satisfied by spinning, without blocking on the event channel */
+   unsigned long long spins;
+   /* waits that blocked on the event channel and were woken by an event */
+   unsigned long long wakeups;
+};
+
+#define VCHAN_THREAD_NONE 0   /* one thread at a time (default) */
+#define VCHAN_THREAD_DUPLEX 1 /* one reading thread and one writing thread */
+#define VCHAN_THREAD_SHARED 2 /* any number of threads in each direction */
+#define VCHAN_THREAD_MPSC 3   /* lock-free writing threads and one reading thread */
+
+/**
+ * Wait queues for concurrent use, set up by libvchan_set_threaded(). Only
+ * one waiting thread at a time reads the event channel; when it wakes, it
+ * checks which of the peer's indexes moved and wakes the threads waiting on
+ * that direction, handing the event channel over when it leaves.
+ */
+struct libvchan_sync {
+   /* protects the rest of the structure, except dir_lock */
+   pthread_mutex_t lock;
+   /* waiters for the read (0) and write (1) directions */
+   pthread_cond_t cond[2];
+   int waiters[2];
+   /* true while a thread is blocked reading the event channel */
+   int polling;
+   /* peer state when the event channel last fired */
+   uint32_t seen_prod, seen_cons;
+   int seen_open;
+   /* VCHAN_THREAD_SHARED: held by the thread using each direction */
+   pthread_mutex_t dir_lock[2];
+   /* VCHAN_THREAD_MPSC: end of the space claimed by producers */
+   uint32_t mp_head __attribute__((aligned(VCHAN_CACHELINE)));
+   /* VCHAN_THREAD_MPSC: end of the space published to the peer */
+   uint32_t mp_tail __attribute__((aligned(VCHAN_CACHELINE)));
+};
+
+#define VCHAN_REGION_XEN 0   /* pages granted with gntalloc, mapped with gntdev */
+#define VCHAN_REGION_LOCAL 1 /* memfd in this host, for tests without Xen */
+
+/* "VREG", first word of a region descriptor */
+#define VCHAN_REGION_MAGIC 0x47455256
+/* indirect pages listing the grants of a region; 16 pages cover 64 MiB */
+#define VCHAN_REGION_MAX_REFS 16
+/* mapped remote regions kept per vchan before the least recent is unmapped */
+#define VCHAN_REGION_CACHE 64
+
+/**
+ * What the owner of a region sends to its peer so that the peer can map it.
+ * For VCHAN_REGION_XEN, refs are the grants of the indirect pages, each
+ * listing the grants of up to PAGE_SIZE/4 data pages; the granting domain is
+ * the other end of the vchan. For VCHAN_REGION_LOCAL, refs[0] is a memfd of
+ * the process owner.
+ */
+struct libvchan_region_desc {
+   uint32_t magic;
+   uint16_t backend;
+   uint16_t nrefs;
+   /* unique among the regions of the owner */
+   uint32_t id;
+   /* pid of the owner, for VCHAN_REGION_LOCAL */
+   uint32_t owner;
+   uint64_t size;
+   uint32_t refs[VCHAN_REGION_MAX_REFS];
+};
+
+/**
+ * A region of memory shared with the peer, either registered here
+ * (libvchan_region_alloc) or mapped from the peer (libvchan_region_map).
+ */
+struct libvchan_region {
+   struct libvchan_region_desc desc;
+   /* the memory, desc.size bytes */
+   void *addr;
+   /* length of the mapping, a whole number of pages */
+   size_t length;
+   /* the owner's indirect grant pages (VCHAN_REGION_XEN) */
+   void *indirect;
+   /* the memfd (VCHAN_REGION_LOCAL owner) */
+   int fd;
+   /* true if the memory belongs to the peer */
+   int remote:1;
+   /* number of libvchan_region_map() calls not yet balanced by unmap */
+   int users;
+   /* mapped region cache, most recently used first */
+   struct libvchan_region *prev, *next;
 };
 
 /**
@@ -110,9 +364,18 @@ struct libvchan {
    int other_domain_id;
    /* "port" we communicate on (allows multiple vchans to exist in xenstore) */
    int device_number;
+   /* index of this ring pair within a libvchan_mq, or -1 */
+   int queue;
    /* Shared ring page, mapped using gntdev or gntalloc */
    /* Note that the FD for gntdev or gntalloc has already been closed. */
    struct vchan_interface *ring;
+   /* layout of the shared page: VCHAN_VERSION_1 or VCHAN_VERSION_2 */
+   int version;
+   /* Pointers to the flags in the shared page, which depend on the layout */
+   uint8_t *cli_live, *srv_live;
+   uint8_t *cli_notify, *srv_notify;
+   /* watermarks of the requests in cli_notify and srv_notify; NULL in v1 */
+   uint32_t *cli_mark, *srv_mark;
    /* event channel interface (needs port for API) */
    int event_fd;
    uint32_t event_port;
@@ -124,10 +387,109 @@ struct libvchan {
    int blocking:1;
    /* communication rings */
    struct libvchan_ring read, write;
+   /* wait policy: longest time to spin before blocking (0 = never spin) */
+   unsigned int spin_max_ns;
+   /* current spin budget, at most spin_max_ns */
+   unsigned int spin_ns;
+   /* average observed time for the peer to wake us (adaptive mode) */
+   uint64_t spin_gap_ns;
+   /* true if spin_ns tunes itself from spin_gap_ns */
+   int spin_adaptive:1;
+   /* shortest gap between two notifies to the peer (0 = no moderation) */
+   uint64_t notify_window_ns;
+   /* when we last notified the peer, if moderating */
+   uint64_t notify_last_ns;
+   /* bytes handed out by libvchan_write_reserve() but not yet committed */
+   size_t write_reserved;
+   /* bytes handed out by libvchan_read_peek() but not yet released */
+   size_t read_peeked;
+   /* copy kernels, picked by CPUID at setup */
+   struct libvchan_copy copy;
+   /* event channel counters */
+   struct libvchan_stats stats;
+   /* poller whose event channel fd we share, or NULL if event_fd is ours */
+   struct libvchan_poller *poller;
+   /* queued on the poller's ready list */
+   struct libvchan *poll_next;
+   int poll_queued;
+   /* VCHAN_THREAD_* mode, and its wait queues if not VCHAN_THREAD_NONE */
+   int thread_mode;
+   struct libvchan_sync *sync;
+   /* peer regions mapped by libvchan_region_map(), most recently used first */
+   struct libvchan_region *regions;
+   int nregions;
+   /* VCHAN_REGION_LOCAL descriptors may be allocated and mapped (tests only) */
+   int local_regions;
+   /* context whose handles we were set up with, or NULL */
+   struct libvchan_context *ctx;
+   /* queues of libvchan_aio operations on this vchan, or NULL */
+   struct vchan_aio_chan *aio;
+   /* framed message being received: whether its header has been read, its
+    * size, and the bytes of it received so far */
+   int msg_header;
+   uint32_t msg_size, msg_got;
+   /* buffer of libvchan_msg_recv_pooled(), grown to the largest message */
+   void *msg_pool;
+   size_t msg_pool_size;
+   /* framed messages carry a CRC32C trailer */
+   int integrity;
+};
+
+/* readiness reported by libvchan_poller_wait() */
+#define VCHAN_POLL_READ 1   /* data is ready to read */
+#define VCHAN_POLL_WRITE 2  /* there is buffer space to write */
+#define VCHAN_POLL_CLOSED 4 /* the peer closed the vchan, or has not connected */
+
+/**
+ * Event multiplexer for vchans created by libvchan_server_init_poller() and
+ * libvchan_client_init_poller(), whose ports all share one event channel fd.
+ */
+struct libvchan_poller;
+
+struct libvchan_event {
+   struct libvchan *ctrl;
+   /* VCHAN_POLL_* */
+   int events;
+};
+
+/**
+ * Device and xenstore handles shared by all the vchans set up through it,
+ * so that creating a vchan does not open and close each of them again.
+ */
+struct libvchan_context;
+
+/* operations of libvchan_aio_submit() */
+#define VCHAN_AIO_SEND 0  /* libvchan_send() the whole buffer */
+#define VCHAN_AIO_RECV 1  /* libvchan_recv() exactly len bytes */
+#define VCHAN_AIO_WRITE 2 /* stream all of the buffer, as space appears */
+#define VCHAN_AIO_READ 3  /* read whatever is ready, up to len bytes */
+
+/** Submission queue entry */
+struct libvchan_sqe {
+   int opcode;
+   struct libvchan *ctrl;
+   void *buf;
+   size_t len;
+   /* handed back in the completion */
+   uint64_t user_data;
+};
+
+/** Completion queue entry */
+struct libvchan_cqe {
+   uint64_t user_data;
+   /* bytes moved, or -1 on error */
+   int res;
 };
 
 /**
- * Set up a vchan, including granting pages
+ * Asynchronous submission/completion queue for vchan I/O: one thread can
+ * keep operations outstanding on many vchans and reap them as they finish.
+ */
+struct libvchan_aio;
+
+/**
+ * Set up a vchan, including granting pages. Rings over 1 MiB, up to 64 MiB,
+ * use indirect grant pages and so the VCHAN_VERSION_2 shared page layout.
  * @param domain The peer domain that will be connecting
  * @param devno A device number, used to identify this vchan in xenstore
  * @param send_min The minimum size (in bytes) of the send ring (left)
@@ -135,6 +497,16 @@ struct libvchan {
  * @return The structure, or NULL in case of an error
  */
 struct libvchan *libvchan_server_init(int domain, int devno, size_t read_min, size_t write_min);
+/**
+ * Set up a vchan as libvchan_server_init() does, choosing the layout of the
+ * shared page. Clients detect the layout when they connect; VCHAN_VERSION_2
+ * avoids false sharing between the ring indexes, but clients built before it
+ * existed will refuse to connect. libvchan_server_init() uses VCHAN_VERSION_1.
+ * @param version VCHAN_VERSION_1 or VCHAN_VERSION_2
+ * @return The structure, or NULL in case of an error
+ */
+struct libvchan *libvchan_server_init_version(int domain, int devno, size_t read_min,
+                                             size_t write_min, int version);
 /**
  * Connect to an existing vchan. Note: you can reconnect to an existing vchan
  * safely, however no locking is performed, so you must prevent multiple clients
@@ -187,9 +559,274 @@ int libvchan_send(struct libvchan *ctrl, const void *data, size_t size);
  */
 int libvchan_write(struct libvchan *ctrl, const void *data, size_t size);
 /**
- * Waits for reads or writes to unblock, or for a close
+ * Packet-based scatter receive: always reads exactly the total size of the
+ * iovec array, consuming it from the ring with a single notify.
+ * @param ctrl The vchan control structure
+ * @param iov Buffers for data that was read, filled in order
+ * @param iovcnt Number of entries in iov
+ * @return -1 on error, 0 if nonblocking and insufficient data is available,
+ *         or the total size
+ */
+int libvchan_recvv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Stream-based scatter receive: reads as much data as possible into the
+ * iovec array, filling the entries in order.
+ * @return -1 on error, otherwise the amount of data read (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libvchan_readv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Packet-based gather send: sends all entries of the iovec array as one
+ * message, publishing them to the peer with a single notify.
+ * @param ctrl The vchan control structure
+ * @param iov Buffers of data to send, in order
+ * @param iovcnt Number of entries in iov
+ * @return -1 on error, 0 if nonblocking and insufficient space is available,
+ *         or the total size
+ */
+int libvchan_sendv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Stream-based gather send: sends as much of the iovec array as possible.
+ * @return -1 on error, otherwise the amount of data sent (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libvchan_writev(struct libvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Batched packet send: each entry of msgs is a separate message. Sends as
+ * many whole messages as fit in the ring, publishing them to the peer with a
+ * single notify. When blocking, waits until at least the first one fits.
+ * @param ctrl The vchan control structure
+ * @param msgs Array of messages to send
+ * @param count Number of entries in msgs
+ * @return -1 on error, 0 if nonblocking and insufficient space is available,
+ *         or the number of messages sent
+ */
+int libvchan_send_batch(struct libvchan *ctrl, const struct iovec *msgs, int count);
+/**
+ * Batched packet receive: each entry of msgs is a separate message of the
+ * given size. Receives as many whole messages as are available, consuming
+ * them with a single notify. When blocking, waits until at least the first
+ * one is available.
+ * @param ctrl The vchan control structure
+ * @param msgs Array of message buffers to fill
+ * @param count Number of entries in msgs
+ * @return -1 on error, 0 if nonblocking and insufficient data is available,
+ *         or the number of messages received
+ */
+int libvchan_recv_batch(struct libvchan *ctrl, const struct iovec *msgs, int count);
+/**
+ * Zero-copy send, step one: reserve space in the write ring. The reserved
+ * region is described by two spans pointing into the shared ring; span2 is
+ * empty unless the region wraps around the end of the ring. Fill them in
+ * place and publish with libvchan_write_commit(). Only one reservation may
+ * be outstanding at a time.
+ * @param ctrl The vchan control structure
+ * @param size Amount of space to reserve
+ * @param span1 First part of the reserved region
+ * @param span2 Second part of the reserved region (may have zero length)
+ * @return -1 on error, 0 if nonblocking and insufficient space is available, or $size
+ */
+int libvchan_write_reserve(struct libvchan *ctrl, size_t size,
+                           struct iovec *span1, struct iovec *span2);
+/**
+ * Zero-copy send, step two: publish the first $size bytes of the current
+ * reservation to the peer, and release the rest of it. If $size is larger
+ * than the reservation nothing is published, but the reservation is still
+ * released.
+ * @param ctrl The vchan control structure
+ * @param size Amount of data written into the reserved spans
+ * @return -1 on error (including $size larger than the reservation), or $size
+ */
+int libvchan_write_commit(struct libvchan *ctrl, size_t size);
+/**
+ * Zero-copy receive, step one: describe the data ready in the read ring.
+ * iov[0] and iov[1] are set to point directly into the shared ring; iov[1]
+ * is empty unless the data wraps around the end of the ring. The data stays
+ * in the ring until it is released with libvchan_read_release().
+ * @param ctrl The vchan control structure
+ * @param iov Array of two iovecs describing the data
+ * @param max Maximum amount of data to describe
+ * @return -1 on error, otherwise the amount of data described (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libvchan_read_peek(struct libvchan *ctrl, struct iovec *iov, size_t max);
+/**
+ * Zero-copy receive, step two: consume $size bytes from the read ring,
+ * making the space available to the peer again.
+ * @param ctrl The vchan control structure
+ * @param size Amount of data consumed
+ * @return -1 on error (including $size larger than the data ready), or $size
+ */
+int libvchan_read_release(struct libvchan *ctrl, size_t size);
+/**
+ * Send data from a file descriptor, which is read straight into the free
+ * space of the write ring, with no copy through a user buffer. Like read(2),
+ * this may move less than $len bytes; a blocking vchan waits for some space.
+ * @param ctrl The vchan control structure
+ * @param fd File descriptor to read from
+ * @param offset If not NULL, offset to pread from, advanced by the bytes read
+ * @param len Maximum amount of data to move
+ * @return -1 on error (with errno set if it came from $fd), or with errno
+ *         EAGAIN if nonblocking and the ring is full; 0 at end of file, or
+ *         the amount of data sent
+ */
+int libvchan_splice_from_fd(struct libvchan *ctrl, int fd, off_t *offset, size_t len);
+/**
+ * Receive data into a file descriptor, which is written straight from the
+ * read ring, with no copy through a user buffer. Like write(2), this may
+ * move less than $len bytes; a blocking vchan waits for some data.
+ * @param ctrl The vchan control structure
+ * @param fd File descriptor to write to
+ * @param offset If not NULL, offset to pwrite at, advanced by the bytes written
+ * @param len Maximum amount of data to move
+ * @return -1 on error (with errno set if it came from $fd), 0 if nonblocking
+ *         and no data is available, or the amount of data received
+ */
+int libvchan_splice_to_fd(struct libvchan *ctrl, int fd, off_t *offset, size_t len);
+
+/**
+ * Disk sink: writes received data to a file opened with O_DIRECT through
+ * io_uring, straight from the read ring, keeping several writes in flight.
+ * Received data stays in the ring until the writes covering it complete.
+ */
+struct libvchan_sink;
+
+/**
+ * Set up a disk sink on the receiving side of a vchan, which must have a
+ * read ring of at least 4096 bytes, no threaded mode and no poller. The
+ * vchan is switched to blocking mode.
+ * @param depth Writes that may be in flight at once
+ * @param chunk Largest write, a multiple of 4096 bytes
+ * @return The sink, or NULL with errno set (ENOSYS without io_uring support)
+ */
+struct libvchan_sink *libvchan_sink_create(struct libvchan *ctrl, unsigned int depth, size_t chunk);
+void libvchan_sink_destroy(struct libvchan_sink *sink);
+/**
+ * Sending side of a disk sink: pad the stream with zeros up to the next
+ * 4096-byte ring offset. Call it before and after sending each file's data.
+ * @return -1 on error, or 0
+ */
+int libvchan_sink_pad(struct libvchan *ctrl);
+/**
+ * Receive $len bytes sent between two libvchan_sink_pad() calls and write
+ * them to fd at offset, which must be 4096-aligned. The last block is
+ * written whole, with its padding, and the file then truncated to
+ * offset + $len, so unaligned lengths are for writing the end of a file.
+ * @return $len, or -1 with errno set
+ */
+ssize_t libvchan_sink_write(struct libvchan_sink *sink, int fd, off_t offset, size_t len);
+/**
+ * Publish our read and write indexes to the peer now, notifying it if it
+ * is waiting, and send any notify held back by a watermark or moderation.
+ * Only needed when a publish threshold, watermark or moderation window is
+ * in use and the caller is about to sleep outside the library; the library
+ * flushes by itself before it blocks or reports that it would block.
+ * @return -1 on error, 0 on success
+ */
+int libvchan_flush(struct libvchan *ctrl);
+/**
+ * Let our own consumer (read) and producer (write) indexes run ahead of the
+ * copies in the shared page, publishing them only after the given number of
+ * bytes have been moved or at a flush point. This saves cross-domain cache
+ * line traffic and notifies on streams of small operations, at the cost of
+ * latency. Both default to 0, publishing after every operation. Ignored in
+ * threaded modes.
+ */
+void libvchan_set_publish_threshold(struct libvchan *ctrl, size_t read_bytes, size_t write_bytes);
+/**
+ * Set how much a blocked streaming call waits for before the peer wakes
+ * it. Calls that need a whole size (libvchan_recv(), libvchan_send() and
+ * the like) always ask to be woken once that size is there; libvchan_read(),
+ * libvchan_write(), libvchan_read_peek() and the splices can use any part
+ * of it, but only ask to be woken once $read_bytes are ready or $write_bytes
+ * are free, or the rest of their request if less. The peer holds back the
+ * notifies before that, sending them anyway when it flushes or is about to
+ * block, so a stream that stops short of a watermark still gets through;
+ * a caller that sleeps outside the library must libvchan_flush() first.
+ * Watermarks live in the v2 shared page; with a v1 page, or in threaded
+ * modes, every move notifies as before.
+ * @param ctrl The vchan control structure
+ * @param read_bytes Data to wait for when reading; 0 for any (default)
+ * @param write_bytes Space to wait for when writing; 0 for any (default)
+ */
+void libvchan_set_watermarks(struct libvchan *ctrl, size_t read_bytes, size_t write_bytes);
+/**
+ * Notify the peer at most once every $usec microseconds. A notify that
+ * falls within the window is held back until the next index update after
+ * it, or until we flush or block, so under load the peer takes one wakeup
+ * per window instead of one per operation. Not used in threaded modes.
+ * @param ctrl The vchan control structure
+ * @param usec Moderation window; 0 notifies as soon as the peer asked (default)
+ */
+void libvchan_set_notify_moderation(struct libvchan *ctrl, unsigned int usec);
+/**
+ * Flushes, then waits for reads or writes to unblock, or for a close. Not
+ * for use in VCHAN_THREAD_DUPLEX or VCHAN_THREAD_SHARED mode, where the
+ * event channel is shared by the waiting threads; blocking calls wait by
+ * themselves.
  */
 int libvchan_wait(struct libvchan *ctrl);
+/**
+ * Allow concurrent use of a vchan. In VCHAN_THREAD_DUPLEX mode one thread
+ * may read while another writes; blocking calls wait on a queue for their
+ * own direction instead of on the event channel, so neither thread steals
+ * the other's wakeups. VCHAN_THREAD_SHARED also serializes the calls of each
+ * direction with a mutex, so several threads may read or write; a mutex is
+ * held from libvchan_write_reserve() to libvchan_write_commit(), and from
+ * libvchan_read_peek() to libvchan_read_release().
+ * Publish thresholds are dropped when a threaded mode is set, and
+ * libvchan_set_publish_threshold() is ignored in these modes, so every
+ * operation publishes its index at once.
+ * VCHAN_THREAD_MPSC is for many writing threads and one reading thread.
+ * Writers claim ring space with a compare-and-swap on a shadow of the
+ * producer index, copy in parallel and publish in claim order; only the
+ * last writer of a burst notifies. Each libvchan_write() is then all or
+ * nothing, like libvchan_send(), and libvchan_write_reserve() fails.
+ * Must be called before the threads start using the vchan.
+ * @param mode VCHAN_THREAD_NONE, VCHAN_THREAD_DUPLEX, VCHAN_THREAD_SHARED
+ *             or VCHAN_THREAD_MPSC
+ * @return -1 on error, 0 on success
+ */
+int libvchan_set_threaded(struct libvchan *ctrl, int mode);
+/**
+ * Set the wait policy used by libvchan_wait(), and so by all blocking calls.
+ * Before blocking on the event channel, the peer's indexes are polled for up
+ * to $max_ns. In adaptive mode the actual budget follows the observed time
+ * the peer takes to wake us, shrinking when spinning does not pay off.
+ * @param ctrl The vchan control structure
+ * @param max_ns Longest time to spin, in nanoseconds; 0 always blocks (default)
+ * @param adaptive Nonzero to tune the budget from observed wake-up gaps
+ */
+void libvchan_set_spin(struct libvchan *ctrl, unsigned int max_ns, int adaptive);
+/**
+ * Choose the copy engine used to move data into and out of the rings.
+ * Sends of at least $nt_threshold bytes use non-temporal stores, so that the
+ * data does not displace our own working set on its way to the peer.
+ * VCHAN_COPY_AUTO, the default, picks the widest engine the CPU supports for
+ * those and leaves smaller copies to memcpy().
+ * @param engine One of the VCHAN_COPY_* values
+ * @param nt_threshold Smallest send to copy non-temporally; 0 for the default
+ * @return -1 if the engine is not supported on this CPU, 0 on success
+ */
+int libvchan_set_copy(struct libvchan *ctrl, int engine, size_t nt_threshold);
+/**
+ * Fill in a copy engine description, as libvchan_set_copy() does.
+ * @return -1 if the engine is not supported on this CPU, 0 on success
+ */
+int libvchan_copy_init(struct libvchan_copy *copy, int engine, size_t nt_threshold);
+/**
+ * Look up a single copy kernel, for benchmarking.
+ * @return The kernel, or NULL if the engine is not supported on this CPU
+ */
+libvchan_copy_fn libvchan_copy_kernel(int engine, int nontemporal);
+/** Name of a copy engine, or NULL if it is not supported on this CPU */
+const char *libvchan_copy_name(int engine);
+/**
+ * Look up a copy-and-checksum kernel, for benchmarking.
+ * @param engine VCHAN_CRC_TABLE or VCHAN_CRC_SSE42
+ * @return The kernel, or NULL if it is not supported on this CPU
+ */
+libvchan_crc_fn libvchan_crc_kernel(int engine);
 /**
  * Returns the event file descriptor for this vchan. When this FD is readable,
  * libvchan_wait() will not block, and the state of the vchan has changed since
@@ -203,7 +840,360 @@ int libvchan_fd_for_select(struct libvchan *ctrl);
  *  return 2 [server only] when no client has yet connected
  */
 int libvchan_is_open(struct libvchan* ctrl);
-/** Amount of data ready to read, in bytes */
+/**
+ * Amount of data ready to read, in bytes. Since the value is used outside
+ * the library, the peer is asked to notify us when it writes more.
+ */
 int libvchan_data_ready(struct libvchan *ctrl);
-/** Amount of data it is possible to send without blocking */
+/**
+ * Amount of data it is possible to send without blocking. Since the value is
+ * used outside the library, the peer is asked to notify us when it reads.
+ */
 int libvchan_buffer_space(struct libvchan *ctrl);
+/**
+ * Copy out the event channel counters accumulated since initialization.
+ */
+void libvchan_get_stats(struct libvchan *ctrl, struct libvchan_stats *stats);
+
+/**
+ * Register a region of memory that the peer can map and then read or write
+ * directly with libvchan_region_get() and libvchan_region_put(), so that bulk
+ * data is copied once instead of through the ring. The memory is allocated
+ * by the library, as gntalloc can only grant pages it owns.
+ * @param size Size of the region in bytes, at most 64 MiB
+ * @param backend VCHAN_REGION_XEN, or VCHAN_REGION_LOCAL if allowed with
+ *                libvchan_region_allow_local()
+ * @return The region, or NULL in case of an error
+ */
+struct libvchan_region *libvchan_region_alloc(struct libvchan *ctrl, size_t size, int backend);
+/**
+ * Allow VCHAN_REGION_LOCAL regions on this vchan, for tests where both ends
+ * run in the same host. A local descriptor names a pid and fd that the
+ * mapping side opens through /proc, so the peer could point it at any file
+ * this process can open; they are refused unless this is set. Off by default.
+ */
+void libvchan_region_allow_local(struct libvchan *ctrl, int allow);
+/**
+ * Free a region returned by libvchan_region_alloc(). Pages the peer still
+ * maps stay allocated until it unmaps them.
+ */
+void libvchan_region_free(struct libvchan_region *region);
+/**
+ * Send the descriptor of a local region to the peer, as a single message.
+ * returns -1 on error, 0 if there is no buffer space, or the descriptor size
+ */
+int libvchan_region_send(struct libvchan *ctrl, struct libvchan_region *region);
+/**
+ * Receive a descriptor sent by libvchan_region_send() and map the region.
+ * @return The region, or NULL on error or if no descriptor is available
+ */
+struct libvchan_region *libvchan_region_recv(struct libvchan *ctrl);
+/**
+ * Map the peer region described by desc. Regions stay mapped after
+ * libvchan_region_unmap(), so mapping the same region again is cheap;
+ * up to VCHAN_REGION_CACHE unused regions are kept.
+ * @return The region, or NULL in case of an error
+ */
+struct libvchan_region *libvchan_region_map(struct libvchan *ctrl, const struct libvchan_region_desc *desc);
+/** Release a region returned by libvchan_region_map() or libvchan_region_recv() */
+void libvchan_region_unmap(struct libvchan *ctrl, struct libvchan_region *region);
+/** Unmap all cached peer regions that are not in use */
+void libvchan_region_cache_flush(struct libvchan *ctrl);
+/**
+ * Copy size bytes from data to offset in the region, with the copy kernels of
+ * ctrl. The stores are visible to the peer before any later vchan message, so
+ * a message sent afterwards can announce the data.
+ * returns -1 if the range is outside the region, or size
+ */
+int libvchan_region_put(struct libvchan *ctrl, struct libvchan_region *region,
+                        size_t offset, const void *data, size_t size);
+/**
+ * Copy size bytes from offset in the region to data.
+ * returns -1 if the range is outside the region, or size
+ */
+int libvchan_region_get(struct libvchan *ctrl, struct libvchan_region *region,
+                        size_t offset, void *data, size_t size);
+
+/* most ring pairs a multi-queue vchan can negotiate */
+#define VCHAN_MQ_MAX 64
+
+/**
+ * A multi-queue vchan: independent ring pairs, each with its own shared page
+ * and event channel, under one device number. Each queue is a struct libvchan
+ * of its own, so threads that use different queues share no state.
+ */
+struct libvchan_mq {
+   int nqueues;
+   struct libvchan *queue[];
+};
+
+/**
+ * Set up a multi-queue vchan of nqueues ring pairs, each sized as by
+ * libvchan_server_init(). The queues are advertised in xenstore under
+ * data/vchan/<devno>/queue-<n>, and data/vchan/<devno>/queues is written
+ * last, once all of them are ready.
+ * @param nqueues Number of ring pairs, 1 to VCHAN_MQ_MAX
+ * @return The structure, or NULL in case of an error
+ */
+struct libvchan_mq *libvchan_mq_server_init(int domain, int devno, int nqueues,
+                                            size_t read_min, size_t write_min);
+/**
+ * Connect to all the queues of a multi-queue vchan.
+ * @return The structure, or NULL in case of an error
+ */
+struct libvchan_mq *libvchan_mq_client_init(int domain, int devno);
+/** Close all the queues of a multi-queue vchan, and free it */
+void libvchan_mq_close(struct libvchan_mq *mq);
+/** The queue with the given index, or NULL if there is no such queue */
+struct libvchan *libvchan_mq_queue(struct libvchan_mq *mq, int index);
+/**
+ * The queue for a flow, found by hashing key, so that all the messages of
+ * a flow take the same queue and stay in order.
+ */
+struct libvchan *libvchan_mq_pick(struct libvchan_mq *mq, uint64_t key);
+
+/**
+ * Create an event multiplexer, with its own event channel fd.
+ * @return The poller, or NULL in case of an error
+ */
+struct libvchan_poller *libvchan_poller_create(void);
+/** Free a poller; all the vchans created on it must be closed first */
+void libvchan_poller_destroy(struct libvchan_poller *poller);
+/**
+ * The event channel fd of the poller, which can be registered with epoll;
+ * it is readable when libvchan_poller_wait() will not block.
+ */
+int libvchan_poller_fd(struct libvchan_poller *poller);
+/**
+ * Set up a vchan as libvchan_server_init() does, with its event channel
+ * port bound on the fd of poller. Such vchans are driven by the poller:
+ * they must be used nonblocking, and libvchan_wait() fails on them.
+ * @return The structure, or NULL in case of an error
+ */
+struct libvchan *libvchan_server_init_poller(struct libvchan_poller *poller, int domain, int devno,
+                                             size_t read_min, size_t write_min);
+/**
+ * Connect to a vchan as libvchan_client_init() does, with its event channel
+ * port bound on the fd of poller.
+ * @return The structure, or NULL in case of an error
+ */
+struct libvchan *libvchan_client_init_poller(struct libvchan_poller *poller, int domain, int devno);
+/**
+ * Wait for vchans of the poller to become ready. Readiness is edge
+ * triggered: a vchan is reported after its peer notifies it, so callers
+ * should read and write until the calls would block before waiting again,
+ * and try new vchans once before their first wait. Ports that fire are read
+ * from the event channel in batches, and only their vchans are examined.
+ * @param events Filled with up to max ready vchans
+ * @param timeout_ms As for poll(): -1 waits forever, 0 does not wait
+ * @return The number of ready vchans, 0 on timeout, or -1 on error
+ */
+int libvchan_poller_wait(struct libvchan_poller *poller, struct libvchan_event *events,
+                         int max, int timeout_ms);
+
+/**
+ * Create a context. Its gntalloc, gntdev and xenstore handles are opened
+ * the first time a vchan needs them, and kept until the context is
+ * destroyed. A vchan has to block on its own event channel fd, so only the
+ * vchans of a context with a poller share one.
+ * @param poller Poller on which the vchans of the context are set up, or NULL
+ * @return The context, or NULL in case of an error
+ */
+struct libvchan_context *libvchan_context_create(struct libvchan_poller *poller);
+/** Free a context; all the vchans set up through it must be closed first */
+void libvchan_context_destroy(struct libvchan_context *ctx);
+/**
+ * Set up a vchan as libvchan_server_init() does, with the handles of ctx.
+ * @return The structure, or NULL in case of an error
+ */
+struct libvchan *libvchan_server_init_ctx(struct libvchan_context *ctx, int domain, int devno,
+                                          size_t read_min, size_t write_min);
+/**
+ * Connect to a vchan as libvchan_client_init() does, with the handles of ctx.
+ * @return The structure, or NULL in case of an error
+ */
+struct libvchan *libvchan_client_init_ctx(struct libvchan_context *ctx, int domain, int devno);
+
+/**
+ * Create a submission/completion queue.
+ * @param entries Operations that can be outstanding (submitted and not yet
+ *        reaped) at once, rounded up to a power of two
+ * @return The queue, or NULL in case of an error
+ */
+struct libvchan_aio *libvchan_aio_create(unsigned int entries);
+/** Free a queue; its pending operations are dropped without completions */
+void libvchan_aio_destroy(struct libvchan_aio *aio);
+/**
+ * An fd, for poll() or epoll, that is readable when libvchan_aio_reap()
+ * has completions to return or event channels to handle.
+ */
+int libvchan_aio_fd(struct libvchan_aio *aio);
+/**
+ * Queue operations. Those on the same vchan and direction complete in
+ * order; each is started at once if it is first in line, and retried as
+ * its vchan's event channel fires. A vchan used here is switched to
+ * nonblocking mode, and cannot have been set up on a poller. Closing it
+ * completes its pending operations with -1.
+ * @return The number of operations queued, fewer if the queue is full or
+ *         an entry is invalid, or -1 if none could be queued
+ */
+int libvchan_aio_submit(struct libvchan_aio *aio, const struct libvchan_sqe *sqes, int count);
+/**
+ * Handle event channels that fired, and return completed operations.
+ * @param cqes Filled with up to max completions
+ * @param timeout_ms As for poll(); -1 waits until something completes
+ * @return The number of completions, 0 if none yet, or -1 on error
+ */
+int libvchan_aio_reap(struct libvchan_aio *aio, struct libvchan_cqe *cqes, int max, int timeout_ms);
+
+/**
+ * Send a framed message: a 32-bit length header followed by the data, so
+ * that the receiver does not need to know the size in advance. A message
+ * that fits in the ring with its header is sent whole or not at all, like
+ * libvchan_send(). A bigger one is streamed through the ring as the peer
+ * drains it, which needs a blocking vchan and cannot be used in
+ * VCHAN_THREAD_MPSC mode.
+ * @param size At least 1 byte, at most INT_MAX - 4
+ * @return 0 if there is no buffer space, -1 on error, or size on success
+ */
+int libvchan_msg_send(struct libvchan *ctrl, const void *data, size_t size);
+/** libvchan_msg_send() of the concatenation of up to 64 iovecs */
+int libvchan_msg_sendv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Turn integrity trailers of framed messages on or off; both ends must
+ * agree. With them, each message is followed by a CRC32C of its header and
+ * data, computed in the same pass that copies it into the ring, and checked
+ * in the pass that copies it out; a mismatch fails the receive with errno
+ * EBADMSG. Not available in VCHAN_THREAD_MPSC mode.
+ * @return -1 if a message is partly received or the mode is MPSC, or 0
+ */
+int libvchan_set_integrity(struct libvchan *ctrl, int on);
+/**
+ * The size of the next framed message, waiting for its header on a
+ * blocking vchan. The message stays in the ring.
+ * @return 0 if there is no message yet, -1 on error, or the size
+ */
+int libvchan_msg_next(struct libvchan *ctrl);
+/**
+ * Receive the next framed message into data. If it is bigger than size,
+ * fails with errno EMSGSIZE and leaves it for a bigger buffer. On a
+ * nonblocking vchan, a message may arrive over several calls, which must
+ * all be passed the same buffer. Framed messages are read by one thread.
+ * @return 0 if the message is not complete yet, -1 on error, or its size
+ */
+int libvchan_msg_recv(struct libvchan *ctrl, void *data, size_t size);
+/**
+ * Receive the next framed message, of any size, into a buffer owned by the
+ * vchan, which stays valid until the next receive or libvchan_close().
+ * @param data Set to the message
+ * @return 0 if the message is not complete yet, -1 on error, or its size
+ */
+int libvchan_msg_recv_pooled(struct libvchan *ctrl, void **data);
+
+/**
+ * Completion of an RPC call: the server's status and reply. The reply is
+ * only valid until the callback returns or calls into the RPC channel.
+ */
+typedef void (*libvchan_rpc_cb)(void *arg, int status, const void *reply, size_t size);
+/**
+ * Pipelined RPC channel over a vchan, built on framed messages: requests
+ * carry call ids, several are outstanding at once, and replies are
+ * matched to their calls in any order.
+ */
+struct libvchan_rpc;
+
+/**
+ * Set up RPC on a vchan, which is switched to blocking mode. Calls are made
+ * on one side, and served with libvchan_rpc_recv() and libvchan_rpc_reply()
+ * on the other. The ring carrying replies should hold a window of them.
+ * @param window Calls that may be outstanding at once, at most 65536
+ * @return The RPC channel, or NULL in case of an error
+ */
+struct libvchan_rpc *libvchan_rpc_create(struct libvchan *ctrl, unsigned int window);
+/** Free an RPC channel; callbacks of outstanding calls are never run */
+void libvchan_rpc_destroy(struct libvchan_rpc *rpc);
+/**
+ * Send a request of up to 63 iovecs without waiting for its reply, which
+ * is passed to cb by a later libvchan_rpc_call(), libvchan_rpc_poll() or
+ * libvchan_rpc_wait_all(). Waits for a reply first if the window is full.
+ * @return The call id, which is never negative, or -1 on error
+ */
+int libvchan_rpc_call(struct libvchan_rpc *rpc, const struct iovec *iov, int iovcnt,
+                      libvchan_rpc_cb cb, void *arg);
+/**
+ * Run the callbacks of the replies that have arrived.
+ * @param wait If set and calls are outstanding, wait for at least one reply
+ * @return The number of callbacks run, or -1 on error
+ */
+int libvchan_rpc_poll(struct libvchan_rpc *rpc, int wait);
+/** Wait for the replies of all outstanding calls; returns -1 on error, or 0 */
+int libvchan_rpc_wait_all(struct libvchan_rpc *rpc);
+/**
+ * Server side: wait for the next request. Its data stays valid until the
+ * next libvchan_rpc_recv(); replies may be sent in any order.
+ * @param id Set to the call id, for libvchan_rpc_reply()
+ * @param data Set to the request
+ * @return The size of the request, or -1 on error
+ */
+int libvchan_rpc_recv(struct libvchan_rpc *rpc, uint32_t *id, void **data);
+/** Server side: send the status and reply of call id; returns -1 on error, or 0 */
+int libvchan_rpc_reply(struct libvchan_rpc *rpc, uint32_t id, int status,
+                       const struct iovec *iov, int iovcnt);
+
+/**
+ * Client of remote file I/O over a vchan, served by libvchan_fio_serve().
+ * Writes are pipelined: they return once sent, and the server acknowledges
+ * them cumulatively. Errors of writes and fsyncs are sticky: once one has
+ * failed, the later writes, fsyncs and closes fail with its errno.
+ */
+struct libvchan_fio;
+
+/**
+ * Set up a file I/O client on a vchan, which is switched to blocking mode.
+ * @param window Bytes of writes that may be unacknowledged at once; with
+ *               0, each write waits for the one before to be acknowledged
+ * @return The client, or NULL in case of an error
+ */
+struct libvchan_fio *libvchan_fio_create(struct libvchan *ctrl, size_t window);
+void libvchan_fio_destroy(struct libvchan_fio *fio);
+/**
+ * Open a file relative to the server's directory, as openat(2) does.
+ * @return The server's file descriptor, or -1 with errno set
+ */
+int libvchan_fio_open(struct libvchan_fio *fio, const char *path, int flags, mode_t mode);
+/**
+ * Send a pwrite(2) without waiting for it to run, unless the window of
+ * unacknowledged writes is full.
+ * @return len, or -1 with errno set
+ */
+ssize_t libvchan_fio_pwrite(struct libvchan_fio *fio, int fd, const void *buf, size_t len, off_t offset);
+/** Run a pread(2) on the server, after the requests sent before */
+ssize_t libvchan_fio_pread(struct libvchan_fio *fio, int fd, void *buf, size_t len, off_t offset);
+/**
+ * Send an fsync(2) of the writes sent so far, without waiting for it.
+ * Writes sent after it go on while it runs.
+ * @return A ticket for libvchan_fio_wait(), or -1 with errno set
+ */
+int64_t libvchan_fio_fsync(struct libvchan_fio *fio, int fd);
+/** Wait for the fsync of a ticket and those before; returns -1 on error, or 0 */
+int libvchan_fio_wait(struct libvchan_fio *fio, int64_t ticket);
+/** Close a file after its writes have run; returns -1 on error, or 0 */
+int libvchan_fio_close(struct libvchan_fio *fio, int fd);
+/**
+ * Server side: run the file I/O requests of a client until it closes the
+ * vchan, which is switched to VCHAN_THREAD_SHARED mode for a thread that
+ * runs the fsyncs. Requests may only use the descriptors the client opened
+ * in this session, and fail with EBADF on any other; those still open when
+ * the session ends are closed.
+ * @param dirfd Directory the client's paths are relative to; paths that
+ *              are absolute, contain ".." or go through a symbolic link
+ *              are refused
+ * @return 0 once the client has closed, or -1 on error
+ */
+int libvchan_fio_serve(struct libvchan *ctrl, int dirfd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,310 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  C++20 coroutine awaitables for vchans. A channel owns a vchan and
+ *  registers its event channel fd with a reactor; co_await ch.read(buf),
+ *  ch.write(buf) and ch.recv_exact(buf) first try the nonblocking call,
+ *  and if it would block, park the coroutine on the channel until the
+ *  reactor sees the event channel fire and the call can make progress.
+ *  The awaiters live in the coroutine frame, so awaiting does not allocate.
+ *
+ *  At most one read-side and one write-side await may be outstanding per
+ *  channel at a time. A channel must not be destroyed while awaited.
+ */
+
+#ifndef LIBVCHAN_CORO_HPP
+#define LIBVCHAN_CORO_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "libvchan.h"
+
+namespace vchan {
+
+class channel;
+
+namespace detail {
+
+/**
+ * An operation parked on a channel. attempt() is retried by the reactor
+ * each time the event channel fires, and returns true once the operation
+ * is done and the coroutine can be resumed. ch follows the channel when it
+ * is moved while the operation is parked.
+ */
+struct pending {
+   virtual bool attempt() = 0;
+   std::coroutine_handle<> handle;
+   channel *ch;
+protected:
+   ~pending() = default;
+};
+
+} // namespace detail
+
+/**
+ * Event loop for channels: an epoll fd with the event channel fd of every
+ * channel registered on it.
+ */
+class reactor {
+public:
+   reactor()
+      : epfd_(epoll_create1(EPOLL_CLOEXEC))
+   {
+      if (epfd_ < 0)
+         throw std::system_error(errno, std::generic_category(), "epoll_create1");
+   }
+   ~reactor() { close(epfd_); }
+   reactor(const reactor &) = delete;
+   reactor &operator=(const reactor &) = delete;
+
+   /** The epoll fd, readable when run_once() has events to handle */
+   int fd() const { return epfd_; }
+
+   /**
+    * Handle the events that fired and resume the coroutines whose operations
+    * completed.
+    * @param timeout_ms As for epoll_wait()
+    * @return The number of coroutines resumed, or -1 on error
+    */
+   inline int run_once(int timeout_ms = -1);
+
+   /** Run until no coroutine is parked on any channel */
+   void run()
+   {
+      while (parked_ > 0)
+         if (run_once() < 0 && errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "epoll_wait");
+   }
+
+private:
+   friend class channel;
+   // events, and so coroutines resumed, per epoll_wait()
+   static constexpr int batch = 64;
+
+   int epfd_;
+   int parked_ = 0;
+};
+
+/**
+ * Move-only owner of a vchan driven by a reactor. The vchan is switched to
+ * nonblocking mode, and closed with libvchan_close() on destruction. Vchans
+ * set up on a libvchan_poller share their event fd and cannot be used.
+ */
+class channel {
+   template <typename Op>
+   struct awaiter : detail::pending {
+      Op op;
+      int result = 0;
+
+      awaiter(channel *c, Op o) : op(std::move(o)) { ch = c; }
+      bool attempt() override { return op(ch->ctrl_, result); }
+      bool await_ready() { return attempt(); }
+      void await_suspend(std::coroutine_handle<> h)
+      {
+         handle = h;
+         ch->park(this, Op::dir);
+      }
+      int await_resume() { return result; }
+   };
+
+   enum { dir_read, dir_write };
+
+   // libvchan_read(): whatever is ready, up to the size of buf
+   struct read_op {
+      static constexpr int dir = dir_read;
+      std::span<std::byte> buf;
+      bool operator()(struct libvchan *ctrl, int &result)
+      {
+         result = buf.empty() ? 0 : libvchan_read(ctrl, buf.data(), buf.size());
+         return result != 0 || buf.empty();
+      }
+   };
+
+   // libvchan_read() or libvchan_write() until all of buf has moved
+   template <typename Span, int Dir>
+   struct exact_op {
+      static constexpr int dir = Dir;
+      Span buf;
+      size_t done = 0;
+      bool operator()(struct libvchan *ctrl, int &result)
+      {
+         int rv;
+         while (done < buf.size()) {
+            if constexpr (Dir == dir_read)
+               rv = libvchan_read(ctrl, buf.data() + done, buf.size() - done);
+            else
+               rv = libvchan_write(ctrl, buf.data() + done, buf.size() - done);
+            if (rv < 0) {
+               result = -1;
+               return true;
+            }
+            if (rv == 0)
+               return false;
+            done += rv;
+         }
+         result = done;
+         return true;
+      }
+   };
+
+public:
+   channel(reactor &r, struct libvchan *ctrl)
+      : reactor_(&r), ctrl_(ctrl)
+   {
+      struct epoll_event ev;
+      if (!ctrl_ || ctrl_->poller)
+         throw std::system_error(EINVAL, std::generic_category(), "libvchan::channel");
+      ctrl_->blocking = 0;
+      ev.events = EPOLLIN;
+      ev.data.ptr = this;
+      if (epoll_ctl(r.epfd_, EPOLL_CTL_ADD, libvchan_fd_for_select(ctrl_), &ev))
+         throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+   }
+   ~channel() { reset(); }
+
+   channel(const channel &) = delete;
+   channel &operator=(const channel &) = delete;
+   channel(channel &&other) noexcept { take(other); }
+   channel &operator=(channel &&other) noexcept
+   {
+      if (this != &other) {
+         reset();
+         take(other);
+      }
+      return *this;
+   }
+
+   struct libvchan *get() const { return ctrl_; }
+   explicit operator bool() const { return ctrl_ != nullptr; }
+
+   /**
+    * co_await: read whatever data is ready, up to buf.size() bytes.
+    * Yields the bytes read, or -1 on error or close.
+    */
+   awaiter<read_op> read(std::span<std::byte> buf)
+   {
+      return awaiter<read_op>(this, read_op{buf});
+   }
+   /**
+    * co_await: write all of buf, as ring space appears.
+    * Yields buf.size(), or -1 on error or close.
+    */
+   awaiter<exact_op<std::span<const std::byte>, dir_write>> write(std::span<const std::byte> buf)
+   {
+      return { this, { buf } };
+   }
+   /**
+    * co_await: read exactly buf.size() bytes, which may be more than the
+    * ring holds. Yields buf.size(), or -1 on error or close.
+    */
+   awaiter<exact_op<std::span<std::byte>, dir_read>> recv_exact(std::span<std::byte> buf)
+   {
+      return { this, { buf } };
+   }
+
+private:
+   friend class reactor;
+
+   void park(detail::pending *p, int dir)
+   {
+      parked_[dir] = p;
+      reactor_->parked_++;
+   }
+
+   /**
+    * Consume the event and retry the parked operations; those that complete
+    * are unparked and their handles stored in out.
+    */
+   int on_event(std::coroutine_handle<> *out)
+   {
+      int n = 0;
+      libvchan_wait(ctrl_);
+      for (auto &p : parked_) {
+         if (p && p->attempt()) {
+            out[n++] = p->handle;
+            p = nullptr;
+            reactor_->parked_--;
+         }
+      }
+      return n;
+   }
+
+   void take(channel &other)
+   {
+      reactor_ = other.reactor_;
+      ctrl_ = std::exchange(other.ctrl_, nullptr);
+      for (int dir : { dir_read, dir_write }) {
+         parked_[dir] = std::exchange(other.parked_[dir], nullptr);
+         if (parked_[dir])
+            parked_[dir]->ch = this;
+      }
+      if (ctrl_) {
+         struct epoll_event ev;
+         ev.events = EPOLLIN;
+         ev.data.ptr = this;
+         epoll_ctl(reactor_->epfd_, EPOLL_CTL_MOD, libvchan_fd_for_select(ctrl_), &ev);
+      }
+   }
+
+   void reset()
+   {
+      if (!ctrl_)
+         return;
+      for (auto &p : parked_) {
+         if (p) {
+            p = nullptr;
+            reactor_->parked_--;
+         }
+      }
+      epoll_ctl(reactor_->epfd_, EPOLL_CTL_DEL, libvchan_fd_for_select(ctrl_), nullptr);
+      libvchan_close(std::exchange(ctrl_, nullptr));
+   }
+
+   reactor *reactor_ = nullptr;
+   struct libvchan *ctrl_ = nullptr;
+   detail::pending *parked_[2] = { nullptr, nullptr };
+};
+
+int reactor::run_once(int timeout_ms)
+{
+   struct epoll_event evs[batch];
+   std::coroutine_handle<> ready[2 * batch];
+   int n, i, nready = 0;
+
+   n = epoll_wait(epfd_, evs, batch, timeout_ms);
+   if (n < 0)
+      return -1;
+   // resumed coroutines may destroy channels, so touch them all first
+   for (i = 0; i < n; i++)
+      nready += static_cast<channel *>(evs[i].data.ptr)->on_event(ready + nready);
+   for (i = 0; i < nready; i++)
+      ready[i].resume();
+   return nready;
+}
+
+} // namespace vchan
+
+#endif
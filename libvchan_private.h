@@ -0,0 +1,72 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Helpers shared between the library's source files. Not installed.
+ */
+
+#ifndef LIBVCHAN_PRIVATE_H
+#define LIBVCHAN_PRIVATE_H
+
+#include <stdint.h>
+
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT 12
+#endif
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define GRANTS_PER_PAGE (PAGE_SIZE / sizeof(uint32_t))
+
+/**
+ * Grant npages pages to domid through the gntalloc device fd, and map them
+ * contiguously. The grant references are stored in refs.
+ * Returns the mapping, or NULL on error.
+ */
+void *vchan_gnt_alloc_pages(int fd, int domid, uint32_t *refs, int npages);
+/**
+ * Map the npages grants of domid in refs contiguously through the gntdev
+ * device fd. Returns the mapping, or NULL on error.
+ */
+void *vchan_gnt_map_pages(int fd, int domid, uint32_t *refs, int npages);
+
+/**
+ * iov_base of a 4-byte iovec ending a send: it is replaced by the CRC32C of
+ * the iovecs before it, computed as they are copied into the ring.
+ */
+#define VCHAN_CRC_TRAILER ((void *)-1)
+
+struct libvchan;
+/** Unmap every cached peer region, in use or not, when the vchan closes. */
+void vchan_region_cache_free(struct libvchan *ctrl);
+
+struct libvchan_poller;
+/**
+ * Route the events of ctrl->event_port, bound on the poller's fd, to ctrl.
+ * Returns -1 on error, having unbound the port, or 0.
+ */
+int vchan_poller_attach(struct libvchan_poller *poller, struct libvchan *ctrl);
+/** Unbind the port of ctrl from its poller. */
+void vchan_poller_detach(struct libvchan *ctrl);
+
+/** Fail the pending operations of ctrl and drop it from its aio queue. */
+void vchan_aio_detach(struct libvchan *ctrl);
+
+#endif
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <sys/time.h>
 
+#include "libvchan.h"
+
 inline double BW(unsigned long long bytes, long usec) {
     double bw;
     // uncomment below to measure in Mbit/s
@@ -12,52 +14,137 @@ inline double BW(unsigned long long bytes, long usec) {
 
 void usage(void)
 {
-    printf("./memcpy <blocksize> <total_size> <dst_buffer_size>\n");
+    printf("./memcpy [<blocksize> <total_size> <dst_buffer_size>]\n"
+           "without arguments, sweeps block and buffer sizes for every copy kernel\n");
     exit(1);
 }
 
-int main(int argc, char **argv)
+/**
+ * Copy total_size bytes from src into a dst ring of buffer_size bytes,
+ * blocksize at a time, the way do_send() fills a ring. Returns the BW in MB/s.
+ */
+double run(libvchan_copy_fn copy, char *dst, char *src, int blocksize,
+           unsigned long long total_size, unsigned long long buffer_size)
 {
-    char *buf1, *buf2;
-    
-    if (argc != 4) {
-        usage();
+    unsigned long long count = 0;
+    long t1, t2, t;
+    struct timeval tv1, tv2;
+
+    gettimeofday(&tv1, NULL);
+    while (count < total_size) {
+        int size = ((total_size - count) < blocksize) ? (total_size - count) : blocksize;
+        int dst_offset = (count % buffer_size) + size > buffer_size ? 0 : count % buffer_size;
+        copy(dst+dst_offset, src+count, size);
+        count += size;
     }
+    gettimeofday(&tv2, NULL);
+    t1 = tv1.tv_sec*1000000 + tv1.tv_usec;
+    t2 = tv2.tv_sec*1000000 + tv2.tv_usec;
+    t = (t2 - t1);
+    return BW(count, t ? t : 1);
+}
 
-    int blocksize = atoi(argv[1]);
-    unsigned long long total_size = atoll(argv[2]);
-    unsigned long long buffer_size = atoll(argv[3]);
+/**
+ * run() for a copy-and-checksum kernel.
+ */
+double run_crc(libvchan_crc_fn copy_crc, char *dst, char *src, int blocksize,
+               unsigned long long total_size, unsigned long long buffer_size)
+{
     unsigned long long count = 0;
     long t1, t2, t;
     struct timeval tv1, tv2;
+    uint32_t crc = ~0U;
 
-    if (buffer_size < blocksize) {
-        printf("buffer_size < blocksize\n");
-        usage();
+    gettimeofday(&tv1, NULL);
+    while (count < total_size) {
+        int size = ((total_size - count) < blocksize) ? (total_size - count) : blocksize;
+        int dst_offset = (count % buffer_size) + size > buffer_size ? 0 : count % buffer_size;
+        crc = copy_crc(dst+dst_offset, src+count, size, crc);
+        count += size;
     }
+    gettimeofday(&tv2, NULL);
+    t1 = tv1.tv_sec*1000000 + tv1.tv_usec;
+    t2 = tv2.tv_sec*1000000 + tv2.tv_usec;
+    t = (t2 - t1);
+    // keep the CRC live
+    if (crc == 0x12345678)
+        printf(" ");
+    return BW(count, t ? t : 1);
+}
+
+/**
+ * One line per block size, one column per available kernel, then the
+ * copy-and-checksum kernels used with integrity trailers.
+ */
+void compare(int *blocksizes, int nblocks, unsigned long long total_size,
+             unsigned long long buffer_size)
+{
+    char *buf1, *buf2;
+    int engine, nt, b;
 
     buf1 = (char*) malloc(buffer_size);
     buf2 = (char*) malloc(total_size);
-    int i;
-    //for (i=0; i<total_size; i++) buf2[i] = i % 10;
-
-    for(i=0; i<1; i++) {
-        count = 0;
-        gettimeofday(&tv1, NULL);
-        while (count < total_size) {
-            int size = ((total_size - count) < blocksize) ? (total_size - count) : blocksize;
-            int dst_offset = (count % buffer_size) + size > buffer_size ? 0 : count % buffer_size;
-            memcpy(buf1+dst_offset, buf2+count, size);
-            count += size;
+    if (!buf1 || !buf2) {
+        perror("malloc");
+        exit(1);
+    }
+    // touch everything first so page faults are not measured
+    memset(buf1, 0, buffer_size);
+    memset(buf2, 1, total_size);
+
+    printf("dst_buffer_size %llu, total_size %llu (MB/s)\n%10s", buffer_size, total_size, "blocksize");
+    for (engine = VCHAN_COPY_MEMCPY; engine <= VCHAN_COPY_AVX512; engine++)
+        for (nt = 0; nt < (engine == VCHAN_COPY_MEMCPY ? 1 : 2); nt++)
+            if (libvchan_copy_kernel(engine, nt))
+                printf(" %9s%3s", libvchan_copy_name(engine), nt ? "-nt" : "");
+    if (libvchan_crc_kernel(VCHAN_CRC_TABLE))
+        printf(" %12s", "crc-table");
+    if (libvchan_crc_kernel(VCHAN_CRC_SSE42))
+        printf(" %12s", "crc-sse4.2");
+    printf("\n");
+    for (b = 0; b < nblocks; b++) {
+        if (blocksizes[b] > buffer_size)
+            continue;
+        printf("%10d", blocksizes[b]);
+        for (engine = VCHAN_COPY_MEMCPY; engine <= VCHAN_COPY_AVX512; engine++)
+            for (nt = 0; nt < (engine == VCHAN_COPY_MEMCPY ? 1 : 2); nt++) {
+                libvchan_copy_fn copy = libvchan_copy_kernel(engine, nt);
+                if (copy)
+                    printf(" %12.1f", run(copy, buf1, buf2, blocksizes[b], total_size, buffer_size));
+            }
+        for (engine = VCHAN_CRC_TABLE; engine <= VCHAN_CRC_SSE42; engine++) {
+            libvchan_crc_fn copy_crc = libvchan_crc_kernel(engine);
+            if (copy_crc)
+                printf(" %12.1f", run_crc(copy_crc, buf1, buf2, blocksizes[b], total_size, buffer_size));
         }
-        gettimeofday(&tv2, NULL);
-        t1 = tv1.tv_sec*1000000 + tv1.tv_usec;
-        t2 = tv2.tv_sec*1000000 + tv2.tv_usec;
-        t = (t2 - t1);
-        printf("BW: %.3f MB/s (%llu bytes in %ld usec), Size: %.2fMB, time: %.3fsec\n", BW(count,t), count, t, ((double)count/(1024*1024)), ((double)t/1000000));
-        //if(i==1)printf("%.3f\n", BW(count, t));
+        printf("\n");
     }
     free(buf1);
     free(buf2);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4) {
+        int blocksize = atoi(argv[1]);
+        unsigned long long total_size = atoll(argv[2]);
+        unsigned long long buffer_size = atoll(argv[3]);
+
+        if (buffer_size < blocksize) {
+            printf("buffer_size < blocksize\n");
+            usage();
+        }
+        compare(&blocksize, 1, total_size, buffer_size);
+    } else if (argc == 1) {
+        int blocksizes[] = { 64, 512, 4096, 16384, 65536, 262144, 1048576 };
+        unsigned long long buffer_sizes[] = { 65536, 1048576, 16777216 };
+        int i;
+
+        for (i = 0; i < sizeof(buffer_sizes)/sizeof(buffer_sizes[0]); i++)
+            compare(blocksizes, sizeof(blocksizes)/sizeof(blocksizes[0]),
+                    256ULL * 1024 * 1024, buffer_sizes[i]);
+    } else {
+        usage();
+    }
     return 0;
 }
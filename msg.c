@@ -0,0 +1,177 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Framed messages. Each message is preceded in the ring by a 32-bit length
+ *  header, so receivers find its size without knowing it in advance. A
+ *  message that fits in the ring is sent with its header as one datagram;
+ *  a bigger one is streamed through the ring in as many pieces as it takes,
+ *  straight from the sender's buffer into the receiver's.
+ *
+ *  With integrity trailers on, a CRC32C of the header and data follows each
+ *  message. The ring copies compute it as they go, so checking a message
+ *  costs no pass over it besides the copy.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "libvchan.h"
+#include "libvchan_private.h"
+
+typedef uint32_t msg_header_t;
+typedef uint32_t msg_trailer_t;
+
+// iovecs of a message, plus one for the header and one for the trailer
+#define MSG_IOV_MAX 64
+
+int libvchan_set_integrity(struct libvchan *ctrl, int on)
+{
+   if (ctrl->msg_header || (on && ctrl->thread_mode == VCHAN_THREAD_MPSC))
+       return -1;
+   ctrl->integrity = !!on;
+   return 0;
+}
+
+int libvchan_msg_sendv(struct libvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+   struct iovec v[MSG_IOV_MAX + 2];
+   msg_header_t header;
+   size_t size = 0, trailer = 0;
+   int i, rv;
+
+   if (iovcnt < 0 || iovcnt > MSG_IOV_MAX)
+       return -1;
+   // producers copy concurrently, so none of them could keep a running CRC
+   if (ctrl->integrity && ctrl->thread_mode == VCHAN_THREAD_MPSC)
+       return -1;
+   for (i = 0; i < iovcnt; i++) {
+       size += iov[i].iov_len;
+       v[i + 1] = iov[i];
+   }
+   if (size == 0 || size > INT_MAX - sizeof(header) - sizeof(msg_trailer_t))
+       return -1;
+   header = size;
+   v[0].iov_base = &header;
+   v[0].iov_len = sizeof(header);
+   if (ctrl->integrity) {
+       trailer = sizeof(msg_trailer_t);
+       v[++iovcnt].iov_base = VCHAN_CRC_TRAILER;
+       v[iovcnt].iov_len = trailer;
+   }
+
+   if (size + sizeof(header) + trailer <= (size_t)1 << ctrl->write.order) {
+       rv = libvchan_sendv(ctrl, v, iovcnt + 1);
+       return rv > 0 ? (int)size : rv;
+   }
+   // the message goes through the ring in pieces, so the caller has to wait
+   if (!ctrl->blocking)
+       return -1;
+   rv = libvchan_writev(ctrl, v, iovcnt + 1);
+   return rv == (int)(size + sizeof(header) + trailer) ? (int)size : -1;
+}
+
+int libvchan_msg_send(struct libvchan *ctrl, const void *data, size_t size)
+{
+   struct iovec iov = { (void *)data, size };
+   return libvchan_msg_sendv(ctrl, &iov, 1);
+}
+
+/**
+ * Read the header of the next message, unless it has been read already.
+ * returns 0 if it is not there yet, -1 on error, or 1
+ */
+static int msg_header(struct libvchan *ctrl)
+{
+   msg_header_t header, scratch;
+   int rv;
+
+   if (ctrl->msg_header)
+       return 1;
+   rv = libvchan_recv(ctrl, &header, sizeof(header));
+   if (rv <= 0)
+       return rv;
+   if (header == 0 || header > INT_MAX - sizeof(header) - sizeof(msg_trailer_t))
+       return -1;
+   // the trailer covers the header too
+   if (ctrl->integrity)
+       ctrl->read.crc = ctrl->copy.copy_crc(&scratch, &header, sizeof(header), ~0U);
+   ctrl->msg_size = header;
+   ctrl->msg_got = 0;
+   ctrl->msg_header = 1;
+   return 1;
+}
+
+int libvchan_msg_next(struct libvchan *ctrl)
+{
+   int rv = msg_header(ctrl);
+   return rv <= 0 ? rv : (int)ctrl->msg_size;
+}
+
+int libvchan_msg_recv(struct libvchan *ctrl, void *data, size_t size)
+{
+   int rv = msg_header(ctrl);
+   if (rv <= 0)
+       return rv;
+   if (ctrl->msg_size > size) {
+       errno = EMSGSIZE;
+       return -1;
+   }
+   while (ctrl->msg_got < ctrl->msg_size) {
+       ctrl->read.crc_on = ctrl->integrity;
+       rv = libvchan_read(ctrl, (char *)data + ctrl->msg_got, ctrl->msg_size - ctrl->msg_got);
+       ctrl->read.crc_on = 0;
+       if (rv <= 0)
+           return rv;
+       ctrl->msg_got += rv;
+   }
+   if (ctrl->integrity) {
+       msg_trailer_t trailer;
+       rv = libvchan_recv(ctrl, &trailer, sizeof(trailer));
+       if (rv <= 0)
+           return rv;
+       if (trailer != (msg_trailer_t)~ctrl->read.crc) {
+           ctrl->msg_header = 0;
+           errno = EBADMSG;
+           return -1;
+       }
+   }
+   ctrl->msg_header = 0;
+   return ctrl->msg_size;
+}
+
+int libvchan_msg_recv_pooled(struct libvchan *ctrl, void **data)
+{
+   void *pool;
+   int rv = msg_header(ctrl);
+   if (rv <= 0)
+       return rv;
+   if (ctrl->msg_size > ctrl->msg_pool_size) {
+       // keep the bytes of a message already partly received
+       pool = realloc(ctrl->msg_pool, ctrl->msg_size);
+       if (!pool)
+           return -1;
+       ctrl->msg_pool = pool;
+       ctrl->msg_pool_size = ctrl->msg_size;
+   }
+   *data = ctrl->msg_pool;
+   return libvchan_msg_recv(ctrl, ctrl->msg_pool, ctrl->msg_pool_size);
+}
@@ -0,0 +1,219 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Event multiplexer for many vchans. All the vchans of a poller have their
+ *  ports bound on one event channel fd; reading it yields the list of ports
+ *  that fired, so finding the ready vchans costs O(ready) rather than a
+ *  select() over one fd per vchan.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+#include <xen/sys/evtchn.h>
+#include "libvchan.h"
+#include "libvchan_private.h"
+
+// ports read from the event channel per read()
+#define PORT_BATCH 256
+
+struct libvchan_poller {
+   /* event channel fd on which all the ports are bound */
+   int fd;
+   /* vchan of each bound port, indexed by port */
+   struct libvchan **ports;
+   unsigned int nports;
+   /* vchans whose port fired but which have not been reported yet */
+   struct libvchan *ready_head, *ready_tail;
+};
+
+struct libvchan_poller *libvchan_poller_create(void)
+{
+   struct libvchan_poller *poller = calloc(1, sizeof(*poller));
+   if (!poller)
+       return NULL;
+   poller->fd = open("/dev/xen/evtchn", O_RDWR | O_NONBLOCK);
+   if (poller->fd < 0) {
+       free(poller);
+       return NULL;
+   }
+   return poller;
+}
+
+void libvchan_poller_destroy(struct libvchan_poller *poller)
+{
+   if (!poller)
+       return;
+   close(poller->fd);
+   free(poller->ports);
+   free(poller);
+}
+
+int libvchan_poller_fd(struct libvchan_poller *poller)
+{
+   return poller->fd;
+}
+
+int vchan_poller_attach(struct libvchan_poller *poller, struct libvchan *ctrl)
+{
+   uint32_t port = ctrl->event_port;
+   struct ioctl_evtchn_unbind unbind;
+   if (port >= poller->nports) {
+       unsigned int n = poller->nports ? poller->nports : 64;
+       struct libvchan **ports;
+       while (n <= port)
+           n *= 2;
+       ports = realloc(poller->ports, n * sizeof(*ports));
+       if (!ports) {
+           // detach cannot find the port, so it would stay bound on the fd
+           unbind.port = port;
+           ioctl(poller->fd, IOCTL_EVTCHN_UNBIND, &unbind);
+           ctrl->event_port = 0;
+           return -1;
+       }
+       memset(ports + poller->nports, 0, (n - poller->nports) * sizeof(*ports));
+       poller->ports = ports;
+       poller->nports = n;
+   }
+   poller->ports[port] = ctrl;
+   ctrl->poll_next = NULL;
+   ctrl->poll_queued = 0;
+   return 0;
+}
+
+void vchan_poller_detach(struct libvchan *ctrl)
+{
+   struct libvchan_poller *poller = ctrl->poller;
+   struct ioctl_evtchn_unbind unbind;
+   struct libvchan *prev = NULL, *cur;
+
+   if (ctrl->event_port >= poller->nports || poller->ports[ctrl->event_port] != ctrl)
+       return;
+   poller->ports[ctrl->event_port] = NULL;
+   unbind.port = ctrl->event_port;
+   ioctl(poller->fd, IOCTL_EVTCHN_UNBIND, &unbind);
+   if (!ctrl->poll_queued)
+       return;
+   for (cur = poller->ready_head; cur; prev = cur, cur = cur->poll_next) {
+       if (cur != ctrl)
+           continue;
+       if (prev)
+           prev->poll_next = cur->poll_next;
+       else
+           poller->ready_head = cur->poll_next;
+       if (poller->ready_tail == ctrl)
+           poller->ready_tail = prev;
+       break;
+   }
+}
+
+static void queue_ready(struct libvchan_poller *poller, struct libvchan *ctrl)
+{
+   if (ctrl->poll_queued)
+       return;
+   ctrl->poll_queued = 1;
+   ctrl->poll_next = NULL;
+   if (poller->ready_tail)
+       poller->ready_tail->poll_next = ctrl;
+   else
+       poller->ready_head = ctrl;
+   poller->ready_tail = ctrl;
+}
+
+/**
+ * Read every pending port, unmask them, and queue their vchans.
+ * returns -1 on error, or 0
+ */
+static int drain_ports(struct libvchan_poller *poller)
+{
+   uint32_t ports[PORT_BATCH];
+   int rv, n, i;
+
+   while (1) {
+       rv = read(poller->fd, ports, sizeof(ports));
+       if (rv < 0)
+           return errno == EAGAIN ? 0 : -1;
+       n = rv / sizeof(ports[0]);
+       if (n == 0)
+           return 0;
+       // a port left masked would never fire again
+       if (write(poller->fd, ports, n * sizeof(ports[0])) != (ssize_t)(n * sizeof(ports[0])))
+           return -1;
+       for (i = 0; i < n; i++) {
+           if (ports[i] < poller->nports && poller->ports[ports[i]])
+               queue_ready(poller, poller->ports[ports[i]]);
+       }
+       if (n < PORT_BATCH)
+           return 0;
+   }
+}
+
+/**
+ * State of a vchan as seen from its shared page, without asking the peer
+ * for any notification.
+ */
+static int vchan_events(struct libvchan *ctrl)
+{
+   int events = 0;
+   if (!libvchan_is_open(ctrl))
+       return VCHAN_POLL_CLOSED;
+   if (__atomic_load_n(ctrl->read.prod, __ATOMIC_ACQUIRE) != ctrl->read.local)
+       events |= VCHAN_POLL_READ;
+   if (ctrl->write.local - __atomic_load_n(ctrl->write.cons, __ATOMIC_ACQUIRE) <
+       (1U << ctrl->write.order))
+       events |= VCHAN_POLL_WRITE;
+   return events;
+}
+
+int libvchan_poller_wait(struct libvchan_poller *poller, struct libvchan_event *events,
+                         int max, int timeout_ms)
+{
+   struct pollfd pfd;
+   struct libvchan *ctrl;
+   int n = 0, rv;
+
+   if (!poller->ready_head) {
+       pfd.fd = poller->fd;
+       pfd.events = POLLIN;
+       rv = poll(&pfd, 1, timeout_ms);
+       if (rv <= 0)
+           return rv;
+   }
+   if (drain_ports(poller))
+       return -1;
+   while (n < max && poller->ready_head) {
+       ctrl = poller->ready_head;
+       poller->ready_head = ctrl->poll_next;
+       if (!poller->ready_head)
+           poller->ready_tail = NULL;
+       ctrl->poll_queued = 0;
+       events[n].ctrl = ctrl;
+       events[n].events = vchan_events(ctrl);
+       if (events[n].events)
+           n++;
+   }
+   return n;
+}
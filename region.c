@@ -0,0 +1,354 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Registered memory regions, for bulk transfers that bypass the rings. One
+ *  side allocates and grants a region, sends its descriptor over the vchan,
+ *  and the peer maps it and reads or writes it directly, so the data is
+ *  copied once rather than into and out of a ring. Peer mappings are cached
+ *  per vchan so that repeated transfers to the same region do not remap it.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "libvchan.h"
+#include "libvchan_private.h"
+
+// largest region: VCHAN_REGION_MAX_REFS indirect pages of grants
+#define MAX_REGION_SIZE ((size_t)VCHAN_REGION_MAX_REFS * GRANTS_PER_PAGE * PAGE_SIZE)
+
+static uint32_t next_region_id;
+
+static size_t page_round(size_t size)
+{
+   return (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+static int alloc_xen(struct libvchan *ctrl, struct libvchan_region *region)
+{
+   int pages = region->length >> PAGE_SHIFT;
+   int indirect = (pages + GRANTS_PER_PAGE - 1) / GRANTS_PER_PAGE;
+   int fd = open("/dev/xen/gntalloc", O_RDWR);
+   if (fd < 0)
+       return -1;
+   region->indirect = vchan_gnt_alloc_pages(fd, ctrl->other_domain_id, region->desc.refs, indirect);
+   if (!region->indirect)
+       goto out;
+   region->addr = vchan_gnt_alloc_pages(fd, ctrl->other_domain_id, region->indirect, pages);
+   if (!region->addr) {
+       munmap(region->indirect, indirect * PAGE_SIZE);
+       region->indirect = NULL;
+       goto out;
+   }
+   region->desc.nrefs = indirect;
+ out:
+   close(fd);
+   return region->addr ? 0 : -1;
+}
+
+static int alloc_local(struct libvchan_region *region)
+{
+   region->fd = memfd_create("libvchan-region", MFD_CLOEXEC);
+   if (region->fd < 0)
+       return -1;
+   if (ftruncate(region->fd, region->length))
+       return -1;
+   region->addr = mmap(NULL, region->length, PROT_READ | PROT_WRITE, MAP_SHARED, region->fd, 0);
+   if (region->addr == MAP_FAILED) {
+       region->addr = NULL;
+       return -1;
+   }
+   region->desc.owner = getpid();
+   region->desc.nrefs = 1;
+   region->desc.refs[0] = region->fd;
+   return 0;
+}
+
+struct libvchan_region *libvchan_region_alloc(struct libvchan *ctrl, size_t size, int backend)
+{
+   struct libvchan_region *region;
+   int rv;
+
+   if (size == 0 || size > MAX_REGION_SIZE)
+       return NULL;
+   if (backend != VCHAN_REGION_XEN && (backend != VCHAN_REGION_LOCAL || !ctrl->local_regions))
+       return NULL;
+   region = calloc(1, sizeof(*region));
+   if (!region)
+       return NULL;
+   region->fd = -1;
+   region->length = page_round(size);
+   region->desc.magic = VCHAN_REGION_MAGIC;
+   region->desc.backend = backend;
+   region->desc.id = __atomic_add_fetch(&next_region_id, 1, __ATOMIC_RELAXED);
+   region->desc.size = size;
+
+   if (backend == VCHAN_REGION_XEN)
+       rv = alloc_xen(ctrl, region);
+   else
+       rv = alloc_local(region);
+   if (rv) {
+       libvchan_region_free(region);
+       return NULL;
+   }
+   return region;
+}
+
+static void region_release(struct libvchan_region *region)
+{
+   if (region->addr)
+       munmap(region->addr, region->length);
+   if (region->indirect) {
+       int pages = region->length >> PAGE_SHIFT;
+       munmap(region->indirect, (pages + GRANTS_PER_PAGE - 1) / GRANTS_PER_PAGE * PAGE_SIZE);
+   }
+   if (region->fd != -1)
+       close(region->fd);
+   free(region);
+}
+
+void libvchan_region_allow_local(struct libvchan *ctrl, int allow)
+{
+   ctrl->local_regions = !!allow;
+}
+
+void libvchan_region_free(struct libvchan_region *region)
+{
+   if (region)
+       region_release(region);
+}
+
+int libvchan_region_send(struct libvchan *ctrl, struct libvchan_region *region)
+{
+   if (region->remote)
+       return -1;
+   return libvchan_send(ctrl, &region->desc, sizeof(region->desc));
+}
+
+struct libvchan_region *libvchan_region_recv(struct libvchan *ctrl)
+{
+   struct libvchan_region_desc desc;
+   int rv = libvchan_recv(ctrl, &desc, sizeof(desc));
+   if (rv != sizeof(desc))
+       return NULL;
+   return libvchan_region_map(ctrl, &desc);
+}
+
+static int map_xen(struct libvchan *ctrl, struct libvchan_region *region)
+{
+   int pages = region->length >> PAGE_SHIFT;
+   int indirect = region->desc.nrefs;
+   uint32_t *refs;
+   int fd;
+
+   if (indirect != (pages + GRANTS_PER_PAGE - 1) / GRANTS_PER_PAGE)
+       return -1;
+   fd = open("/dev/xen/gntdev", O_RDWR);
+   if (fd < 0)
+       return -1;
+   // the list of data page grants is only needed while mapping them
+   refs = vchan_gnt_map_pages(fd, ctrl->other_domain_id, region->desc.refs, indirect);
+   if (refs) {
+       region->addr = vchan_gnt_map_pages(fd, ctrl->other_domain_id, refs, pages);
+       munmap(refs, indirect * PAGE_SIZE);
+   }
+   close(fd);
+   return region->addr ? 0 : -1;
+}
+
+static int map_local(struct libvchan_region *region)
+{
+   char path[64];
+   int fd;
+
+   snprintf(path, sizeof(path), "/proc/%u/fd/%u", region->desc.owner, region->desc.refs[0]);
+   fd = open(path, O_RDWR | O_CLOEXEC);
+   if (fd < 0)
+       return -1;
+   region->addr = mmap(NULL, region->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (region->addr == MAP_FAILED) {
+       region->addr = NULL;
+       return -1;
+   }
+   return 0;
+}
+
+static void cache_unlink(struct libvchan *ctrl, struct libvchan_region *region)
+{
+   if (region->prev)
+       region->prev->next = region->next;
+   else
+       ctrl->regions = region->next;
+   if (region->next)
+       region->next->prev = region->prev;
+   region->prev = region->next = NULL;
+   ctrl->nregions--;
+}
+
+static void cache_push(struct libvchan *ctrl, struct libvchan_region *region)
+{
+   region->prev = NULL;
+   region->next = ctrl->regions;
+   if (ctrl->regions)
+       ctrl->regions->prev = region;
+   ctrl->regions = region;
+   ctrl->nregions++;
+}
+
+/**
+ * Unmap the least recently used regions that are not in use until at most
+ * VCHAN_REGION_CACHE remain.
+ */
+static void cache_trim(struct libvchan *ctrl)
+{
+   struct libvchan_region *region, *prev;
+
+   region = ctrl->regions;
+   while (region && region->next)
+       region = region->next;
+   for (; region && ctrl->nregions > VCHAN_REGION_CACHE; region = prev) {
+       prev = region->prev;
+       if (region->users)
+           continue;
+       cache_unlink(ctrl, region);
+       region_release(region);
+   }
+}
+
+/**
+ * Whether a cached mapping is of the region desc describes. Ids restart
+ * with the peer, so a reconnected peer reuses them for new grants; the refs
+ * tell those apart from the stale ones.
+ */
+static int desc_matches(const struct libvchan_region_desc *cached,
+                        const struct libvchan_region_desc *desc)
+{
+   return cached->id == desc->id && cached->owner == desc->owner &&
+          cached->backend == desc->backend && cached->size == desc->size &&
+          cached->nrefs == desc->nrefs &&
+          !memcmp(cached->refs, desc->refs, desc->nrefs * sizeof(desc->refs[0]));
+}
+
+struct libvchan_region *libvchan_region_map(struct libvchan *ctrl, const struct libvchan_region_desc *desc)
+{
+   struct libvchan_region *region;
+   int rv;
+
+   if (desc->magic != VCHAN_REGION_MAGIC || desc->size == 0 || desc->size > MAX_REGION_SIZE)
+       return NULL;
+   if (desc->nrefs == 0 || desc->nrefs > VCHAN_REGION_MAX_REFS)
+       return NULL;
+   // a local descriptor lets the peer pick any pid and fd of this host
+   if (desc->backend == VCHAN_REGION_LOCAL && !ctrl->local_regions)
+       return NULL;
+   for (region = ctrl->regions; region; region = region->next) {
+       if (desc_matches(&region->desc, desc)) {
+           cache_unlink(ctrl, region);
+           cache_push(ctrl, region);
+           region->users++;
+           return region;
+       }
+   }
+
+   region = calloc(1, sizeof(*region));
+   if (!region)
+       return NULL;
+   region->desc = *desc;
+   region->fd = -1;
+   region->remote = 1;
+   region->length = page_round(desc->size);
+   if (desc->backend == VCHAN_REGION_XEN)
+       rv = map_xen(ctrl, region);
+   else if (desc->backend == VCHAN_REGION_LOCAL)
+       rv = map_local(region);
+   else
+       rv = -1;
+   if (rv) {
+       region_release(region);
+       return NULL;
+   }
+   region->users = 1;
+   cache_push(ctrl, region);
+   cache_trim(ctrl);
+   return region;
+}
+
+void libvchan_region_unmap(struct libvchan *ctrl, struct libvchan_region *region)
+{
+   if (!region || !region->remote || region->users == 0)
+       return;
+   region->users--;
+   cache_trim(ctrl);
+}
+
+void libvchan_region_cache_flush(struct libvchan *ctrl)
+{
+   struct libvchan_region *region, *next;
+
+   for (region = ctrl->regions; region; region = next) {
+       next = region->next;
+       if (region->users)
+           continue;
+       cache_unlink(ctrl, region);
+       region_release(region);
+   }
+}
+
+void vchan_region_cache_free(struct libvchan *ctrl)
+{
+   struct libvchan_region *region, *next;
+
+   for (region = ctrl->regions; region; region = next) {
+       next = region->next;
+       region_release(region);
+   }
+   ctrl->regions = NULL;
+   ctrl->nregions = 0;
+}
+
+int libvchan_region_put(struct libvchan *ctrl, struct libvchan_region *region,
+                        size_t offset, const void *data, size_t size)
+{
+   if (offset > region->desc.size || size > region->desc.size - offset)
+       return -1;
+   // the peer reads this after a later message, whose index update is a
+   // release store; the non-temporal kernels fence their own stores
+   if (size >= ctrl->copy.nt_threshold)
+       ctrl->copy.copy_nt(region->addr + offset, data, size);
+   else
+       ctrl->copy.copy(region->addr + offset, data, size);
+   return size;
+}
+
+int libvchan_region_get(struct libvchan *ctrl, struct libvchan_region *region,
+                        size_t offset, void *data, size_t size)
+{
+   if (offset > region->desc.size || size > region->desc.size - offset)
+       return -1;
+   ctrl->copy.copy(data, region->addr + offset, size);
+   return size;
+}
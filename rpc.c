@@ -0,0 +1,213 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Pipelined RPC over one vchan. Requests and replies are framed messages
+ *  carrying a call id. The caller keeps up to a window of calls outstanding
+ *  instead of waiting a round trip per call, and each reply is matched to
+ *  its call by id, in whatever order the server sends them.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libvchan.h"
+
+// iovecs of a framed message, less the one for the call header
+#define RPC_IOV_MAX 63
+// the low bits of a call id are its slot, the high bits count slot reuses;
+// one bit less than the rest keeps ids positive as int return values
+#define SLOT_BITS 16
+#define GEN_BITS 15
+
+struct rpc_header {
+   uint32_t id;
+   /* server's status for a reply, 0 for a request */
+   int32_t status;
+};
+
+struct rpc_slot {
+   libvchan_rpc_cb cb;
+   void *arg;
+   uint16_t gen;
+   int busy;
+};
+
+struct libvchan_rpc {
+   struct libvchan *ctrl;
+   unsigned int window, outstanding;
+   struct rpc_slot *slots;
+   /* stack of free slot numbers */
+   unsigned int *free_slots;
+   unsigned int nfree;
+};
+
+struct libvchan_rpc *libvchan_rpc_create(struct libvchan *ctrl, unsigned int window)
+{
+   struct libvchan_rpc *rpc;
+   unsigned int i;
+
+   if (window == 0 || window > 1U << SLOT_BITS)
+       return NULL;
+   rpc = calloc(1, sizeof(*rpc));
+   if (!rpc)
+       return NULL;
+   rpc->slots = calloc(window, sizeof(*rpc->slots));
+   rpc->free_slots = calloc(window, sizeof(*rpc->free_slots));
+   if (!rpc->slots || !rpc->free_slots) {
+       libvchan_rpc_destroy(rpc);
+       return NULL;
+   }
+   for (i = 0; i < window; i++)
+       rpc->free_slots[i] = window - 1 - i;
+   rpc->nfree = window;
+   rpc->window = window;
+   rpc->ctrl = ctrl;
+   ctrl->blocking = 1;
+   return rpc;
+}
+
+void libvchan_rpc_destroy(struct libvchan_rpc *rpc)
+{
+   if (!rpc)
+       return;
+   free(rpc->slots);
+   free(rpc->free_slots);
+   free(rpc);
+}
+
+/**
+ * Receive one framed message without waiting for it unless wait is set.
+ * returns 0 if there is none yet, -1 on error, or its size
+ */
+static int rpc_recv(struct libvchan_rpc *rpc, void **data, int wait)
+{
+   int rv;
+   rpc->ctrl->blocking = wait;
+   rv = libvchan_msg_recv_pooled(rpc->ctrl, data);
+   rpc->ctrl->blocking = 1;
+   return rv;
+}
+
+int libvchan_rpc_poll(struct libvchan_rpc *rpc, int wait)
+{
+   struct rpc_header *header;
+   struct rpc_slot *slot;
+   void *data;
+   unsigned int n_slot;
+   int size, n = 0;
+
+   while (rpc->outstanding) {
+       size = rpc_recv(rpc, &data, wait && n == 0);
+       if (size < 0)
+           return -1;
+       if (size == 0)
+           break;
+       if (size < sizeof(*header))
+           return -1;
+       header = data;
+       n_slot = header->id & ((1U << SLOT_BITS) - 1);
+       if (n_slot >= rpc->window)
+           return -1;
+       slot = &rpc->slots[n_slot];
+       if (!slot->busy || slot->gen != header->id >> SLOT_BITS)
+           return -1;
+       slot->busy = 0;
+       rpc->free_slots[rpc->nfree++] = n_slot;
+       rpc->outstanding--;
+       if (slot->cb)
+           slot->cb(slot->arg, header->status, header + 1, size - sizeof(*header));
+       n++;
+   }
+   return n;
+}
+
+int libvchan_rpc_call(struct libvchan_rpc *rpc, const struct iovec *iov, int iovcnt,
+                      libvchan_rpc_cb cb, void *arg)
+{
+   struct iovec v[RPC_IOV_MAX + 1];
+   struct rpc_header header;
+   struct rpc_slot *slot;
+   unsigned int n;
+
+   if (iovcnt < 0 || iovcnt > RPC_IOV_MAX)
+       return -1;
+   // wait for a reply while the window is full, and otherwise take the
+   // replies that are there, so that the server is never stuck sending them
+   if (libvchan_rpc_poll(rpc, rpc->nfree == 0) < 0)
+       return -1;
+   n = rpc->free_slots[--rpc->nfree];
+   slot = &rpc->slots[n];
+   slot->gen = (slot->gen + 1) & ((1U << GEN_BITS) - 1);
+   slot->cb = cb;
+   slot->arg = arg;
+   slot->busy = 1;
+   header.id = (uint32_t)slot->gen << SLOT_BITS | n;
+   header.status = 0;
+   v[0].iov_base = &header;
+   v[0].iov_len = sizeof(header);
+   if (iovcnt)
+       memcpy(v + 1, iov, iovcnt * sizeof(*iov));
+   if (libvchan_msg_sendv(rpc->ctrl, v, iovcnt + 1) <= 0) {
+       slot->busy = 0;
+       rpc->free_slots[rpc->nfree++] = n;
+       return -1;
+   }
+   rpc->outstanding++;
+   return header.id;
+}
+
+int libvchan_rpc_wait_all(struct libvchan_rpc *rpc)
+{
+   while (rpc->outstanding)
+       if (libvchan_rpc_poll(rpc, 1) < 0)
+           return -1;
+   return 0;
+}
+
+int libvchan_rpc_recv(struct libvchan_rpc *rpc, uint32_t *id, void **data)
+{
+   struct rpc_header *header;
+   void *msg;
+   int size = rpc_recv(rpc, &msg, 1);
+   if (size < (int)sizeof(*header))
+       return -1;
+   header = msg;
+   *id = header->id;
+   *data = header + 1;
+   return size - sizeof(*header);
+}
+
+int libvchan_rpc_reply(struct libvchan_rpc *rpc, uint32_t id, int status,
+                       const struct iovec *iov, int iovcnt)
+{
+   struct iovec v[RPC_IOV_MAX + 1];
+   struct rpc_header header;
+
+   if (iovcnt < 0 || iovcnt > RPC_IOV_MAX)
+       return -1;
+   header.id = id;
+   header.status = status;
+   v[0].iov_base = &header;
+   v[0].iov_len = sizeof(header);
+   if (iovcnt)
+       memcpy(v + 1, iov, iovcnt * sizeof(*iov));
+   return libvchan_msg_sendv(rpc->ctrl, v, iovcnt + 1) > 0 ? 0 : -1;
+}
@@ -0,0 +1,358 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * @section DESCRIPTION
+ *
+ *  Disk sink: data received on a vchan is written to a file opened with
+ *  O_DIRECT straight from the pages of the read ring, through io_uring, with
+ *  several writes in flight. The data is only consumed from the ring, and
+ *  its space handed back to the sender, as the writes covering it complete.
+ *  O_DIRECT wants aligned buffers, lengths and offsets, so the sender pads
+ *  the stream to SINK_ALIGN bytes of the ring around each file.
+ *
+ *  io_uring is driven with raw system calls, so there is no library to link;
+ *  with kernel headers that predate it, libvchan_sink_create() fails.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "libvchan.h"
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
+// O_DIRECT alignment of buffers, lengths and file offsets
+#define SINK_ALIGN 4096
+
+int libvchan_sink_pad(struct libvchan *ctrl)
+{
+   static const char zero[SINK_ALIGN];
+   size_t pad = -ctrl->write.local & (SINK_ALIGN - 1);
+   int rv;
+   if (ctrl->write.order < 12)
+       return -1;
+   while (pad) {
+       rv = libvchan_write(ctrl, zero, pad);
+       if (rv <= 0)
+           return -1;
+       pad -= rv;
+   }
+   return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+/* one write in flight, covering len bytes of the ring */
+struct sink_slot {
+   struct iovec iov;
+   off_t offset;
+   size_t len;
+   int done;
+};
+
+struct libvchan_sink {
+   struct libvchan *ctrl;
+   int ring_fd;
+   unsigned int depth;
+   size_t chunk;
+   /* submission queue */
+   void *sq_map;
+   size_t sq_map_size;
+   unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+   struct io_uring_sqe *sqes;
+   size_t sqes_size;
+   /* completion queue, which may share the submission queue's mapping */
+   void *cq_map;
+   size_t cq_map_size;
+   unsigned *cq_head, *cq_tail, *cq_mask;
+   struct io_uring_cqe *cqes;
+   /* writes in submission order: head is the oldest in flight */
+   struct sink_slot *slots;
+   unsigned int head, inflight;
+   /* submissions queued but not yet passed to the kernel */
+   unsigned int to_submit;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+   return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+   return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+void libvchan_sink_destroy(struct libvchan_sink *sink)
+{
+   if (!sink)
+       return;
+   if (sink->sqes)
+       munmap(sink->sqes, sink->sqes_size);
+   if (sink->cq_map && sink->cq_map != sink->sq_map)
+       munmap(sink->cq_map, sink->cq_map_size);
+   if (sink->sq_map)
+       munmap(sink->sq_map, sink->sq_map_size);
+   if (sink->ring_fd >= 0)
+       close(sink->ring_fd);
+   free(sink->slots);
+   free(sink);
+}
+
+static int map_rings(struct libvchan_sink *sink, struct io_uring_params *p)
+{
+   sink->sq_map_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+   sink->cq_map_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+   if (p->features & IORING_FEAT_SINGLE_MMAP) {
+       if (sink->cq_map_size > sink->sq_map_size)
+           sink->sq_map_size = sink->cq_map_size;
+       sink->cq_map_size = sink->sq_map_size;
+   }
+   sink->sq_map = mmap(NULL, sink->sq_map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_SQ_RING);
+   if (sink->sq_map == MAP_FAILED) {
+       sink->sq_map = NULL;
+       return -1;
+   }
+   if (p->features & IORING_FEAT_SINGLE_MMAP) {
+       sink->cq_map = sink->sq_map;
+   } else {
+       sink->cq_map = mmap(NULL, sink->cq_map_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_CQ_RING);
+       if (sink->cq_map == MAP_FAILED) {
+           sink->cq_map = NULL;
+           return -1;
+       }
+   }
+   sink->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+   sink->sqes = mmap(NULL, sink->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_SQES);
+   if (sink->sqes == MAP_FAILED) {
+       sink->sqes = NULL;
+       return -1;
+   }
+   sink->sq_head = sink->sq_map + p->sq_off.head;
+   sink->sq_tail = sink->sq_map + p->sq_off.tail;
+   sink->sq_mask = sink->sq_map + p->sq_off.ring_mask;
+   sink->sq_array = sink->sq_map + p->sq_off.array;
+   sink->cq_head = sink->cq_map + p->cq_off.head;
+   sink->cq_tail = sink->cq_map + p->cq_off.tail;
+   sink->cq_mask = sink->cq_map + p->cq_off.ring_mask;
+   sink->cqes = sink->cq_map + p->cq_off.cqes;
+   return 0;
+}
+
+struct libvchan_sink *libvchan_sink_create(struct libvchan *ctrl, unsigned int depth, size_t chunk)
+{
+   struct libvchan_sink *sink;
+   struct io_uring_params p;
+
+   // writes come straight from ring pages, which must be whole and not shared
+   if (ctrl->read.order < 12 || ctrl->sync || ctrl->poller || depth == 0 ||
+       chunk < SINK_ALIGN || chunk % SINK_ALIGN) {
+       errno = EINVAL;
+       return NULL;
+   }
+   sink = calloc(1, sizeof(*sink));
+   if (!sink)
+       return NULL;
+   sink->ring_fd = -1;
+   sink->slots = calloc(depth, sizeof(*sink->slots));
+   if (!sink->slots)
+       goto err;
+   memset(&p, 0, sizeof(p));
+   sink->ring_fd = uring_setup(depth, &p);
+   if (sink->ring_fd < 0 || map_rings(sink, &p))
+       goto err;
+   sink->ctrl = ctrl;
+   sink->depth = depth;
+   sink->chunk = chunk;
+   ctrl->blocking = 1;
+   return sink;
+err:
+   libvchan_sink_destroy(sink);
+   return NULL;
+}
+
+/** Queue a write of slot n; the kernel sees it at the next uring_enter() */
+static void queue_write(struct libvchan_sink *sink, int fd, unsigned int n)
+{
+   struct sink_slot *slot = &sink->slots[n];
+   unsigned tail = *sink->sq_tail;
+   unsigned idx = tail & *sink->sq_mask;
+   struct io_uring_sqe *sqe = &sink->sqes[idx];
+
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = IORING_OP_WRITEV;
+   sqe->fd = fd;
+   sqe->addr = (unsigned long)&slot->iov;
+   sqe->len = 1;
+   sqe->off = slot->offset;
+   sqe->user_data = n;
+   sink->sq_array[idx] = idx;
+   __atomic_store_n(sink->sq_tail, tail + 1, __ATOMIC_RELEASE);
+   sink->to_submit++;
+}
+
+/**
+ * Take the completed writes, requeueing the rest of short ones. Returns the
+ * bytes of the ring that may be released, as the oldest writes are done,
+ * failed ones included; the errno of the first write to fail is stored in
+ * *error unless it already holds one.
+ */
+static size_t reap_writes(struct libvchan_sink *sink, int fd, int *error)
+{
+   unsigned head = *sink->cq_head;
+   unsigned tail = __atomic_load_n(sink->cq_tail, __ATOMIC_ACQUIRE);
+   size_t released = 0;
+
+   for (; head != tail; head++) {
+       struct io_uring_cqe *cqe = &sink->cqes[head & *sink->cq_mask];
+       struct sink_slot *slot = &sink->slots[cqe->user_data];
+       if (cqe->res <= 0) {
+           if (!*error)
+               *error = cqe->res < 0 ? -cqe->res : EIO;
+       } else if ((size_t)cqe->res < slot->iov.iov_len) {
+           slot->iov.iov_base += cqe->res;
+           slot->iov.iov_len -= cqe->res;
+           slot->offset += cqe->res;
+           queue_write(sink, fd, cqe->user_data);
+           continue;
+       }
+       slot->done = 1;
+   }
+   __atomic_store_n(sink->cq_head, head, __ATOMIC_RELEASE);
+   // writes may complete out of order; the ring is consumed in order
+   while (sink->inflight && sink->slots[sink->head].done) {
+       released += sink->slots[sink->head].len;
+       sink->slots[sink->head].done = 0;
+       sink->head = (sink->head + 1) % sink->depth;
+       sink->inflight--;
+   }
+   return released;
+}
+
+ssize_t libvchan_sink_write(struct libvchan_sink *sink, int fd, off_t offset, size_t len)
+{
+   struct libvchan *ctrl = sink->ctrl;
+   size_t ring_size = (size_t)1 << ctrl->read.order;
+   size_t total = (len + SINK_ALIGN - 1) & ~(size_t)(SINK_ALIGN - 1);
+   size_t pad = -ctrl->read.local & (SINK_ALIGN - 1);
+   size_t submitted = 0, released = 0, done;
+   char scratch[SINK_ALIGN];
+   ssize_t rv;
+   int error = 0;
+
+   if (offset % SINK_ALIGN) {
+       errno = EINVAL;
+       return -1;
+   }
+   // skip the sender's padding up to an aligned ring offset
+   if (pad && libvchan_recv(ctrl, scratch, pad) != (int)pad)
+       return -1;
+
+   while (released < total) {
+       while (!error && sink->inflight < sink->depth && submitted < total) {
+           size_t pending = submitted - released;
+           int ready = libvchan_data_ready(ctrl);
+           size_t pos = (ctrl->read.local + pending) & (ring_size - 1);
+           size_t n = ready - pending;
+           unsigned int slot;
+           if (n > total - submitted)
+               n = total - submitted;
+           if (n > sink->chunk)
+               n = sink->chunk;
+           if (n > ring_size - pos)
+               n = ring_size - pos;
+           n &= ~(size_t)(SINK_ALIGN - 1);
+           if (n == 0)
+               break;
+           slot = (sink->head + sink->inflight) % sink->depth;
+           sink->slots[slot].iov.iov_base = ctrl->read.buffer + pos;
+           sink->slots[slot].iov.iov_len = n;
+           sink->slots[slot].offset = offset + submitted;
+           sink->slots[slot].len = n;
+           queue_write(sink, fd, slot);
+           sink->inflight++;
+           submitted += n;
+       }
+       if (sink->inflight) {
+           // pass on the new writes and wait for at least one to complete
+           rv = uring_enter(sink->ring_fd, sink->to_submit, 1, IORING_ENTER_GETEVENTS);
+           if (rv < 0 && errno != EINTR)
+               return -1;
+           if (rv > 0)
+               sink->to_submit -= rv;
+           // after an error, what completed is still handed back while the
+           // writes in flight drain
+           done = reap_writes(sink, fd, &error);
+           if (done && libvchan_read_release(ctrl, done) < 0)
+               return -1;
+           released += done;
+       } else if (error) {
+           errno = error;
+           return -1;
+       } else {
+           // less than an aligned block is ready: wait for the sender
+           if (libvchan_data_ready(ctrl) >= SINK_ALIGN)
+               continue;
+           if (!libvchan_is_open(ctrl) || libvchan_wait(ctrl)) {
+               errno = EPIPE;
+               return -1;
+           }
+       }
+   }
+   // the failed writes may have been the last ones
+   if (error) {
+       errno = error;
+       return -1;
+   }
+   // the last block was written whole, padding included
+   if (len != total && ftruncate(fd, offset + len))
+       return -1;
+   return len;
+}
+
+#else
+
+struct libvchan_sink *libvchan_sink_create(struct libvchan *ctrl, unsigned int depth, size_t chunk)
+{
+   errno = ENOSYS;
+   return NULL;
+}
+
+void libvchan_sink_destroy(struct libvchan_sink *sink)
+{
+}
+
+ssize_t libvchan_sink_write(struct libvchan_sink *sink, int fd, off_t offset, size_t len)
+{
+   errno = ENOSYS;
+   return -1;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/**
+ * Daemon serving remote file I/O over vchans: each client that connects on
+ * the given node may open files in the given directory, and read and write
+ * them with libvchan_fio. Clients are served one after the other.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "libvchan.h"
+
+void usage(char** argv)
+{
+       fprintf(stderr, "usage:\n"
+               "%s domid nodeid read_buffer_size write_buffer_size directory\n",
+               argv[0]);
+       exit(1);
+}
+
+int main(int argc, char **argv)
+{
+       struct libvchan *ctrl;
+       int domid, nodeid, dirfd;
+
+       if (argc < 6)
+               usage(argv);
+       domid = atoi(argv[1]);
+       nodeid = atoi(argv[2]);
+       dirfd = open(argv[5], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+       if (dirfd < 0) {
+               perror(argv[5]);
+               exit(1);
+       }
+
+       while (1) {
+               ctrl = libvchan_server_init(domid, nodeid, atoi(argv[3]), atoi(argv[4]));
+               if (!ctrl) {
+                       perror("libvchan_server_init");
+                       exit(1);
+               }
+               if (libvchan_fio_serve(ctrl, dirfd))
+                       perror("libvchan_fio_serve");
+               libvchan_close(ctrl);
+       }
+       return 0;
+}